@@ -0,0 +1,798 @@
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+double bench_msec(clock_t begin)
+{
+    return (double)(clock() - begin) * 1000 / CLOCKS_PER_SEC;
+}
+
+/* wall-clock time, for things that run in child processes */
+double bench_wall_msec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+void bench_report(const char *name, double msec)
+{
+    printf("%-32s %10.2f ms\n", name, msec);
+}
+
+/*
+Build a program of roughly ntokens tokens. Each statement is a chain of 50
+additions so that neither the statement list nor the expressions get deep.
+*/
+char *bench_make_source(int ntokens, size_t *size)
+{
+    char *src, *p;
+    int i, nstmts = ntokens / 100 + 1;
+
+    src = (char *)malloc(nstmts * 100 * 2 + 1);
+    assert(src != NULL);
+    for (p = src; nstmts > 0; nstmts--) {
+        for (i = 0; i < 49; i++) {
+            *p++ = '1' + i % 9;
+            *p++ = '+';
+        }
+        *p++ = '1';
+        *p++ = ';';
+    }
+    *p = '\0';
+    *size = p - src;
+
+    return src;
+}
+
+/* the previous token representation: one malloc'd node per token */
+typedef struct BenchToken {
+    int kind;
+    TokenValue value;
+    struct BenchToken *next;
+} BenchToken;
+
+void bench_token_list(int ntokens)
+{
+    Arena *arena;
+    TokenList *tokens;
+    BenchToken *head = NULL, *tail = NULL, *token;
+    char *src;
+    size_t size;
+    clock_t begin;
+    long sum = 0;
+    int i;
+
+    src = bench_make_source(ntokens, &size);
+    arena = new_arena();
+    tokens = tokenize_buffer(arena, NULL, src, size);
+    assert(tokens != NULL);
+    printf("%d tokens\n", tokens->size);
+
+    begin = clock();
+    for (i = 0; i < tokens->size; i++) {
+        token = (BenchToken *)malloc(sizeof(BenchToken));
+        assert(token != NULL);
+        token->kind = tokens->kind[i];
+        token->value = tokens->value[i];
+        token->next = NULL;
+        if (tail != NULL) tail->next = token;
+        tail = token;
+        if (head == NULL) head = tail;
+    }
+    bench_report("linked list: build", bench_msec(begin));
+
+    begin = clock();
+    for (token = head; token != NULL; token = token->next)
+        if (token->kind == tINTEGER) sum += token->value.ival;
+    bench_report("linked list: walk", bench_msec(begin));
+
+    begin = clock();
+    while (head != NULL) {
+        token = head;
+        head = head->next;
+        free(token);
+    }
+    bench_report("linked list: free", bench_msec(begin));
+
+    free_arena(arena);
+
+    arena = new_arena();
+    begin = clock();
+    tokens = tokenize_buffer(arena, NULL, src, size);
+    bench_report("token array: tokenize", bench_msec(begin));
+
+    begin = clock();
+    for (i = 0; i < tokens->size; i++)
+        if (tokens->kind[i] == tINTEGER) sum -= tokens->value[i].ival;
+    bench_report("token array: walk", bench_msec(begin));
+    assert(sum == 0);
+
+    begin = clock();
+    free_arena(arena);
+    bench_report("token array: free", bench_msec(begin));
+
+    free(src);
+}
+
+void bench_parse(int ntokens)
+{
+    Arena *arena;
+    TokenList *tokens;
+    AST *prog;
+    char *src;
+    size_t size;
+    clock_t begin;
+
+    src = bench_make_source(ntokens, &size);
+    arena = new_arena();
+    tokens = tokenize_buffer(arena, NULL, src, size);
+    assert(tokens != NULL);
+
+    begin = clock();
+    prog = parse(tokens, arena, NULL, false);
+    bench_report("parse", bench_msec(begin));
+    assert(prog != NULL);
+    printf("arena: %lu bytes used, %lu bytes peak\n",
+           (unsigned long)arena->used, (unsigned long)arena->peak);
+
+    begin = clock();
+    free_arena(arena);
+    bench_report("free", bench_msec(begin));
+
+    free(src);
+}
+
+/* Write a balanced expression tree of the given depth over literals. */
+void bench_write_tree(FILE *fh, int depth)
+{
+    static const char ops[] = "+-*/";
+    int op = rand() % 4;
+
+    if (depth == 0) {
+        if (rand() % 2)
+            fprintf(fh, "%d", rand() % 9 + 1);
+        else
+            fprintf(fh, "%d.5", rand() % 9);
+        return;
+    }
+
+    fputc('(', fh);
+    bench_write_tree(fh, depth - 1);
+    fprintf(fh, " %c ", ops[op]);
+    /* divide only by non-zero literals so that idiv never traps */
+    bench_write_tree(fh, op == 3 ? 0 : depth - 1);
+    fputc(')', fh);
+}
+
+/* the naive evaluator: a recursive walk over the tree */
+BCValue bench_eval_tree(AST *ast)
+{
+    BCValue lhs, rhs, ret;
+
+    if (ast->kind == AST_LITERAL) {
+        if (ast->type.kind == TY_DOUBLE)
+            ret.fval = ast->fval;
+        else
+            ret.ival = ast->ival;
+        return ret;
+    }
+
+    lhs = bench_eval_tree(ast->lhs);
+    rhs = bench_eval_tree(ast->rhs);
+    if (ast->type.kind == TY_LONG) {
+        switch (ast->kind) {
+            case AST_ADD:
+                ret.ival = (unsigned long)lhs.ival + rhs.ival;
+                break;
+            case AST_SUB:
+                ret.ival = (unsigned long)lhs.ival - rhs.ival;
+                break;
+            case AST_MUL:
+                ret.ival = (unsigned long)lhs.ival * rhs.ival;
+                break;
+            case AST_DIV:
+                ret.ival = lhs.ival / rhs.ival;
+                break;
+            default:
+                assert(false);
+        }
+        return ret;
+    }
+
+    if (ast->lhs->type.kind == TY_LONG) lhs.fval = lhs.ival;
+    if (ast->rhs->type.kind == TY_LONG) rhs.fval = rhs.ival;
+    switch (ast->kind) {
+        case AST_ADD:
+            ret.fval = lhs.fval + rhs.fval;
+            break;
+        case AST_SUB:
+            ret.fval = lhs.fval - rhs.fval;
+            break;
+        case AST_MUL:
+            ret.fval = lhs.fval * rhs.fval;
+            break;
+        case AST_DIV:
+            ret.fval = lhs.fval / rhs.fval;
+            break;
+        default:
+            assert(false);
+    }
+    return ret;
+}
+
+/*
+Compare the bytecode interpreter with a recursive walk over the same
+deep expression trees, as statements per second.
+*/
+void bench_interp(int nstmts, int depth)
+{
+    Arena *arena;
+    TokenList *tokens;
+    AST *prog;
+    Bytecode *bc;
+    FILE *fh;
+    char *src;
+    size_t size;
+    clock_t begin;
+    double msec;
+    int i;
+
+    srand(0);
+    fh = tmpfile();
+    assert(fh != NULL);
+    for (i = 0; i < nstmts; i++) {
+        bench_write_tree(fh, depth);
+        fputs(";\n", fh);
+    }
+    rewind(fh);
+    src = read_all(fh, &size);
+    fclose(fh);
+
+    arena = new_arena();
+    tokens = tokenize_buffer(arena, NULL, src, size);
+    assert(tokens != NULL);
+    prog = parse(tokens, arena, NULL, false);
+    assert(prog != NULL);
+    printf("%d statements of depth %d\n", nstmts, depth);
+
+    fh = fopen("/dev/null", "w");
+    assert(fh != NULL);
+
+    begin = clock();
+    for (i = 0; i < prog->nstmts; i++) {
+        BCValue val = bench_eval_tree(prog->stmts[i]);
+
+        if (prog->stmts[i]->type.kind == TY_DOUBLE)
+            fprintf(fh, sym_strings[SYM_DOUBLEFMT], val.fval);
+        else
+            fprintf(fh, sym_strings[SYM_LONGFMT], val.ival);
+    }
+    msec = bench_msec(begin);
+    bench_report("tree walk", msec);
+    printf("%.0f statements/sec\n", nstmts / (msec / 1000));
+
+    begin = clock();
+    bc = bc_compile(prog, 0);
+    bench_report("bytecode: compile", bench_msec(begin));
+    printf("%d instructions, %d registers\n", bc->ninsts, bc->nregs);
+
+    begin = clock();
+    bc_run(bc, fh);
+    msec = bench_msec(begin);
+    bench_report("bytecode: run", msec);
+    printf("%.0f statements/sec, %.0f instructions/sec\n",
+           nstmts / (msec / 1000), bc->ninsts / (msec / 1000));
+
+    fclose(fh);
+    free_bytecode(bc);
+    free_arena(arena);
+    free(src);
+}
+
+/* Compile src into an executable at exe and return the number of lines. */
+int bench_build(const char *src, size_t size, const char *asm_path,
+                const char *exe, Options *opts, int *nmemops)
+{
+    FILE *fh;
+    char line[256], cmd[1024];
+    int nlines = 0;
+
+    fh = fopen(asm_path, "w");
+    assert(fh != NULL);
+    compile(src, size, fh, opts);
+    fclose(fh);
+
+    fh = fopen(asm_path, "r");
+    assert(fh != NULL);
+    *nmemops = 0;
+    while (fgets(line, sizeof(line), fh) != NULL) {
+        nlines++;
+        if (strstr(line, "(%rbp)") != NULL) (*nmemops)++;
+    }
+    fclose(fh);
+
+    sprintf(cmd, "gcc -no-pie -o %s %s 2>/dev/null", exe, asm_path);
+    if (system(cmd) != 0) return -1;
+    return nlines;
+}
+
+/* Run exe a few times and return the best wall-clock time. */
+double bench_run(const char *exe)
+{
+    char cmd[1024];
+    double best = -1;
+    int i;
+
+    sprintf(cmd, "%s > /dev/null", exe);
+    for (i = 0; i < 5; i++) {
+        double begin = bench_wall_msec(), msec;
+
+        if (system(cmd) != 0) return -1;
+        msec = bench_wall_msec() - begin;
+        if (best < 0 || msec < best) best = msec;
+    }
+
+    return best;
+}
+
+/*
+Build the source written to fh with the pass opt off and then on, and time
+the executables. Constant folding is off so that the arithmetic is
+actually done at run time. If nops is not 0, a run does that many
+operations and the time of each is reported too.
+*/
+void bench_toggle(FILE *fh, int opt, const char **names, double nops)
+{
+    const char *tmpdir = getenv("TMPDIR");
+    char asm_path[512], exe[512], name[64];
+    char *src;
+    size_t size;
+    Options opts;
+    int on;
+
+    if (tmpdir == NULL) tmpdir = "/tmp";
+    sprintf(asm_path, "%s/anqoubc_bench_%d.s", tmpdir, (int)getpid());
+    sprintf(exe, "%s/anqoubc_bench_%d", tmpdir, (int)getpid());
+
+    rewind(fh);
+    src = read_all(fh, &size);
+    fclose(fh);
+
+    init_options(&opts);
+    opts.enabled[OPT_FOLD] = false;
+    for (on = false; on <= true; on++) {
+        int nlines, nmemops;
+        double msec;
+
+        opts.enabled[opt] = on;
+        nlines = bench_build(src, size, asm_path, exe, &opts, &nmemops);
+        if (nlines < 0) {
+            printf("%s: gcc failed, skipped\n", names[on]);
+            continue;
+        }
+        printf("%s: %d lines, %d frame accesses\n", names[on], nlines,
+               nmemops);
+        sprintf(name, "run (%s)", names[on]);
+        msec = bench_run(exe);
+        bench_report(name, msec);
+        if (nops > 0)
+            printf("%s: %.2f ns per operation\n", names[on],
+                   msec * 1e6 / nops);
+    }
+
+    remove(asm_path);
+    remove(exe);
+    free(src);
+}
+
+/* Time the executables generated for deep expression trees. */
+void bench_generated_code(int nstmts, int depth)
+{
+    static const char *names[] = {"stack slots", "register allocator"};
+    FILE *fh;
+    int i;
+
+    srand(0);
+    fh = tmpfile();
+    assert(fh != NULL);
+    for (i = 0; i < nstmts; i++) {
+        bench_write_tree(fh, depth);
+        fputs(";\n", fh);
+    }
+    printf("%d statements of depth %d\n", nstmts, depth);
+
+    bench_toggle(fh, OPT_REGALLOC, names, 0);
+}
+
+/*
+Time chains of multiplications and divisions by literals with and without
+strength reduction. Each operation of a statement needs the result of the
+one before, so the runs take the latency of imul and idiv, or of what
+replaces them, times the number of operations.
+*/
+void bench_strength(int nstmts, int len)
+{
+    static const char *names[] = {"imul and idiv", "strength reduced"};
+    static const int factors[] = {1000, 641, 100, 24, -96, 1001, 40, 4096};
+    static const int divisors[] = {3, 7, 10, -16, 9, 641, 4, 1000};
+    FILE *fh;
+    int i, j;
+
+    srand(0);
+    fh = tmpfile();
+    assert(fh != NULL);
+    for (i = 0; i < nstmts; i++) {
+        fprintf(fh, "%d", rand());
+        for (j = 0; j < len; j++) {
+            if (j % 2 == 0)
+                fprintf(fh, " * %d", factors[rand() % 8]);
+            else
+                fprintf(fh, " / %d", divisors[rand() % 8]);
+        }
+        fputs(";\n", fh);
+    }
+    printf("%d chains of %d multiplications and divisions by literals\n",
+           nstmts, len);
+
+    bench_toggle(fh, OPT_STRENGTH, names, (double)nstmts * len);
+}
+
+void execute_bench()
+{
+    bench_token_list(1000000);
+    bench_parse(1000000);
+    bench_generated_code(400, 11);
+    bench_strength(4000, 64);
+    bench_interp(2000, 11);
+}
+
+/*
+A synthetic workload: statements of random expression trees, written by
+--gen and compiled and run by --bench-suite.
+*/
+typedef struct {
+    const char *name;
+    long nstmts;  /* stmts=, unless size= is given */
+    long size;    /* size=<KiB>, in bytes; 0 to count statements */
+    int depth;    /* depth=: of every tree */
+    int mix[4];   /* ops=a,b,c,d: weights of + - * / */
+    int doubles;  /* doubles=: percentage of literals that are doubles */
+    unsigned long seed; /* seed= */
+} BenchWorkload;
+
+void init_bench_workload(BenchWorkload *this)
+{
+    this->name = "gen";
+    this->nstmts = 1000;
+    this->size = 0;
+    this->depth = 4;
+    this->mix[0] = this->mix[1] = this->mix[2] = this->mix[3] = 1;
+    this->doubles = 50;
+    this->seed = 1;
+}
+
+/* Handle one key=value argument of --gen; return false if it is not one. */
+int bench_workload_parse(BenchWorkload *this, const char *arg)
+{
+    const char *val = strchr(arg, '=');
+    char *end;
+
+    if (val == NULL) return false;
+    val++;
+    if (strncmp(arg, "stmts=", 6) == 0) {
+        this->nstmts = strtol(val, &end, 10);
+        this->size = 0;
+    }
+    else if (strncmp(arg, "size=", 5) == 0)
+        this->size = strtol(val, &end, 10) * 1024;
+    else if (strncmp(arg, "depth=", 6) == 0)
+        this->depth = strtol(val, &end, 10);
+    else if (strncmp(arg, "doubles=", 8) == 0)
+        this->doubles = strtol(val, &end, 10);
+    else if (strncmp(arg, "seed=", 5) == 0)
+        this->seed = strtoul(val, &end, 10);
+    else if (strncmp(arg, "ops=", 4) == 0) {
+        int i;
+
+        for (i = 0, end = (char *)val; i < 4; i++) {
+            this->mix[i] = strtol(end, &end, 10);
+            if (i < 3 && *end++ != ',') return false;
+        }
+        if (this->mix[0] + this->mix[1] + this->mix[2] + this->mix[3] <= 0)
+            return false;
+    }
+    else
+        return false;
+
+    return *end == '\0' && end != val && this->depth >= 0 &&
+           0 <= this->doubles && this->doubles <= 100;
+}
+
+/* xorshift, so that a seed means the same program on every libc */
+unsigned long bench_random(BenchWorkload *this, unsigned long n)
+{
+    this->seed ^= this->seed << 13;
+    this->seed ^= this->seed >> 7;
+    this->seed ^= this->seed << 17;
+    return this->seed % n;
+}
+
+/* Write one tree of the given depth and return the bytes written. */
+long bench_write_expr(FILE *fh, BenchWorkload *w, int depth)
+{
+    static const char ops[] = "+-*/";
+    long ret;
+    int i, op, pick;
+
+    if (depth == 0) {
+        if ((int)bench_random(w, 100) < w->doubles)
+            return fprintf(fh, "%d.5", (int)bench_random(w, 9));
+        return fprintf(fh, "%d", (int)bench_random(w, 9) + 1);
+    }
+
+    pick = bench_random(w, w->mix[0] + w->mix[1] + w->mix[2] + w->mix[3]);
+    for (op = 0; pick >= w->mix[op]; op++) pick -= w->mix[op];
+
+    ret = fprintf(fh, "(");
+    ret += bench_write_expr(fh, w, depth - 1);
+    ret += fprintf(fh, " %c ", ops[op]);
+    /* divide only by non-zero literals so that idiv never traps */
+    i = op == 3 ? 0 : depth - 1;
+    ret += bench_write_expr(fh, w, i);
+    ret += fprintf(fh, ")");
+    return ret;
+}
+
+/* Write the program of w and return how many statements it has. */
+long bench_write_workload(FILE *fh, BenchWorkload *w)
+{
+    long nstmts = 0, size = 0;
+    unsigned long seed = w->seed;
+
+    if (w->seed == 0) w->seed = 1;
+    while (w->size > 0 ? size < w->size : nstmts < w->nstmts) {
+        size += bench_write_expr(fh, w, w->depth);
+        size += fprintf(fh, ";\n");
+        nstmts++;
+    }
+    w->seed = seed;
+    return nstmts;
+}
+
+/* --gen [key=value...]: write a workload to stdout */
+int bench_gen_main(int argc, char **argv)
+{
+    BenchWorkload w;
+    int i;
+
+    init_bench_workload(&w);
+    for (i = 0; i < argc; i++) {
+        if (bench_workload_parse(&w, argv[i])) continue;
+        fprintf(stderr, "--gen: bad argument %s\n", argv[i]);
+        return 1;
+    }
+    bench_write_workload(stdout, &w);
+    return 0;
+}
+
+/*
+Run argv in a child with stdout going to out, and return the wall-clock
+time it took, or -1 if it failed. The peak RSS of the child goes to
+maxrss in KiB.
+*/
+double bench_spawn(char **argv, const char *out, long *maxrss)
+{
+    struct rusage usage;
+    double begin = bench_wall_msec();
+    pid_t pid;
+    int status;
+
+    fflush(stdout);
+    pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        if (freopen(out, "w", stdout) == NULL) _exit(127);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    if (wait4(pid, &status, 0, &usage) != pid) return -1;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) return -1;
+    if (maxrss != NULL) *maxrss = usage.ru_maxrss;
+    return bench_wall_msec() - begin;
+}
+
+/* one figure of the suite, named <workload>.<metric> */
+typedef struct {
+    char name[64];
+    double val;
+} BenchResult;
+
+enum {
+    BENCH_MAX_RESULTS = 256,
+    BENCH_RUNS = 3, /* the best of these counts */
+};
+
+/* percent a figure may get worse by before it counts as a regression */
+static const struct {
+    const char *suffix;
+    int higher_is_better;
+    double slack;
+} bench_metrics[] = {
+    {"compile_mb_s", true, 15},
+    {"compile_stmts_s", true, 15},
+    {"peak_rss_kb", false, 10},
+    {"binary_bytes", false, 2},
+    {"run_ms", false, 15},
+};
+
+void bench_result(BenchResult *results, int *nresults, const char *workload,
+                  const char *metric, double val)
+{
+    BenchResult *r = &results[(*nresults)++];
+
+    assert(*nresults <= BENCH_MAX_RESULTS);
+    sprintf(r->name, "%s.%s", workload, metric);
+    r->val = val;
+    printf("%-32s %14.2f\n", r->name, val);
+}
+
+/*
+Compile w with self -O1 -fno-fold --emit=exe and run the result, both in
+children, and add the figures to results.
+*/
+void bench_workload(const char *self, BenchWorkload *w, BenchResult *results,
+                    int *nresults)
+{
+    const char *tmpdir = getenv("TMPDIR");
+    char src[512], exe[512], *argv[8];
+    struct stat st;
+    FILE *fh;
+    double compile = -1, run = -1;
+    long nstmts, maxrss = 0;
+    int i;
+
+    if (tmpdir == NULL) tmpdir = "/tmp";
+    sprintf(src, "%s/anqoubc_suite_%d.in", tmpdir, (int)getpid());
+    sprintf(exe, "%s/anqoubc_suite_%d", tmpdir, (int)getpid());
+
+    fh = fopen(src, "w");
+    assert(fh != NULL);
+    nstmts = bench_write_workload(fh, w);
+    fclose(fh);
+    stat(src, &st);
+
+    /* all literals, so folding would leave nothing to run */
+    argv[0] = (char *)self;
+    argv[1] = "-O1";
+    argv[2] = "-fno-fold";
+    argv[3] = "--emit=exe";
+    argv[4] = src;
+    argv[5] = exe;
+    argv[6] = NULL;
+    for (i = 0; i < BENCH_RUNS; i++) {
+        long rss;
+        double msec = bench_spawn(argv, "/dev/null", &rss);
+
+        assert(msec >= 0);
+        if (compile < 0 || msec < compile) compile = msec;
+        if (rss > maxrss) maxrss = rss;
+    }
+    bench_result(results, nresults, w->name, "compile_mb_s",
+                 st.st_size / 1048576.0 / (compile / 1000));
+    bench_result(results, nresults, w->name, "compile_stmts_s",
+                 nstmts / (compile / 1000));
+    bench_result(results, nresults, w->name, "peak_rss_kb", maxrss);
+
+    stat(exe, &st);
+    bench_result(results, nresults, w->name, "binary_bytes", st.st_size);
+
+    argv[0] = exe;
+    argv[1] = NULL;
+    for (i = 0; i < BENCH_RUNS; i++) {
+        double msec = bench_spawn(argv, "/dev/null", NULL);
+
+        assert(msec >= 0);
+        if (run < 0 || msec < run) run = msec;
+    }
+    bench_result(results, nresults, w->name, "run_ms", run);
+
+    remove(src);
+    remove(exe);
+}
+
+/*
+Hold results to the figures in the baseline file and return how many got
+worse by more than their slack. Figures missing on either side are skipped.
+*/
+int bench_compare(BenchResult *results, int nresults, const char *path)
+{
+    char name[64];
+    double val;
+    FILE *fh;
+    int nregressions = 0, i, j;
+
+    fh = fopen(path, "r");
+    if (fh == NULL) {
+        printf("no baseline at %s\n", path);
+        return 0;
+    }
+    printf("\ncompared to %s:\n", path);
+    while (fscanf(fh, "%63s %lf", name, &val) == 2) {
+        for (i = 0; i < nresults && strcmp(results[i].name, name) != 0; i++)
+            ;
+        if (i == nresults || val <= 0) continue;
+
+        for (j = 0; j < (int)(sizeof(bench_metrics) / sizeof(bench_metrics[0]));
+             j++) {
+            const char *suffix = bench_metrics[j].suffix;
+            size_t len = strlen(name), slen = strlen(suffix);
+            double change = (results[i].val - val) / val * 100;
+            double worse = bench_metrics[j].higher_is_better ? -change : change;
+
+            if (len < slen || strcmp(name + len - slen, suffix) != 0) continue;
+            printf("%-32s %+8.1f%%%s\n", name, change,
+                   worse > bench_metrics[j].slack ? "  REGRESSION" : "");
+            if (worse > bench_metrics[j].slack) nregressions++;
+        }
+    }
+    fclose(fh);
+    return nregressions;
+}
+
+/*
+--bench-suite [--save=FILE] [BASELINE]: compile and run a fixed set of
+workloads with the compiler at self, then either save the figures as a
+baseline or compare them to one. Returns non-zero on a regression.
+*/
+int bench_suite_main(const char *self, int argc, char **argv)
+{
+    static const char *specs[][6] = {
+        {"small", "stmts=2000", "depth=4", "ops=1,1,1,1", "doubles=50", ""},
+        {"large", "size=8192", "depth=3", "ops=1,1,1,1", "doubles=50", ""},
+        {"deep", "stmts=200", "depth=12", "ops=1,1,1,1", "doubles=50", ""},
+        {"long", "size=2048", "depth=4", "ops=4,4,2,1", "doubles=0", ""},
+        {"double", "size=2048", "depth=4", "ops=4,4,2,1", "doubles=100", ""},
+    };
+    BenchResult *results;
+    const char *save = NULL, *baseline = NULL;
+    int nresults = 0, ret = 0, i, j;
+
+    for (i = 0; i < argc; i++) {
+        if (strncmp(argv[i], "--save=", 7) == 0)
+            save = argv[i] + 7;
+        else
+            baseline = argv[i];
+    }
+
+    results = (BenchResult *)malloc(sizeof(BenchResult) * BENCH_MAX_RESULTS);
+    assert(results != NULL);
+    for (i = 0; i < (int)(sizeof(specs) / sizeof(specs[0])); i++) {
+        BenchWorkload w;
+
+        init_bench_workload(&w);
+        w.name = specs[i][0];
+        for (j = 1; specs[i][j][0] != '\0'; j++) {
+            int ok = bench_workload_parse(&w, specs[i][j]);
+
+            assert(ok);
+        }
+        bench_workload(self, &w, results, &nresults);
+    }
+
+    if (save != NULL) {
+        FILE *fh = fopen(save, "w");
+
+        assert(fh != NULL);
+        for (i = 0; i < nresults; i++)
+            fprintf(fh, "%s %.2f\n", results[i].name, results[i].val);
+        fclose(fh);
+        printf("saved to %s\n", save);
+    }
+    if (baseline != NULL) ret = bench_compare(results, nresults, baseline);
+
+    free(results);
+    return ret != 0;
+}
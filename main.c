@@ -1,8 +1,27 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE /* MAP_ANONYMOUS */
+
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
 
 /*
 long: 8-byte integer
@@ -23,6 +42,41 @@ enum {
 
 int max(int lhs, int rhs) { return lhs < rhs ? rhs : lhs; }
 
+/*
+Arena: a bump allocator for everything that lives as long as one
+compilation. Chunks are chained and released all at once.
+*/
+typedef struct ArenaChunk ArenaChunk;
+struct ArenaChunk {
+    ArenaChunk *next;
+    size_t size;
+};
+
+typedef struct {
+    ArenaChunk *head;
+    char *cur, *end, *last;
+    size_t used, peak;
+    size_t nallocs;
+} Arena;
+
+enum {
+    ARENA_ALIGN = 8,
+    ARENA_CHUNK_SIZE = 64 * 1024,
+    ARENA_CHUNK_MAX_SIZE = 64 * 1024 * 1024,
+};
+
+/*
+The chunks that free_arena gave back, which arena_grow hands out again
+before it asks malloc for more, so that memory faulted in once stays so.
+The pool is shared by all threads and keeps no more than limit bytes,
+which is 0 unless --server raised it.
+*/
+struct {
+    pthread_mutex_t lock;
+    ArenaChunk *head;
+    size_t size, limit;
+} arena_pool = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0};
+
 enum {
     tINTEGER,
     tFLOAT,
@@ -34,19 +88,43 @@ enum {
     tSTAR,
     tSLASH,
     tSEMICOLON,
+    tASSIGN,
     tEOF,
 };
 
-typedef struct Token {
-    int kind;
+typedef union {
+    double fval;
+    long ival;
+} TokenValue;
 
-    union {
-        double fval;
-        long ival;
-    };
+/* struct of arrays: token kinds and their payloads are stored side by side */
+typedef struct {
+    unsigned char *kind;
+    TokenValue *value; /* the id of the name for tVARIABLE */
+    int size, rsved_size;
+} TokenList;
+
+/*
+Names, interned once by the lexer so that everything after it compares
+ids. Ids are handed out from 0 in the order the names first appear.
+*/
+typedef struct {
+    char *names; /* back to back, each NUL-terminated */
+    size_t names_size, names_cap;
+    long *offsets;        /* where the name of each id starts in names */
+    unsigned long *hashes; /* of the name of each id */
+    int *types; /* TY_* of the last assignment the parser saw, or -1 */
+    int size, rsved_size;
+    int *table; /* open addressing; ids, or -1 */
+    int table_size;
+} SymTab;
 
-    struct Token *next;
-} Token;
+/* open addressing from non-negative keys to ints */
+typedef struct {
+    int *keys; /* -1 if the slot is free */
+    int *vals;
+    int size, table_size;
+} IntMap;
 
 enum {
     TY_LONG,
@@ -57,868 +135,7499 @@ typedef struct {
     int kind;
 } Type;
 
-enum { AST_LITERAL, AST_ADD, AST_SUB, AST_MUL, AST_DIV, AST_PROG };
+enum {
+    AST_LITERAL,
+    AST_ADD,
+    AST_SUB,
+    AST_MUL,
+    AST_DIV,
+    AST_PROG,
+    AST_VAR,    /* the value of var */
+    AST_ASSIGN, /* var = rhs */
+};
 
 typedef struct AST AST;
 struct AST {
     int kind;
     Type type;
+    int need; /* Sethi-Ullman number, computed by the code generator */
+
+    union {
+        int var;    /* AST_VAR and AST_ASSIGN: the id of the name */
+        int shared; /* AST_ADD..AST_DIV: see hashcons_ast */
+    };
 
     union {
         /* AST_PROG */
         struct {
-            AST *stmt;
-            struct AST *next;
+            AST **stmts;
+            int nstmts;
         };
 
         /* AST_LITERAL */
         double fval;
         long ival;
 
-        /* AST_ADD, AST_SUB, AST_MUL, AST_DIV */
+        /* AST_ADD, AST_SUB, AST_MUL, AST_DIV; AST_ASSIGN has only rhs */
         struct {
             AST *lhs, *rhs;
         };
     };
 };
 
-Token *new_token(int kind);
-Token *new_token_float(double num);
-Token *tokenize(FILE *fp);
-void free_token_list(Token *token_list);
-AST *new_ast_float(double val);
-AST *new_ast_integer(long val);
-AST *new_ast_binary_op(int kind, AST *lhs, AST *rhs);
-Token *pop_token(Token **token_list);
-Token *peek_token(Token **token_list);
-Token *pop_number_token(Token **token_list);
-Token *parse_match(Token **token_list, int kind);
-AST *parse_factor(Token **token_list);
-AST *parse_term_detail(Token **token_list, AST *factor);
-AST *parse_term(Token **token_list);
-AST *parse_expr_detail(Token **token_list, AST *term);
-AST *parse_expr(Token **token_list);
-AST *parse_prog(Token **token_list);
-AST *parse(Token *token_list);
-void dump_token_list(Token *token_list);
+/*
+A chain of left-associative operators makes a tree as deep as the chain
+is long down its left operands. The walkers of expressions follow that
+spine with a loop, keeping its nodes on an AstSpine, and recurse only into
+right operands, which nest as deep as the parentheses of the source, at
+most PARSE_MAX_DEPTH.
+*/
+typedef struct {
+    AST *ast;
+    int val; /* whatever the walker keeps for the node */
+} AstSpineNode;
 
-/********** Token *************/
+typedef struct {
+    AstSpineNode *nodes;
+    int size, rsved_size;
+} AstSpine;
 
-Token *new_token(int kind)
+typedef struct {
+    TokenList *tokens;
+    int idx;
+    Arena *arena;
+    SymTab *syms;
+    int verbose;
+
+    /* the stacks of parse_expr, empty between expressions */
+    AST **operands;
+    int *operators; /* token kinds, tLPAREN for an open parenthesis */
+    int noperands, rsved_operands, noperators, rsved_operators;
+} ParseEnv;
+
+Arena *new_arena();
+ArenaChunk *arena_pool_take(size_t size);
+int arena_pool_give(ArenaChunk *chunk);
+void free_arena(Arena *this);
+void *arena_alloc(Arena *this, size_t size);
+void *arena_realloc(Arena *this, void *ptr, size_t old_size, size_t new_size);
+TokenList *new_token_list(Arena *arena, int rsved_size);
+int token_list_append(TokenList *this, Arena *arena, int kind);
+void token_list_append_float(TokenList *this, Arena *arena, double fval);
+void token_list_append_integer(TokenList *this, Arena *arena, long ival);
+int *new_hash_table(int size);
+SymTab *new_symtab();
+void free_symtab(SymTab *this);
+int symtab_intern(SymTab *this, const char *name, size_t len);
+const char *symtab_name(SymTab *this, int id);
+IntMap *new_int_map();
+void free_int_map(IntMap *this);
+int int_map_get(IntMap *this, int key, int def);
+void int_map_put(IntMap *this, int key, int val);
+TokenList *tokenize_buffer(Arena *arena, SymTab *syms, const char *src,
+                           size_t size);
+TokenList *tokenize(FILE *fp, Arena *arena);
+AST *new_ast_float(Arena *arena, double val);
+AST *new_ast_integer(Arena *arena, long val);
+AST *new_ast_binary_op(Arena *arena, int kind, AST *lhs, AST *rhs);
+AST *new_ast_var(Arena *arena, int var, int type);
+AST *new_ast_assign(Arena *arena, int var, AST *rhs);
+int ast_is_binary_op(AST *ast);
+void init_ast_spine(AstSpine *this);
+int ast_spine_push(AstSpine *this, AST *ast);
+int pop_token(ParseEnv *env);
+int peek_token(ParseEnv *env);
+int parse_match(ParseEnv *env, int kind);
+AST *parse_factor(ParseEnv *env);
+void parse_push_operand(ParseEnv *env, AST *ast);
+void parse_push_operator(ParseEnv *env, int kind);
+void parse_reduce(ParseEnv *env);
+AST *parse_expr(ParseEnv *env);
+AST *parse_prog(ParseEnv *env);
+AST *parse(TokenList *tokens, Arena *arena, SymTab *syms, int verbose);
+AST *fold_ast(Arena *arena, AST *ast);
+void dump_token_list(TokenList *tokens, int idx, int limit);
+
+/* how many tokens ahead the parser shows under -v */
+enum { DUMP_TOKEN_WINDOW = 16 };
+
+/********** Arena *************/
+
+Arena *new_arena()
 {
-    Token *token;
+    Arena *ret;
 
-    token = (Token *)malloc(sizeof(Token));
-    token->next = NULL;
-    token->kind = kind;
-    return token;
+    ret = (Arena *)malloc(sizeof(Arena));
+    assert(ret != NULL);
+    ret->head = NULL;
+    ret->cur = ret->end = ret->last = NULL;
+    ret->used = ret->peak = 0;
+    ret->nallocs = 0;
+    return ret;
 }
 
-Token *new_token_float(double fval)
+/* Take the smallest chunk of the pool with room for size, or NULL. */
+ArenaChunk *arena_pool_take(size_t size)
 {
-    Token *token = new_token(tFLOAT);
+    ArenaChunk **p, **best = NULL, *ret = NULL;
+
+    if (arena_pool.limit == 0) return NULL;
+
+    pthread_mutex_lock(&arena_pool.lock);
+    for (p = &arena_pool.head; *p != NULL; p = &(*p)->next)
+        if ((*p)->size >= size && (best == NULL || (*p)->size < (*best)->size))
+            best = p;
+    if (best != NULL) {
+        ret = *best;
+        *best = ret->next;
+        arena_pool.size -= ret->size;
+    }
+    pthread_mutex_unlock(&arena_pool.lock);
 
-    token->fval = fval;
-    return token;
+    return ret;
 }
 
-Token *new_token_integer(long ival)
+/* Put chunk into the pool if it fits under the limit. */
+int arena_pool_give(ArenaChunk *chunk)
 {
-    Token *token = new_token(tINTEGER);
+    int ret = false;
 
-    token->ival = ival;
-    return token;
-}
+    if (arena_pool.limit == 0) return false;
 
-enum {
-    TK_ST_INITIAL,
-    TK_ST_INTEGER,
-    TK_ST_FLOAT,
-    TK_ST_VARIABLE,
-};
+    pthread_mutex_lock(&arena_pool.lock);
+    if (arena_pool.size + chunk->size <= arena_pool.limit) {
+        chunk->next = arena_pool.head;
+        arena_pool.head = chunk;
+        arena_pool.size += chunk->size;
+        ret = true;
+    }
+    pthread_mutex_unlock(&arena_pool.lock);
+
+    return ret;
+}
 
-Token *tokenize(FILE *fp)
+void free_arena(Arena *this)
 {
-    char buf[256]; /* TODO: should be enough??? */
-    int bufidx, st = TK_ST_INITIAL;
-    Token *token = NULL, *token_list_tail = NULL, *token_list_head = NULL;
+    while (this->head != NULL) {
+        ArenaChunk *chunk = this->head;
 
-    while (true) {
-        int ch;
+        this->head = chunk->next;
+        if (!arena_pool_give(chunk)) free(chunk);
+    }
+    free(this);
+}
 
-        ch = fgetc(fp);
-        if (ch == EOF) break;
+size_t arena_roundup(size_t size)
+{
+    return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
 
-        switch (st) {
-            case TK_ST_INITIAL:
-                if (isspace(ch)) break;
+/* the chunk header, rounded up to keep the payload aligned */
+#define ARENA_CHUNK_HEADER_SIZE arena_roundup(sizeof(ArenaChunk))
 
-                if (isdigit(ch)) {
-                    bufidx = 0;
-                    buf[bufidx++] = ch;
-                    st = TK_ST_INTEGER;
-                    break;
-                }
+/* Chain a new chunk that has room for at least size bytes. */
+void arena_grow(Arena *this, size_t size)
+{
+    ArenaChunk *chunk;
+    size_t chunk_size = ARENA_CHUNK_SIZE;
+
+    /* grow geometrically so that big inputs need few chunks */
+    if (this->head != NULL) chunk_size = this->head->size * 2;
+    if (chunk_size > ARENA_CHUNK_MAX_SIZE) chunk_size = ARENA_CHUNK_MAX_SIZE;
+    if (chunk_size < size) chunk_size = size;
+
+    chunk = arena_pool_take(chunk_size);
+    if (chunk == NULL) {
+        chunk = (ArenaChunk *)malloc(ARENA_CHUNK_HEADER_SIZE + chunk_size);
+        assert(chunk != NULL);
+        chunk->size = chunk_size;
+    }
+    chunk->next = this->head;
+    this->head = chunk;
+    this->cur = (char *)chunk + ARENA_CHUNK_HEADER_SIZE;
+    this->end = this->cur + chunk->size;
+    this->peak += ARENA_CHUNK_HEADER_SIZE + chunk->size;
+}
 
-                if (ch == '.') {
-                    bufidx = 0;
-                    buf[bufidx++] = ch;
-                    st = TK_ST_FLOAT;
-                    break;
-                }
+void *arena_alloc(Arena *this, size_t size)
+{
+    size = arena_roundup(size);
+    if ((size_t)(this->end - this->cur) < size) arena_grow(this, size);
+
+    this->last = this->cur;
+    this->cur += size;
+    this->used += size;
+    this->nallocs++;
+    return this->last;
+}
 
-                switch (ch) {
-                    case '+':
-                        token = new_token(tPLUS);
-                        break;
-                    case '-':
-                        token = new_token(tMINUS);
-                        break;
-                    case '*':
-                        token = new_token(tSTAR);
-                        break;
-                    case '/':
-                        token = new_token(tSLASH);
-                        break;
-                    case '(':
-                        token = new_token(tLPAREN);
-                        break;
-                    case ')':
-                        token = new_token(tRPAREN);
-                        break;
-                    case ';':
-                        token = new_token(tSEMICOLON);
-                        break;
-                }
-                if (token != NULL) break;
+/* Resize ptr. It is extended in place if it is the latest allocation. */
+void *arena_realloc(Arena *this, void *ptr, size_t old_size, size_t new_size)
+{
+    size_t aligned = arena_roundup(new_size);
+    void *ret;
+
+    if (ptr != NULL && ptr == this->last &&
+        (size_t)(this->end - this->last) >= aligned) {
+        this->used += aligned - (this->cur - this->last);
+        this->cur = this->last + aligned;
+        return ptr;
+    }
 
-                return NULL;
+    ret = arena_alloc(this, new_size);
+    if (ptr != NULL)
+        memcpy(ret, ptr, old_size < new_size ? old_size : new_size);
+    return ret;
+}
 
-            case TK_ST_INTEGER:
-                assert(bufidx < sizeof(buf) - 1);
+/********** Token *************/
 
-                if (isdigit(ch) || ch == '.') {
-                    buf[bufidx++] = ch;
-                    if (ch == '.')
-                        st = TK_ST_FLOAT; /* actually, it's a float. */
-                    break;
-                }
+TokenList *new_token_list(Arena *arena, int rsved_size)
+{
+    TokenList *ret;
 
-                buf[bufidx++] = '\0';
-                token = new_token_integer(atol(buf));
+    ret = (TokenList *)arena_alloc(arena, sizeof(TokenList));
+    ret->size = 0;
+    ret->rsved_size = max(rsved_size, 1);
+    ret->kind = (unsigned char *)arena_alloc(
+        arena, sizeof(unsigned char) * ret->rsved_size);
+    ret->value =
+        (TokenValue *)arena_alloc(arena, sizeof(TokenValue) * ret->rsved_size);
+    return ret;
+}
 
-                st = TK_ST_INITIAL;
+/* Append a token and return its index. */
+int token_list_append(TokenList *this, Arena *arena, int kind)
+{
+    if (this->size == this->rsved_size) {
+        this->kind = (unsigned char *)arena_realloc(
+            arena, this->kind, sizeof(unsigned char) * this->rsved_size,
+            sizeof(unsigned char) * this->rsved_size * 2);
+        this->value = (TokenValue *)arena_realloc(
+            arena, this->value, sizeof(TokenValue) * this->rsved_size,
+            sizeof(TokenValue) * this->rsved_size * 2);
+        this->rsved_size *= 2;
+    }
 
-                ungetc(ch, fp);
-                break;
+    this->kind[this->size] = kind;
+    return this->size++;
+}
 
-            case TK_ST_FLOAT:
-                assert(bufidx < sizeof(buf) - 1);
+void token_list_append_float(TokenList *this, Arena *arena, double fval)
+{
+    int idx = token_list_append(this, arena, tFLOAT);
 
-                if (isdigit(ch) || ch == '.') {
-                    buf[bufidx++] = ch;
-                    break;
-                }
+    this->value[idx].fval = fval;
+}
 
-                buf[bufidx++] = '\0';
-                token = new_token_float(atof(buf));
+void token_list_append_integer(TokenList *this, Arena *arena, long ival)
+{
+    int idx = token_list_append(this, arena, tINTEGER);
 
-                st = TK_ST_INITIAL;
+    this->value[idx].ival = ival;
+}
 
-                ungetc(ch, fp);
-                break;
+/******** Symbols *********/
 
-            default:
-                assert(false);
-        }
+SymTab *new_symtab()
+{
+    SymTab *ret;
 
-        if (token != NULL) {
-            if (token_list_tail != NULL) token_list_tail->next = token;
-            token_list_tail = token;
-            if (token_list_head == NULL) token_list_head = token_list_tail;
-        }
-    }
+    ret = (SymTab *)malloc(sizeof(SymTab));
+    assert(ret != NULL);
+    ret->names = NULL;
+    ret->names_size = ret->names_cap = 0;
+    ret->offsets = NULL;
+    ret->hashes = NULL;
+    ret->types = NULL;
+    ret->size = ret->rsved_size = 0;
+    ret->table_size = 64;
+    ret->table = new_hash_table(ret->table_size);
+    return ret;
+}
+
+void free_symtab(SymTab *this)
+{
+    if (this == NULL) return;
+    free(this->names);
+    free(this->offsets);
+    free(this->hashes);
+    free(this->types);
+    free(this->table);
+    free(this);
+}
 
-    token = new_token(tEOF);
-    /* TODO: duplicate code */
-    if (token_list_tail != NULL) token_list_tail->next = token;
-    token_list_tail = token;
-    if (token_list_head == NULL) token_list_head = token_list_tail;
+unsigned long symtab_hash(const char *name, size_t len)
+{
+    unsigned long h = 0xcbf29ce484222325UL;
+    size_t i;
 
-    return token_list_head;
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char)name[i]) * 0x100000001b3UL;
+    return h ^ (h >> 29);
 }
 
-void free_token_list(Token *token_list)
+/*
+The slot of name, whose hash is h, in the table. Names are compared only
+when all of their hashes match.
+*/
+int symtab_slot(SymTab *this, unsigned long h, const char *name, size_t len)
 {
-    while (token_list != NULL) {
-        Token *token = token_list;
+    int mask = this->table_size - 1, i = (h >> 32) & mask, id;
 
-        token_list = token_list->next;
-        free(token);
+    while ((id = this->table[i]) >= 0) {
+        const char *p = this->names + this->offsets[id];
+
+        if (this->hashes[id] == h && strncmp(p, name, len) == 0 &&
+            p[len] == '\0')
+            break;
+        i = (i + 1) & mask;
     }
+    return i;
 }
 
-/******** AST *********/
-
-AST *new_ast_float(double val)
+void symtab_rehash(SymTab *this)
 {
-    AST *ast;
+    int mask, i;
 
-    ast = (AST *)malloc(sizeof(AST));
-    assert(ast != NULL);
-    ast->kind = AST_LITERAL;
-    ast->type.kind = TY_DOUBLE;
-    ast->fval = val;
+    free(this->table);
+    this->table_size *= 2;
+    this->table = new_hash_table(this->table_size);
+    mask = this->table_size - 1;
+    for (i = 0; i < this->size; i++) {
+        int slot = (this->hashes[i] >> 32) & mask;
 
-    return ast;
+        /* the names are distinct, so the first free slot is it */
+        while (this->table[slot] >= 0) slot = (slot + 1) & mask;
+        this->table[slot] = i;
+    }
 }
 
-AST *new_ast_integer(long val)
+/* Return the id of the len bytes of name, adding it if it is new. */
+int symtab_intern(SymTab *this, const char *name, size_t len)
 {
-    AST *ast;
+    unsigned long h = symtab_hash(name, len);
+    int slot = symtab_slot(this, h, name, len), id;
+
+    if (this->table[slot] >= 0) return this->table[slot];
+
+    if (this->size == this->rsved_size) {
+        this->rsved_size = max(this->rsved_size * 2, 64);
+        this->offsets = (long *)realloc(this->offsets,
+                                        sizeof(long) * this->rsved_size);
+        this->hashes = (unsigned long *)realloc(
+            this->hashes, sizeof(unsigned long) * this->rsved_size);
+        this->types =
+            (int *)realloc(this->types, sizeof(int) * this->rsved_size);
+        assert(this->offsets != NULL && this->hashes != NULL &&
+               this->types != NULL);
+    }
+    while (this->names_cap - this->names_size < len + 1) {
+        this->names_cap = this->names_cap == 0 ? 4096 : this->names_cap * 2;
+        this->names = (char *)realloc(this->names, this->names_cap);
+        assert(this->names != NULL);
+    }
 
-    ast = (AST *)malloc(sizeof(AST));
-    assert(ast != NULL);
-    ast->kind = AST_LITERAL;
-    ast->type.kind = TY_LONG;
-    ast->ival = val;
+    id = this->size++;
+    this->offsets[id] = this->names_size;
+    this->hashes[id] = h;
+    this->types[id] = -1;
+    memcpy(this->names + this->names_size, name, len);
+    this->names[this->names_size + len] = '\0';
+    this->names_size += len + 1;
+    this->table[slot] = id;
+    if (this->size * 2 > this->table_size) symtab_rehash(this);
+
+    return id;
+}
 
-    return ast;
+const char *symtab_name(SymTab *this, int id)
+{
+    assert(0 <= id && id < this->size);
+    return this->names + this->offsets[id];
 }
 
-AST *new_ast_binary_op(int kind, AST *lhs, AST *rhs)
+IntMap *new_int_map()
 {
-    AST *ast;
+    IntMap *ret;
 
-    ast = (AST *)malloc(sizeof(AST));
-    assert(ast != NULL);
-    ast->kind = kind;
-    ast->type.kind = lhs->type.kind == TY_DOUBLE || rhs->type.kind == TY_DOUBLE
-                         ? TY_DOUBLE
-                         : TY_LONG;
-    ast->lhs = lhs;
-    ast->rhs = rhs;
+    ret = (IntMap *)malloc(sizeof(IntMap));
+    assert(ret != NULL);
+    ret->size = 0;
+    ret->table_size = 16;
+    ret->keys = new_hash_table(ret->table_size);
+    ret->vals = (int *)malloc(sizeof(int) * ret->table_size);
+    assert(ret->vals != NULL);
+    return ret;
+}
 
-    return ast;
+void free_int_map(IntMap *this)
+{
+    free(this->keys);
+    free(this->vals);
+    free(this);
 }
 
-Token *pop_token(Token **token_list)
+int int_map_slot(IntMap *this, int key)
 {
-    Token *token = *token_list;
+    unsigned long h = (unsigned long)key * 0x9e3779b97f4a7c15UL;
+    int mask = this->table_size - 1, i = (h >> 32) & mask;
 
-    if (token == NULL) return NULL;
-    *token_list = (*token_list)->next;
-    return token;
+    while (this->keys[i] >= 0 && this->keys[i] != key) i = (i + 1) & mask;
+    return i;
 }
 
-Token *peek_token(Token **token_list) { return *token_list; }
-
-Token *pop_token_if(Token **token_list, int kind)
+/* The value of key, or def if it has none. */
+int int_map_get(IntMap *this, int key, int def)
 {
-    Token *token = peek_token(token_list);
+    int slot = int_map_slot(this, key);
 
-    if (token == NULL || token->kind != kind) return NULL;
-    return pop_token(token_list);
+    return this->keys[slot] >= 0 ? this->vals[slot] : def;
 }
 
-Token *parse_match(Token **token_list, int kind)
+void int_map_put(IntMap *this, int key, int val)
 {
-    Token *token = peek_token(token_list);
+    int slot = int_map_slot(this, key);
 
-    if (token == NULL) return NULL;
-    if (token->kind == kind) return pop_token(token_list);
-    return NULL;
+    assert(key >= 0);
+    if (this->keys[slot] >= 0) {
+        this->vals[slot] = val;
+        return;
+    }
+
+    this->keys[slot] = key;
+    this->vals[slot] = val;
+    if (++this->size * 2 > this->table_size) {
+        int *keys = this->keys, *vals = this->vals, n = this->table_size, i;
+
+        this->table_size *= 2;
+        this->keys = new_hash_table(this->table_size);
+        this->vals = (int *)malloc(sizeof(int) * this->table_size);
+        assert(this->vals != NULL);
+        for (i = 0; i < n; i++) {
+            if (keys[i] < 0) continue;
+            slot = int_map_slot(this, keys[i]);
+            this->keys[slot] = keys[i];
+            this->vals[slot] = vals[i];
+        }
+        free(keys);
+        free(vals);
+    }
 }
 
-AST *parse_factor(Token **token_list)
+enum {
+    READ_BLOCK_SIZE = 64 * 1024,
+};
+
+/* Read the whole stream in large blocks. The result is NUL-terminated. */
+char *read_all(FILE *fp, size_t *size)
 {
-    if (parse_match(token_list, tLPAREN) != NULL) {
-        /* (expr) */
-        AST *ast;
+    char *buf = NULL;
+    size_t len = 0, cap = 0;
 
-        ast = parse_expr(token_list);
-        assert(parse_match(token_list, tRPAREN) != NULL);
-        return ast;
+    while (true) {
+        size_t nread, nwant;
+
+        if (cap - len < READ_BLOCK_SIZE) {
+            cap = cap == 0 ? READ_BLOCK_SIZE : cap * 2;
+            buf = (char *)realloc(buf, cap + 1);
+            assert(buf != NULL);
+        }
+
+        nwant = cap - len;
+        nread = fread(buf + len, 1, nwant, fp);
+        len += nread;
+        if (nread < nwant) break; /* EOF or error */
     }
 
-    /* number */
-    Token *token;
-    int minus = 1;
+    buf[len] = '\0';
+    *size = len;
+    return buf;
+}
 
-    token = pop_token_if(token_list, tMINUS);
-    if (token != NULL) minus = -1;
+/* exact powers of ten representable in a double */
+static const double exact_pow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
 
-    token = pop_token_if(token_list, tFLOAT);
-    if (token != NULL) return new_ast_float(minus * token->fval);
+/* Parse a float numeral [begin, end) the way atof() does. */
+double scan_float_slow(const char *begin, const char *end)
+{
+    char sbuf[64], *buf = sbuf;
+    size_t len = end - begin;
+    double ret;
 
-    token = pop_token_if(token_list, tINTEGER);
-    if (token != NULL) return new_ast_integer(minus * token->ival);
+    if (len >= sizeof(sbuf)) {
+        buf = (char *)malloc(len + 1);
+        assert(buf != NULL);
+    }
+    memcpy(buf, begin, len);
+    buf[len] = '\0';
+    ret = strtod(buf, NULL);
+    if (buf != sbuf) free(buf);
 
-    return NULL;
+    return ret;
 }
 
-AST *parse_term_detail(Token **token_list, AST *factor)
+/*
+Scan a numeral of the form [0-9.]+ starting at p without copying it.
+The numeral is a float if it contains '.'. As with atof(), everything after
+a second '.' is ignored.
+*/
+const char *scan_number(const char *p, const char *end, TokenList *tokens,
+                        Arena *arena)
 {
-    Token *op;
-    AST *ast = factor;
+    const char *begin = p;
+    unsigned long mant = 0;
+    int nfrac = 0, overflow = false;
 
-    if ((op = parse_match(token_list, tSTAR)) != NULL) {
-        AST *lhs, *rhs;
+    for (; p < end && isdigit((unsigned char)*p); p++) {
+        int digit = *p - '0';
 
-        lhs = factor;
-        rhs = parse_factor(token_list);
-        assert(rhs != NULL);
-        ast = (AST *)new_ast_binary_op(AST_MUL, lhs, rhs);
-        ast = parse_term_detail(token_list, ast);
+        if (mant > ((unsigned long)LONG_MAX - digit) / 10) {
+            overflow = true;
+            continue;
+        }
+        mant = mant * 10 + digit;
     }
-    else if ((op = parse_match(token_list, tSLASH)) != NULL) {
-        AST *lhs, *rhs;
 
-        lhs = factor;
-        rhs = parse_factor(token_list);
-        assert(rhs != NULL);
-        ast = (AST *)new_ast_binary_op(AST_DIV, lhs, rhs);
-        ast = parse_term_detail(token_list, ast);
+    if (p == end || *p != '.') {
+        /* saturate like strtol() */
+        token_list_append_integer(tokens, arena,
+                                  overflow ? LONG_MAX : (long)mant);
+        return p;
     }
 
-    return ast;
-}
-
-AST *parse_term(Token **token_list)
-{
-    AST *ast;
-    Token *org_token_list_head = *token_list;
+    for (p++; p < end && isdigit((unsigned char)*p); p++) {
+        int digit = *p - '0';
 
-    ast = parse_factor(token_list);
-    if (ast == NULL) goto err;
+        if (mant > ((unsigned long)LONG_MAX - digit) / 10) {
+            overflow = true;
+            continue;
+        }
+        mant = mant * 10 + digit;
+        nfrac++;
+    }
 
-    ast = parse_term_detail(token_list, ast);
-    if (ast == NULL) goto err;
+    while (p < end && (isdigit((unsigned char)*p) || *p == '.')) p++;
 
-    return ast;
+    /*
+    Both mant and 10^nfrac are exact doubles here, so a single division
+    gives the correctly rounded result.
+    */
+    if (!overflow && mant <= (1UL << 53) && nfrac <= 22)
+        token_list_append_float(tokens, arena,
+                                (double)mant / exact_pow10[nfrac]);
+    else
+        token_list_append_float(tokens, arena, scan_float_slow(begin, p));
 
-err:
-    *token_list = org_token_list_head;
-    return NULL;
+    return p;
 }
 
-AST *parse_expr_detail(Token **token_list, AST *term)
+/*
+Names go into syms; without syms they are an error like any other
+character that starts no token.
+*/
+TokenList *tokenize_buffer(Arena *arena, SymTab *syms, const char *src,
+                           size_t size)
 {
-    Token *op;
-    AST *ast = term;
+    const char *p = src, *end = src + size;
+    TokenList *tokens;
 
-    if ((op = parse_match(token_list, tPLUS)) != NULL) {
-        AST *lhs, *rhs;
+    /* A rough guess of the token count so that one allocation is enough. */
+    tokens = new_token_list(arena, size / 2 + 16);
 
-        dump_token_list(*token_list);
+    while (true) {
+        int ch, kind;
 
-        lhs = term;
-        rhs = parse_term(token_list);
-        assert(rhs != NULL);
-        ast = (AST *)new_ast_binary_op(AST_ADD, lhs, rhs);
-        ast = parse_expr_detail(token_list, ast);
-    }
-    else if ((op = parse_match(token_list, tMINUS)) != NULL) {
-        AST *lhs, *rhs;
+        while (p < end && isspace((unsigned char)*p)) p++;
+        if (p == end) break;
+
+        ch = (unsigned char)*p;
+        if (isdigit(ch) || ch == '.') {
+            p = scan_number(p, end, tokens, arena);
+            continue;
+        }
+        if (isalpha(ch) || ch == '_') {
+            const char *name = p;
+            int idx;
+
+            if (syms == NULL) return NULL;
+            while (p < end && (isalnum((unsigned char)*p) || *p == '_')) p++;
+            idx = token_list_append(tokens, arena, tVARIABLE);
+            tokens->value[idx].ival = symtab_intern(syms, name, p - name);
+            continue;
+        }
 
-        lhs = term;
-        rhs = parse_term(token_list);
-        assert(rhs != NULL);
-        ast = (AST *)new_ast_binary_op(AST_SUB, lhs, rhs);
-        ast = parse_expr_detail(token_list, ast);
+        switch (ch) {
+            case '+':
+                kind = tPLUS;
+                break;
+            case '-':
+                kind = tMINUS;
+                break;
+            case '*':
+                kind = tSTAR;
+                break;
+            case '/':
+                kind = tSLASH;
+                break;
+            case '(':
+                kind = tLPAREN;
+                break;
+            case ')':
+                kind = tRPAREN;
+                break;
+            case ';':
+                kind = tSEMICOLON;
+                break;
+            case '=':
+                kind = tASSIGN;
+                break;
+            default:
+                return NULL;
+        }
+        token_list_append(tokens, arena, kind);
+        p++;
     }
 
-    return ast;
+    token_list_append(tokens, arena, tEOF);
+
+    return tokens;
 }
 
-AST *parse_expr(Token **token_list)
+TokenList *tokenize(FILE *fp, Arena *arena)
 {
-    AST *ast;
-    Token *org_token_list_head = *token_list;
+    TokenList *tokens;
+    char *src;
+    size_t size;
+
+    src = read_all(fp, &size);
+    tokens = tokenize_buffer(arena, NULL, src, size);
+    free(src);
 
-    dump_token_list(*token_list);
+    return tokens;
+}
 
-    ast = parse_term(token_list);
-    if (ast == NULL) goto err;
+/******** AST *********/
 
-    dump_token_list(*token_list);
+AST *new_ast_float(Arena *arena, double val)
+{
+    AST *ast;
 
-    ast = parse_expr_detail(token_list, ast);
-    if (ast == NULL) goto err;
+    ast = (AST *)arena_alloc(arena, sizeof(AST));
+    ast->kind = AST_LITERAL;
+    ast->type.kind = TY_DOUBLE;
+    ast->need = 0;
+    ast->fval = val;
 
     return ast;
-
-err:
-    *token_list = org_token_list_head;
-    return NULL;
 }
 
-AST *parse_stmt(Token **token_list)
+AST *new_ast_integer(Arena *arena, long val)
 {
     AST *ast;
 
-    ast = parse_expr(token_list);
-    if (ast == NULL) return NULL;
-    assert(parse_match(token_list, tSEMICOLON) != NULL);
-    dump_token_list(*token_list);
+    ast = (AST *)arena_alloc(arena, sizeof(AST));
+    ast->kind = AST_LITERAL;
+    ast->type.kind = TY_LONG;
+    ast->need = 0;
+    ast->ival = val;
 
     return ast;
 }
 
-AST *parse_prog(Token **token_list)
+AST *new_ast_binary_op(Arena *arena, int kind, AST *lhs, AST *rhs)
 {
-    AST *stmt;
-    AST *prog, *ast;
-
-    if (parse_match(token_list, tEOF) != NULL) return NULL;
-
-    stmt = parse_stmt(token_list);
-    if (stmt == NULL) return NULL;
-    prog = parse_prog(token_list);
+    AST *ast;
 
-    ast = (AST *)malloc(sizeof(AST));
-    assert(ast != NULL);
-    ast->kind = AST_PROG;
-    ast->stmt = stmt;
-    ast->next = prog;
+    ast = (AST *)arena_alloc(arena, sizeof(AST));
+    ast->kind = kind;
+    ast->need = 0;
+    ast->shared = 0;
+    ast->type.kind = lhs->type.kind == TY_DOUBLE || rhs->type.kind == TY_DOUBLE
+                         ? TY_DOUBLE
+                         : TY_LONG;
+    ast->lhs = lhs;
+    ast->rhs = rhs;
 
     return ast;
 }
 
-AST *parse(Token *token_list)
+AST *new_ast_var(Arena *arena, int var, int type)
 {
-    AST *prog;
+    AST *ast;
 
-    prog = parse_prog(&token_list);
-    assert(token_list == NULL);
+    ast = (AST *)arena_alloc(arena, sizeof(AST));
+    ast->kind = AST_VAR;
+    ast->type.kind = type;
+    ast->need = 0;
+    ast->var = var;
 
-    return prog;
+    return ast;
 }
 
-/*
-float eval_ast(AST *ast)
+AST *new_ast_assign(Arena *arena, int var, AST *rhs)
 {
-    switch (ast->kind) {
-        case AST_PROG: {
-            while (ast != NULL) {
-                assert(ast->kind == AST_PROG);
-                printf("%f\n", eval_ast(ast->stmt));
-                ast = ast->next;
-            }
-            return 0;
-        }
+    AST *ast;
 
-        case AST_ADD: {
-            return eval_ast(ast->lhs) + eval_ast(ast->rhs);
-        }
+    ast = (AST *)arena_alloc(arena, sizeof(AST));
+    ast->kind = AST_ASSIGN;
+    ast->type = rhs->type;
+    ast->need = 0;
+    ast->var = var;
+    ast->lhs = NULL;
+    ast->rhs = rhs;
 
-        case AST_SUB: {
-            return eval_ast(ast->lhs) - eval_ast(ast->rhs);
-        }
+    return ast;
+}
 
-        case AST_MUL: {
-            return eval_ast(ast->lhs) * eval_ast(ast->rhs);
-        }
+int ast_is_binary_op(AST *ast)
+{
+    return AST_ADD <= ast->kind && ast->kind <= AST_DIV;
+}
 
-        case AST_DIV: {
-            return eval_ast(ast->lhs) / eval_ast(ast->rhs);
-        }
+void init_ast_spine(AstSpine *this)
+{
+    this->nodes = NULL;
+    this->size = this->rsved_size = 0;
+}
+
+/* Push ast with val 0 and return its index, which stays valid. */
+int ast_spine_push(AstSpine *this, AST *ast)
+{
+    if (this->size == this->rsved_size) {
+        this->rsved_size = max(this->rsved_size * 2, 64);
+        this->nodes = (AstSpineNode *)realloc(
+            this->nodes, sizeof(AstSpineNode) * this->rsved_size);
+        assert(this->nodes != NULL);
     }
+    this->nodes[this->size].ast = ast;
+    this->nodes[this->size].val = 0;
+    return this->size++;
+}
 
-    assert(false);
+/* Return the index of the current token and advance, or -1 at the end. */
+int pop_token(ParseEnv *env)
+{
+    if (env->idx >= env->tokens->size) return -1;
+    return env->idx++;
 }
-*/
 
-void free_ast(AST *ast)
+int peek_token(ParseEnv *env)
 {
-    if (ast == NULL) return;
+    if (env->idx >= env->tokens->size) return -1;
+    return env->idx;
+}
 
-    switch (ast->kind) {
-        case AST_PROG: {
-            free_ast(ast->stmt);
-            free_ast(ast->next);
-            free(ast);
-            return;
-        }
+int pop_token_if(ParseEnv *env, int kind)
+{
+    int idx = peek_token(env);
 
-        case AST_ADD:
-        case AST_SUB:
-        case AST_MUL:
-        case AST_DIV: {
-            free_ast(ast->lhs);
-            free_ast(ast->rhs);
-            free(ast);
-            return;
-        }
+    if (idx < 0 || env->tokens->kind[idx] != kind) return -1;
+    return pop_token(env);
+}
 
-        case AST_LITERAL: {
-            free(ast);
-            return;
-        }
-    }
+int parse_match(ParseEnv *env, int kind)
+{
+    int idx = peek_token(env);
 
-    assert(false);
+    if (idx < 0) return -1;
+    if (env->tokens->kind[idx] == kind) return pop_token(env);
+    return -1;
 }
 
-void dump_token_list(Token *token)
+/* A number or a name, either of them negated by a leading '-'. */
+AST *parse_factor(ParseEnv *env)
 {
-    for (; token != NULL; token = token->next) {
-        switch (token->kind) {
+    int idx;
+    int minus = 1;
+
+    idx = pop_token_if(env, tMINUS);
+    if (idx >= 0) minus = -1;
+
+    idx = pop_token_if(env, tVARIABLE);
+    if (idx >= 0) {
+        int var = env->tokens->value[idx].ival, type;
+        AST *ast;
+
+        /* a name has to be assigned before it is used */
+        type = env->syms->types[var];
+        if (type < 0) return NULL;
+        ast = new_ast_var(env->arena, var, type);
+        if (minus > 0) return ast;
+
+        /* -1 * x is exactly -x, the sign of zero included */
+        return new_ast_binary_op(env->arena, AST_MUL,
+                                 type == TY_DOUBLE
+                                     ? new_ast_float(env->arena, -1.0)
+                                     : new_ast_integer(env->arena, -1),
+                                 ast);
+    }
+
+    idx = pop_token_if(env, tFLOAT);
+    if (idx >= 0)
+        return new_ast_float(env->arena, minus * env->tokens->value[idx].fval);
+
+    idx = pop_token_if(env, tINTEGER);
+    if (idx >= 0)
+        return new_ast_integer(env->arena,
+                               minus * env->tokens->value[idx].ival);
+
+    return NULL;
+}
+
+/*
+The binary operators by token kind: the node each one makes and how
+tightly it binds. Tokens with precedence 0 are not binary operators.
+*/
+static const struct {
+    int kind, prec;
+} parse_binops[] = {
+    {-1, 0},      /* tINTEGER */
+    {-1, 0},      /* tFLOAT */
+    {-1, 0},      /* tLPAREN */
+    {-1, 0},      /* tRPAREN */
+    {-1, 0},      /* tVARIABLE */
+    {AST_ADD, 1}, /* tPLUS */
+    {AST_SUB, 1}, /* tMINUS */
+    {AST_MUL, 2}, /* tSTAR */
+    {AST_DIV, 2}, /* tSLASH */
+    {-1, 0},      /* tSEMICOLON */
+    {-1, 0},      /* tASSIGN */
+    {-1, 0},      /* tEOF */
+};
+
+void parse_push_operand(ParseEnv *env, AST *ast)
+{
+    if (env->noperands == env->rsved_operands) {
+        env->rsved_operands = max(env->rsved_operands * 2, 16);
+        env->operands = (AST **)realloc(
+            env->operands, sizeof(AST *) * env->rsved_operands);
+        assert(env->operands != NULL);
+    }
+    env->operands[env->noperands++] = ast;
+}
+
+void parse_push_operator(ParseEnv *env, int kind)
+{
+    if (env->noperators == env->rsved_operators) {
+        env->rsved_operators = max(env->rsved_operators * 2, 16);
+        env->operators = (int *)realloc(env->operators,
+                                        sizeof(int) * env->rsved_operators);
+        assert(env->operators != NULL);
+    }
+    env->operators[env->noperators++] = kind;
+}
+
+/* Replace the top two operands with the operator on top applied to them. */
+void parse_reduce(ParseEnv *env)
+{
+    int op = env->operators[--env->noperators];
+    AST *rhs = env->operands[--env->noperands];
+    AST **lhs = &env->operands[env->noperands - 1];
+
+    assert(op != tLPAREN);
+    *lhs = new_ast_binary_op(env->arena, parse_binops[op].kind, *lhs, rhs);
+}
+
+/*
+The walkers after the parser recurse into right operands, which nest as
+deep as the parentheses do; past this many open at once they could run
+out of C stack, so the parser refuses them.
+*/
+enum { PARSE_MAX_DEPTH = 10000 };
+
+/*
+Parse an expression with explicit stacks of operands and operators rather
+than recursion, so that the parser itself never runs out of C stack, and
+every token is pushed and popped once. An operator first reduces those on
+the stack that bind at least as tightly, which makes all of them
+left-associative. An open parenthesis sits on the operator stack until its
+')' reduces down to it.
+*/
+AST *parse_expr(ParseEnv *env)
+{
+    AST *ast;
+    int org_idx = env->idx, idx, kind, depth = 0;
+
+    if (env->verbose) dump_token_list(env->tokens, env->idx, DUMP_TOKEN_WINDOW);
+
+    assert(env->noperands == 0 && env->noperators == 0);
+    for (;;) {
+        while (parse_match(env, tLPAREN) >= 0) {
+            depth++;
+            assert(depth <= PARSE_MAX_DEPTH);
+            parse_push_operator(env, tLPAREN);
+            if (env->verbose)
+                dump_token_list(env->tokens, env->idx, DUMP_TOKEN_WINDOW);
+        }
+
+        ast = parse_factor(env);
+        if (ast == NULL) goto err;
+        parse_push_operand(env, ast);
+
+        for (;;) {
+            idx = peek_token(env);
+            kind = idx < 0 ? tEOF : env->tokens->kind[idx];
+            if (kind != tRPAREN || env->noperators == 0) break;
+
+            /* a ')' without its '(' ends the expression */
+            while (env->noperators > 0 &&
+                   env->operators[env->noperators - 1] != tLPAREN)
+                parse_reduce(env);
+            if (env->noperators == 0) break;
+            env->noperators--;
+            depth--;
+            pop_token(env);
+        }
+        if (parse_binops[kind].prec == 0) break;
+
+        while (env->noperators > 0 &&
+               env->operators[env->noperators - 1] != tLPAREN &&
+               parse_binops[env->operators[env->noperators - 1]].prec >=
+                   parse_binops[kind].prec)
+            parse_reduce(env);
+        parse_push_operator(env, kind);
+        pop_token(env);
+
+        if (env->verbose)
+            dump_token_list(env->tokens, env->idx, DUMP_TOKEN_WINDOW);
+    }
+
+    while (env->noperators > 0) parse_reduce(env);
+    assert(env->noperands == 1);
+    env->noperands = 0;
+
+    return env->operands[0];
+
+err:
+    env->noperands = env->noperators = 0;
+    env->idx = org_idx;
+    return NULL;
+}
+
+/*
+A statement is an expression, whose value is printed, or an assignment,
+which prints nothing. From then on the name has the type of the value.
+*/
+AST *parse_stmt(ParseEnv *env)
+{
+    TokenList *tokens = env->tokens;
+    AST *ast;
+    int idx = peek_token(env);
+
+    if (idx >= 0 && idx + 1 < tokens->size &&
+        tokens->kind[idx] == tVARIABLE && tokens->kind[idx + 1] == tASSIGN) {
+        int var = tokens->value[idx].ival;
+        AST *rhs;
+
+        env->idx += 2;
+        rhs = parse_expr(env);
+        if (rhs == NULL) return NULL;
+        ast = new_ast_assign(env->arena, var, rhs);
+        env->syms->types[var] = rhs->type.kind;
+    }
+    else {
+        ast = parse_expr(env);
+        if (ast == NULL) return NULL;
+    }
+    assert(parse_match(env, tSEMICOLON) >= 0);
+    if (env->verbose) dump_token_list(env->tokens, env->idx, DUMP_TOKEN_WINDOW);
+
+    return ast;
+}
+
+AST *parse_prog(ParseEnv *env)
+{
+    AST *prog;
+    int i, rsved_size = 0;
+
+    /* Every statement ends with ';', so this many slots are enough. */
+    for (i = env->idx; i < env->tokens->size; i++)
+        if (env->tokens->kind[i] == tSEMICOLON) rsved_size++;
+
+    prog = (AST *)arena_alloc(env->arena, sizeof(AST));
+    prog->kind = AST_PROG;
+    prog->need = 0;
+    prog->stmts = (AST **)arena_alloc(env->arena, sizeof(AST *) * rsved_size);
+    prog->nstmts = 0;
+
+    while (parse_match(env, tEOF) < 0) {
+        AST *stmt;
+
+        stmt = parse_stmt(env);
+        if (stmt == NULL) return NULL;
+        assert(prog->nstmts < rsved_size);
+        prog->stmts[prog->nstmts++] = stmt;
+    }
+
+    return prog;
+}
+
+/*
+The types of names carry over in syms from one call to the next, so the
+chunks of a program have to be parsed in order.
+*/
+AST *parse(TokenList *tokens, Arena *arena, SymTab *syms, int verbose)
+{
+    ParseEnv env;
+    AST *prog;
+
+    env.tokens = tokens;
+    env.idx = 0;
+    env.arena = arena;
+    env.syms = syms;
+    env.verbose = verbose;
+    env.operands = NULL;
+    env.operators = NULL;
+    env.noperands = env.rsved_operands = 0;
+    env.noperators = env.rsved_operators = 0;
+
+    prog = parse_prog(&env);
+    assert(env.idx == tokens->size);
+    free(env.operands);
+    free(env.operators);
+
+    return prog;
+}
+
+/******** Optimization *********/
+
+/*
+Evaluate a binary operation on two literals the way the generated code
+would. Return NULL if that cannot be done at compile time.
+*/
+AST *fold_binary_op(Arena *arena, int kind, AST *lhs, AST *rhs)
+{
+    double lval, rval, val;
+
+    if (lhs->type.kind == TY_LONG && rhs->type.kind == TY_LONG) {
+        /* add, sub and imul wrap around */
+        unsigned long l = lhs->ival, r = rhs->ival;
+
+        switch (kind) {
+            case AST_ADD:
+                return new_ast_integer(arena, (long)(l + r));
+            case AST_SUB:
+                return new_ast_integer(arena, (long)(l - r));
+            case AST_MUL:
+                return new_ast_integer(arena, (long)(l * r));
+            case AST_DIV:
+                /* idiv traps on these, so leave them to run time */
+                if (rhs->ival == 0 ||
+                    (lhs->ival == LONG_MIN && rhs->ival == -1))
+                    return NULL;
+                return new_ast_integer(arena, lhs->ival / rhs->ival);
+        }
+        assert(false);
+    }
+
+    /* cvtsi2sd is a plain conversion to the nearest double */
+    lval = lhs->type.kind == TY_DOUBLE ? lhs->fval : (double)lhs->ival;
+    rval = rhs->type.kind == TY_DOUBLE ? rhs->fval : (double)rhs->ival;
+    switch (kind) {
+        case AST_ADD:
+            val = lval + rval;
+            break;
+        case AST_SUB:
+            val = lval - rval;
+            break;
+        case AST_MUL:
+            val = lval * rval;
+            break;
+        case AST_DIV:
+            val = lval / rval;
+            break;
+        default:
+            assert(false);
+    }
+
+    /* inf and nan have no literal form; val - val is nan for them */
+    if (val - val != 0) return NULL;
+
+    return new_ast_float(arena, val);
+}
+
+typedef struct {
+    Arena *arena;
+    AST **stmts;
+    IntMap *known; /* name -> the statement that assigned it a literal */
+    AstSpine spine;
+} FoldEnv;
+
+/* Fold the leftmost leaf first, then each operation up the spine. */
+AST *fold_expr(FoldEnv *env, AST *ast)
+{
+    int base = env->spine.size, i;
+
+    for (; ast_is_binary_op(ast); ast = ast->lhs)
+        ast_spine_push(&env->spine, ast);
+
+    assert(ast->kind == AST_LITERAL || ast->kind == AST_VAR);
+    if (ast->kind == AST_VAR && env->known != NULL) {
+        int stmt = int_map_get(env->known, ast->var, -1);
+
+        if (stmt >= 0) ast = env->stmts[stmt]->rhs;
+    }
+
+    for (i = env->spine.size - 1; i >= base; i--) {
+        AST *node = env->spine.nodes[i].ast, *rhs, *folded;
+
+        rhs = fold_expr(env, node->rhs);
+        if (ast->kind == AST_LITERAL && rhs->kind == AST_LITERAL) {
+            folded = fold_binary_op(env->arena, node->kind, ast, rhs);
+            if (folded != NULL) {
+                ast = folded;
+                continue;
+            }
+        }
+
+        if (ast != node->lhs || rhs != node->rhs)
+            ast = new_ast_binary_op(env->arena, node->kind, ast, rhs);
+        else
+            ast = node;
+    }
+    env->spine.size = base;
+
+    return ast;
+}
+
+/*
+Replace constant subtrees with literals. Within a program, a name whose
+last assignment in it was a literal is that literal until it is assigned
+again; names from before the program are left alone.
+*/
+AST *fold_ast(Arena *arena, AST *ast)
+{
+    FoldEnv env;
+    int i;
+
+    env.arena = arena;
+    env.stmts = NULL;
+    env.known = NULL;
+    init_ast_spine(&env.spine);
+    if (ast->kind != AST_PROG) {
+        ast = fold_expr(&env, ast);
+        free(env.spine.nodes);
+        return ast;
+    }
+
+    env.stmts = ast->stmts;
+    env.known = new_int_map();
+    for (i = 0; i < ast->nstmts; i++) {
+        AST *stmt = ast->stmts[i];
+
+        if (stmt->kind != AST_ASSIGN) {
+            ast->stmts[i] = fold_expr(&env, stmt);
+            continue;
+        }
+        stmt->rhs = fold_expr(&env, stmt->rhs);
+        int_map_put(env.known, stmt->var,
+                    stmt->rhs->kind == AST_LITERAL ? i : -1);
+    }
+    free_int_map(env.known);
+    free(env.spine.nodes);
+
+    return ast;
+}
+
+/*
+Hash-consing: equal subtrees (the same kind, type and literal bits or
+name, and children that are the same node) are made one node, so the
+statements of a program form a DAG. A binary operation that turns out to
+be shared gets a number in shared from 1 on, by which lowering computes
+it once per statement, unless its operands are both leaves.
+*/
+typedef struct {
+    AST **table; /* open addressing; the canonical nodes, or NULL */
+    int *used;   /* the statement that last used each of them */
+    int table_size, size;
+    int nshared;
+    int stmt;
+    long nsaved, nreused;
+    AstSpine spine;
+} HashConsEnv;
+
+unsigned long hashcons_hash(AST *ast)
+{
+    unsigned long h = ast->kind * 31UL + ast->type.kind;
+
+    h *= 0x9e3779b97f4a7c15UL;
+
+    switch (ast->kind) {
+        case AST_LITERAL:
+            /* ival has the bits of fval too */
+            h ^= (unsigned long)ast->ival;
+            break;
+        case AST_VAR:
+            h ^= (unsigned long)ast->var;
+            break;
+        default:
+            h ^= (unsigned long)ast->lhs;
+            h = (h ^ (h >> 29)) * 0x9e3779b97f4a7c15UL;
+            h ^= (unsigned long)ast->rhs;
+    }
+    h = (h ^ (h >> 31)) * 0x9e3779b97f4a7c15UL;
+    return h ^ (h >> 32);
+}
+
+int hashcons_equal(AST *lhs, AST *rhs)
+{
+    if (lhs->kind != rhs->kind || lhs->type.kind != rhs->type.kind)
+        return false;
+
+    switch (lhs->kind) {
+        case AST_LITERAL:
+            return lhs->ival == rhs->ival;
+        case AST_VAR:
+            return lhs->var == rhs->var;
+    }
+    return lhs->lhs == rhs->lhs && lhs->rhs == rhs->rhs;
+}
+
+int hashcons_slot(HashConsEnv *env, AST *ast)
+{
+    int mask = env->table_size - 1, i = hashcons_hash(ast) & mask;
+
+    while (env->table[i] != NULL && !hashcons_equal(env->table[i], ast))
+        i = (i + 1) & mask;
+    return i;
+}
+
+void hashcons_alloc(HashConsEnv *env, int size)
+{
+    env->table_size = size;
+    env->table = (AST **)calloc(size, sizeof(AST *));
+    env->used = (int *)malloc(sizeof(int) * size);
+    assert(env->table != NULL && env->used != NULL);
+}
+
+void hashcons_rehash(HashConsEnv *env)
+{
+    AST **old = env->table;
+    int *old_used = env->used, old_size = env->table_size, i;
+
+    hashcons_alloc(env, old_size * 2);
+    for (i = 0; i < old_size; i++) {
+        int slot;
+
+        if (old[i] == NULL) continue;
+        slot = hashcons_slot(env, old[i]);
+        env->table[slot] = old[i];
+        env->used[slot] = old_used[i];
+    }
+    free(old);
+    free(old_used);
+}
+
+/* Return the canonical node of ast, whose children are already so. */
+AST *hashcons_node(HashConsEnv *env, AST *ast)
+{
+    AST *found;
+    int slot;
+
+    slot = hashcons_slot(env, ast);
+    found = env->table[slot];
+    if (found == NULL) {
+        env->table[slot] = ast;
+        env->used[slot] = env->stmt;
+        if (++env->size * 2 > env->table_size) hashcons_rehash(env);
+        return ast;
+    }
+    if (found == ast) return ast;
+
+    env->nsaved++;
+    if (found->kind == AST_LITERAL || found->kind == AST_VAR) return found;
+    /* one operation on leaves is cheaper to do again than to keep live */
+    if (!ast_is_binary_op(found->lhs) && !ast_is_binary_op(found->rhs))
+        return found;
+    if (found->shared == 0) found->shared = ++env->nshared;
+    if (env->used[slot] == env->stmt) env->nreused++;
+    env->used[slot] = env->stmt;
+    return found;
+}
+
+/* Return the canonical node of ast, whose children are made so first. */
+AST *hashcons_expr(HashConsEnv *env, AST *ast)
+{
+    int base = env->spine.size, i;
+
+    for (; ast_is_binary_op(ast); ast = ast->lhs)
+        ast_spine_push(&env->spine, ast);
+    ast = hashcons_node(env, ast);
+
+    /* the nodes below a binary operation have only it as their parent */
+    for (i = env->spine.size - 1; i >= base; i--) {
+        AST *node = env->spine.nodes[i].ast;
+
+        node->lhs = ast;
+        node->rhs = hashcons_expr(env, node->rhs);
+        ast = hashcons_node(env, node);
+    }
+    env->spine.size = base;
+
+    return ast;
+}
+
+/*
+Share the equal subtrees of the program prog. Return the number of nodes
+that became garbage, and add to nreused how many of them were values
+that a statement would have computed a second time.
+*/
+long hashcons_ast(AST *prog, long *nreused)
+{
+    HashConsEnv env;
+    int i;
+
+    assert(prog->kind == AST_PROG);
+
+    hashcons_alloc(&env, 64);
+    env.size = env.nshared = 0;
+    env.nsaved = env.nreused = 0;
+    init_ast_spine(&env.spine);
+
+    for (i = 0; i < prog->nstmts; i++) {
+        AST *stmt = prog->stmts[i];
+
+        env.stmt = i;
+        if (stmt->kind == AST_ASSIGN)
+            stmt->rhs = hashcons_expr(&env, stmt->rhs);
+        else
+            prog->stmts[i] = hashcons_expr(&env, stmt);
+    }
+
+    free(env.table);
+    free(env.used);
+    free(env.spine.nodes);
+    *nreused += env.nreused;
+    return env.nsaved;
+}
+
+/*
+Print the tokens from idx on to stderr, no more than limit of them unless
+it is negative. The parser shows a window of what it has ahead of it, as
+all of the rest on every call would be quadratic in the input.
+*/
+void dump_token_list(TokenList *tokens, int idx, int limit)
+{
+    int end = limit < 0 || tokens->size - idx < limit ? tokens->size
+                                                      : idx + limit;
+
+    for (; idx < end; idx++) {
+        switch (tokens->kind[idx]) {
             case tFLOAT:
-                printf("%lff ", token->fval);
+                fprintf(stderr, "%lff ", tokens->value[idx].fval);
                 break;
 
             case tINTEGER:
-                printf("%ldi ", token->ival);
+                fprintf(stderr, "%ldi ", tokens->value[idx].ival);
+                break;
+
+            case tVARIABLE:
+                fprintf(stderr, "$%ld ", tokens->value[idx].ival);
+                break;
+
+            case tASSIGN:
+                fprintf(stderr, "= ");
+                break;
+
+            case tPLUS:
+                fprintf(stderr, "+ ");
+                break;
+
+            case tMINUS:
+                fprintf(stderr, "- ");
+                break;
+
+            case tSTAR:
+                fprintf(stderr, "* ");
+                break;
+
+            case tSLASH:
+                fprintf(stderr, "/ ");
+                break;
+
+            case tLPAREN:
+                fprintf(stderr, "( ");
+                break;
+
+            case tRPAREN:
+                fprintf(stderr, ") ");
+                break;
+
+            case tSEMICOLON:
+                fprintf(stderr, "; ");
+                break;
+
+            case tEOF:
+                fprintf(stderr, "<EOF> ");
                 break;
 
-            case tPLUS:
-                printf("+ ");
-                break;
+            default:
+                fprintf(stderr, "???%d\n", tokens->kind[idx]);
+                assert(false);
+        }
+    }
+
+    if (end < tokens->size) fputs("...", stderr);
+    fputc('\n', stderr);
+}
+
+/********** Assembly *************/
+
+/* physical registers, numbered as in the instruction encoding */
+enum {
+    REG_RAX,
+    REG_RCX,
+    REG_RDX,
+    REG_RBX,
+    REG_RSP,
+    REG_RBP,
+    REG_RSI,
+    REG_RDI,
+    REG_R8,
+    REG_R9,
+    REG_R10,
+    REG_R11,
+    REG_R12,
+    REG_R13,
+    REG_R14,
+    REG_R15,
+    REG_XMM0,
+    NUM_PHYS_REGS = REG_XMM0 + 16,
+};
+
+static const char *reg64_names[NUM_PHYS_REGS] = {
+    "%rax",   "%rcx",   "%rdx",   "%rbx",   "%rsp",   "%rbp",   "%rsi",
+    "%rdi",   "%r8",    "%r9",    "%r10",   "%r11",   "%r12",   "%r13",
+    "%r14",   "%r15",   "%xmm0",  "%xmm1",  "%xmm2",  "%xmm3",  "%xmm4",
+    "%xmm5",  "%xmm6",  "%xmm7",  "%xmm8",  "%xmm9",  "%xmm10", "%xmm11",
+    "%xmm12", "%xmm13", "%xmm14", "%xmm15",
+};
+static const char *reg32_names[REG_XMM0] = {
+    "%eax", "%ecx", "%edx",  "%ebx",  "%esp",  "%ebp",  "%esi",  "%edi",
+    "%r8d", "%r9d", "%r10d", "%r11d", "%r12d", "%r13d", "%r14d", "%r15d",
+};
+static const char *reg8_names[REG_XMM0] = {
+    "%al",  "%cl",  "%dl",   "%bl",   "%spl",  "%bpl",  "%sil",  "%dil",
+    "%r8b", "%r9b", "%r10b", "%r11b", "%r12b", "%r13b", "%r14b", "%r15b",
+};
+
+/* machine instructions followed by assembler directives */
+enum {
+    X_NOP, /* renders as nothing */
+    X_MOV,
+    X_MOVL, /* 32-bit mov, zero-extended */
+    X_MOVSD,
+    X_ADD,
+    X_SUB,
+    X_IMUL,
+    X_IDIV,
+    X_CQTO,
+    X_ADDSD,
+    X_SUBSD,
+    X_MULSD,
+    X_DIVSD,
+    X_CVTSI2SDQ,
+    X_LEA,
+    X_CALL, /* dst.val is the mask of the registers passing arguments */
+    X_PUSH,
+    X_LEAVE,
+    X_RET,
+
+    /* packed SSE2, for the statements the vectorizer pairs up */
+    X_MOVAPD,
+    X_MOVUPD, /* loads only */
+    X_ADDPD,
+    X_SUBPD,
+    X_MULPD,
+    X_DIVPD,
+    X_PADDQ,
+    X_PSUBQ,
+    X_UNPCKLPD, /* the low lane of src into the high lane of dst */
+    X_MOVHPD,   /* load 8 bytes into the high lane */
+    X_MOVHLPS,  /* the high lane of src into the low lane of dst */
+    X_MOVQ,     /* %xmm to general purpose register */
+
+    /* for multiplications and divisions by literals, and the runtime */
+    X_SHL, /* by an immediate or %cl */
+    X_SHR,
+    X_SAR,
+    X_NEG,
+    X_IMULQ, /* %rdx:%rax = %rax * src, signed */
+
+    /* used only by the runtime, which the peephole pass never sees */
+    X_MOVB, /* byte store */
+    X_CMP,
+    X_TEST,
+    X_AND,
+    X_OR,
+    X_MUL, /* %rdx:%rax = %rax * src, unsigned */
+    X_SYSCALL,
+    X_JMP, /* src is a label; the target has to be within 127 bytes */
+    X_JB,
+    X_JAE,
+    X_JE,
+    X_JNE,
+    X_JBE,
+    X_JA,
+    X_JNS,
+    X_JLE,
+    X_JG,
+
+    X_SECTION, /* src.val is one of SEC_* */
+    X_GLOBL,
+    X_LABEL,
+    X_ALIGN,
+    X_QUAD,
+    X_STRING, /* the string of the symbol in src */
+    X_ZERO,   /* src.val zero bytes */
+};
+
+static const char *x_mnemonics[] = {
+    "",      "mov",   "mov",   "movsd", "add",   "sub",   "imul",
+    "idivq", "cqto",  "addsd", "subsd", "mulsd", "divsd", "cvtsi2sdq",
+    "lea",   "call",  "push",  "leave", "ret",   "movapd", "movupd",
+    "addpd", "subpd", "mulpd", "divpd", "paddq", "psubq", "unpcklpd",
+    "movhpd", "movhlps", "movq", "shl",  "shr",   "sar",   "neg",
+    "imulq", "movb",  "cmp",   "test",  "and",   "or",    "mulq",
+    "syscall", "jmp", "jb",    "jae",   "je",    "jne",   "jbe",
+    "ja",    "jns",   "jle",   "jg",
+};
+
+enum {
+    SEC_DATA,
+    SEC_RODATA,
+    SEC_TEXT,
+    SEC_BSS,
+};
+
+enum {
+    SYM_MAIN,
+    SYM_SNPRINTF,
+    SYM_DOUBLEFMT,
+    SYM_LONGFMT,
+    SYM_START,
+    SYM_EXIT,
+    SYM_RT_BUF,
+    SYM_RT_LEN,
+    SYM_RT_FLUSH,
+    SYM_RT_PUT_ULONG,
+    SYM_RT_PUT_DIGITS,
+    SYM_RT_PRINT_LONG,
+    SYM_RT_PRINT_DOUBLE,
+    SYM_RT_VARS,
+    NUM_SYMS,
+};
+
+static const char *sym_names[NUM_SYMS] = {
+    "main",
+    "snprintf",
+    "doublefmt",
+    "longfmt",
+    "_start",
+    "exit",
+    "anqoubc_buf",
+    "anqoubc_len",
+    "anqoubc_flush",
+    "anqoubc_put_ulong",
+    "anqoubc_put_digits",
+    "anqoubc_print_long",
+    "anqoubc_print_double",
+    "anqoubc_vars",
+};
+static const char *sym_strings[NUM_SYMS] = {NULL, NULL, "%lff\n", "%ldi\n"};
+
+enum {
+    OPD_NONE,
+    OPD_REG,
+    OPD_IMM,
+    OPD_MEM,       /* val(reg) */
+    OPD_LABEL,     /* .L<val> */
+    OPD_SYM,       /* sym_names[val] */
+    OPD_RIP_LABEL, /* .L<val>(%rip) */
+    OPD_RIP_SYM,   /* sym_names[val](%rip) */
+    OPD_RIP_VAR,   /* the slot of the name of id val in anqoubc_vars */
+    OPD_INDEX,     /* (reg,index,val), only as the source of lea */
+};
+
+typedef struct {
+    unsigned char kind;
+    unsigned char reg;   /* OPD_REG, or the base of OPD_MEM and OPD_INDEX */
+    unsigned char index; /* OPD_INDEX */
+    long val;
+} Operand;
+
+/* operands are in AT&T order */
+typedef struct {
+    int op;
+    Operand src, dst;
+} AsmInst;
+
+typedef struct {
+    AsmInst *data;
+    int size, rsved_size;
+} AsmList;
+
+typedef struct {
+    char *data;
+    size_t size, rsved_size;
+} ByteBuf;
+
+Operand opd_none()
+{
+    Operand ret;
+
+    ret.kind = OPD_NONE;
+    ret.reg = ret.index = 0;
+    ret.val = 0;
+    return ret;
+}
+
+Operand opd_of(int kind, long val)
+{
+    Operand ret = opd_none();
+
+    ret.kind = kind;
+    ret.val = val;
+    return ret;
+}
+
+Operand opd_reg(int reg)
+{
+    Operand ret = opd_of(OPD_REG, 0);
+
+    ret.reg = reg;
+    return ret;
+}
+
+Operand opd_mem(int base, long disp)
+{
+    Operand ret = opd_of(OPD_MEM, disp);
+
+    ret.reg = base;
+    return ret;
+}
+
+/* base + index * scale, where scale is 1, 2, 4 or 8 */
+Operand opd_index(int base, int index, int scale)
+{
+    Operand ret = opd_of(OPD_INDEX, scale);
+
+    ret.reg = base;
+    ret.index = index;
+    return ret;
+}
+
+int opd_equal(Operand *lhs, Operand *rhs)
+{
+    return lhs->kind == rhs->kind && lhs->reg == rhs->reg &&
+           lhs->index == rhs->index && lhs->val == rhs->val;
+}
+
+AsmList *new_asm_list()
+{
+    AsmList *ret;
+
+    ret = (AsmList *)malloc(sizeof(AsmList));
+    assert(ret != NULL);
+    ret->data = NULL;
+    ret->size = ret->rsved_size = 0;
+    return ret;
+}
+
+void free_asm_list(AsmList *this)
+{
+    free(this->data);
+    free(this);
+}
+
+/* Append an instruction and return its index. */
+int asm_append(AsmList *this, int op, Operand src, Operand dst)
+{
+    AsmInst *inst;
+
+    if (this->size == this->rsved_size) {
+        this->rsved_size = max(this->rsved_size * 2, 256);
+        this->data = (AsmInst *)realloc(this->data,
+                                        sizeof(AsmInst) * this->rsved_size);
+        assert(this->data != NULL);
+    }
+
+    inst = &this->data[this->size];
+    inst->op = op;
+    inst->src = src;
+    inst->dst = dst;
+    return this->size++;
+}
+
+ByteBuf *new_byte_buf()
+{
+    ByteBuf *ret;
+
+    ret = (ByteBuf *)malloc(sizeof(ByteBuf));
+    assert(ret != NULL);
+    ret->data = NULL;
+    ret->size = ret->rsved_size = 0;
+    return ret;
+}
+
+void free_byte_buf(ByteBuf *this)
+{
+    free(this->data);
+    free(this);
+}
+
+void byte_buf_reserve(ByteBuf *this, size_t size)
+{
+    if (this->size + size <= this->rsved_size) return;
+
+    this->rsved_size = max(this->rsved_size * 2, 4096);
+    while (this->size + size > this->rsved_size) this->rsved_size *= 2;
+    this->data = (char *)realloc(this->data, this->rsved_size);
+    assert(this->data != NULL);
+}
+
+void byte_buf_append(ByteBuf *this, const char *src, size_t size)
+{
+    byte_buf_reserve(this, size);
+    memcpy(this->data + this->size, src, size);
+    this->size += size;
+}
+
+void byte_buf_puts(ByteBuf *this, const char *src)
+{
+    byte_buf_append(this, src, strlen(src));
+}
+
+void byte_buf_putc(ByteBuf *this, char c)
+{
+    byte_buf_reserve(this, 1);
+    this->data[this->size++] = c;
+}
+
+void byte_buf_put_hex(ByteBuf *this, unsigned long val)
+{
+    char buf[32], *p = buf + sizeof(buf);
+
+    do {
+        *--p = "0123456789abcdef"[val % 16];
+        val /= 16;
+    } while (val != 0);
+    *--p = 'x';
+    *--p = '0';
+    byte_buf_append(this, p, buf + sizeof(buf) - p);
+}
+
+void byte_buf_put_long(ByteBuf *this, long val)
+{
+    char buf[32], *p = buf + sizeof(buf);
+    unsigned long u = val < 0 ? -(unsigned long)val : (unsigned long)val;
+
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u != 0);
+    if (val < 0) *--p = '-';
+    byte_buf_append(this, p, buf + sizeof(buf) - p);
+}
+
+/* Write str as a C string literal for .string. */
+void byte_buf_put_string(ByteBuf *this, const char *str)
+{
+    byte_buf_putc(this, '"');
+    for (; *str != '\0'; str++) {
+        if (*str == '\n') {
+            byte_buf_puts(this, "\\n");
+            continue;
+        }
+        if (*str == '"' || *str == '\\') byte_buf_putc(this, '\\');
+        byte_buf_putc(this, *str);
+    }
+    byte_buf_putc(this, '"');
+}
+
+/* size is that of a register operand in bytes */
+void render_operand(ByteBuf *buf, Operand *opd, int size)
+{
+    switch (opd->kind) {
+        case OPD_REG:
+            if (size == SZ_BYTE)
+                byte_buf_puts(buf, reg8_names[opd->reg]);
+            else if (size == SZ_DWORD)
+                byte_buf_puts(buf, reg32_names[opd->reg]);
+            else
+                byte_buf_puts(buf, reg64_names[opd->reg]);
+            return;
+
+        case OPD_IMM:
+            byte_buf_putc(buf, '$');
+            byte_buf_put_long(buf, opd->val);
+            return;
+
+        case OPD_MEM:
+            if (opd->val != 0) byte_buf_put_long(buf, opd->val);
+            byte_buf_putc(buf, '(');
+            byte_buf_puts(buf, reg64_names[opd->reg]);
+            byte_buf_putc(buf, ')');
+            return;
+
+        case OPD_INDEX:
+            byte_buf_putc(buf, '(');
+            byte_buf_puts(buf, reg64_names[opd->reg]);
+            byte_buf_putc(buf, ',');
+            byte_buf_puts(buf, reg64_names[opd->index]);
+            byte_buf_putc(buf, ',');
+            byte_buf_put_long(buf, opd->val);
+            byte_buf_putc(buf, ')');
+            return;
+
+        case OPD_LABEL:
+        case OPD_RIP_LABEL:
+            byte_buf_puts(buf, ".L");
+            byte_buf_put_long(buf, opd->val);
+            break;
+
+        case OPD_SYM:
+        case OPD_RIP_SYM:
+            byte_buf_puts(buf, sym_names[opd->val]);
+            break;
+
+        case OPD_RIP_VAR:
+            byte_buf_puts(buf, sym_names[SYM_RT_VARS]);
+            if (opd->val != 0) {
+                byte_buf_putc(buf, '+');
+                byte_buf_put_long(buf, opd->val * SZ_QWORD);
+            }
+            break;
+
+        default:
+            assert(false);
+    }
+
+    if (opd->kind == OPD_RIP_LABEL || opd->kind == OPD_RIP_SYM ||
+        opd->kind == OPD_RIP_VAR)
+        byte_buf_puts(buf, "(%rip)");
+}
+
+void render_inst(ByteBuf *buf, AsmInst *inst)
+{
+    static const char *sections[] = {".data", ".section .rodata", ".text",
+                                     ".bss"};
+
+    switch (inst->op) {
+        case X_NOP:
+            return;
+
+        case X_SECTION:
+            byte_buf_puts(buf, sections[inst->src.val]);
+            break;
+
+        case X_GLOBL:
+            byte_buf_puts(buf, ".globl ");
+            render_operand(buf, &inst->src, SZ_QWORD);
+            break;
+
+        case X_LABEL:
+            render_operand(buf, &inst->src, SZ_QWORD);
+            byte_buf_putc(buf, ':');
+            break;
+
+        case X_ALIGN:
+            byte_buf_puts(buf, ".align ");
+            byte_buf_put_long(buf, inst->src.val);
+            break;
+
+        case X_QUAD:
+            byte_buf_puts(buf, ".quad ");
+            byte_buf_put_hex(buf, inst->src.val);
+            break;
+
+        case X_STRING:
+            byte_buf_puts(buf, ".string ");
+            byte_buf_put_string(buf, sym_strings[inst->src.val]);
+            break;
+
+        case X_ZERO:
+            byte_buf_puts(buf, ".zero ");
+            byte_buf_put_long(buf, inst->src.val);
+            break;
+
+        default: {
+            int size = inst->op == X_MOVL ? SZ_DWORD : SZ_QWORD;
+
+            /* an immediate stored to memory needs an operand size */
+            if (inst->op == X_MOV && inst->src.kind == OPD_IMM &&
+                inst->dst.kind != OPD_REG)
+                byte_buf_puts(buf, "movq");
+            else
+                byte_buf_puts(buf, x_mnemonics[inst->op]);
+            if (inst->src.kind != OPD_NONE) {
+                byte_buf_putc(buf, ' ');
+                /* a byte store, or a shift by %cl */
+                render_operand(buf, &inst->src,
+                               inst->op == X_MOVB || inst->op == X_SHL ||
+                                       inst->op == X_SHR || inst->op == X_SAR
+                                   ? SZ_BYTE
+                                   : size);
+            }
+            if (inst->dst.kind != OPD_NONE) {
+                byte_buf_puts(buf, inst->src.kind != OPD_NONE ? ", " : " ");
+                render_operand(buf, &inst->dst, size);
+            }
+        }
+    }
+
+    byte_buf_putc(buf, '\n');
+}
+
+/* Render the whole list as text and write it out at once. */
+void asm_dump(AsmList *this, FILE *fh)
+{
+    ByteBuf *buf;
+    int i;
+
+    buf = new_byte_buf();
+    for (i = 0; i < this->size; i++) render_inst(buf, &this->data[i]);
+    if (buf->size > 0) fwrite(buf->data, 1, buf->size, fh);
+    free_byte_buf(buf);
+}
+
+/********** Constant pool *************/
+
+/*
+Double literals, interned by bit pattern so that 0.0 and -0.0 stay
+apart. The i-th one is emitted as .L<i> in .rodata.
+*/
+typedef struct {
+    unsigned long *bits;
+    int size, rsved_size;
+    int *table; /* open addressing; indexes of bits, or -1 */
+    int table_size;
+    int *pairs; /* the same for 16-byte pairs, by their first entry */
+    int pairs_size, npairs;
+} ConstPool;
+
+int *new_hash_table(int size)
+{
+    int *ret, i;
+
+    ret = (int *)malloc(sizeof(int) * size);
+    assert(ret != NULL);
+    for (i = 0; i < size; i++) ret[i] = -1;
+    return ret;
+}
+
+ConstPool *new_const_pool()
+{
+    ConstPool *ret;
+
+    assert(sizeof(unsigned long) == sizeof(double));
+
+    ret = (ConstPool *)malloc(sizeof(ConstPool));
+    assert(ret != NULL);
+    ret->bits = NULL;
+    ret->size = ret->rsved_size = 0;
+    ret->table_size = ret->pairs_size = 64;
+    ret->table = new_hash_table(ret->table_size);
+    ret->pairs = new_hash_table(ret->pairs_size);
+    ret->npairs = 0;
+    return ret;
+}
+
+void free_const_pool(ConstPool *this)
+{
+    free(this->bits);
+    free(this->table);
+    free(this->pairs);
+    free(this);
+}
+
+int const_pool_slot(ConstPool *this, unsigned long bits)
+{
+    unsigned long h = (bits ^ (bits >> 31)) * 0x9e3779b97f4a7c15UL;
+    int mask = this->table_size - 1, i = (h >> 32) & mask;
+
+    while (this->table[i] >= 0 && this->bits[this->table[i]] != bits)
+        i = (i + 1) & mask;
+    return i;
+}
+
+void const_pool_rehash(ConstPool *this)
+{
+    int i;
+
+    free(this->table);
+    this->table_size *= 2;
+    this->table = new_hash_table(this->table_size);
+    for (i = 0; i < this->size; i++) {
+        int slot = const_pool_slot(this, this->bits[i]);
+
+        /* the first of equal entries is the one that is looked up */
+        if (this->table[slot] < 0) this->table[slot] = i;
+    }
+}
+
+/* Add bits as a new entry even if it is there already. */
+int const_pool_append(ConstPool *this, unsigned long bits)
+{
+    int slot = const_pool_slot(this, bits);
+
+    if (this->size == this->rsved_size) {
+        this->rsved_size = max(this->rsved_size * 2, 16);
+        this->bits = (unsigned long *)realloc(
+            this->bits, sizeof(unsigned long) * this->rsved_size);
+        assert(this->bits != NULL);
+    }
+    this->bits[this->size] = bits;
+    if (this->table[slot] < 0) this->table[slot] = this->size;
+    if (++this->size * 2 > this->table_size) const_pool_rehash(this);
+
+    return this->size - 1;
+}
+
+/* Return the label number of val, adding it if it is new. */
+int const_pool_intern(ConstPool *this, double val)
+{
+    unsigned long bits;
+    int idx;
+
+    memcpy(&bits, &val, sizeof(bits));
+    idx = this->table[const_pool_slot(this, bits)];
+    return idx >= 0 ? idx : const_pool_append(this, bits);
+}
+
+int const_pool_pair_slot(ConstPool *this, unsigned long lo,
+                         unsigned long hi)
+{
+    unsigned long h = (lo ^ (lo >> 31)) * 0x9e3779b97f4a7c15UL;
+    int mask = this->pairs_size - 1, i;
+
+    h = (h ^ hi ^ (hi >> 31)) * 0x9e3779b97f4a7c15UL;
+    i = (h >> 32) & mask;
+    while (this->pairs[i] >= 0 && (this->bits[this->pairs[i]] != lo ||
+                                   this->bits[this->pairs[i] + 1] != hi))
+        i = (i + 1) & mask;
+    return i;
+}
+
+void const_pool_rehash_pairs(ConstPool *this)
+{
+    int *old = this->pairs, old_size = this->pairs_size, i;
+
+    this->pairs_size *= 2;
+    this->pairs = new_hash_table(this->pairs_size);
+    for (i = 0; i < old_size; i++) {
+        int idx = old[i];
+
+        if (idx < 0) continue;
+        this->pairs[const_pool_pair_slot(this, this->bits[idx],
+                                         this->bits[idx + 1])] = idx;
+    }
+    free(old);
+}
+
+/* Return the label of 16 bytes holding lo and then hi. */
+int const_pool_intern_pair(ConstPool *this, unsigned long lo,
+                           unsigned long hi)
+{
+    int slot = const_pool_pair_slot(this, lo, hi), idx;
+
+    if (this->pairs[slot] >= 0) return this->pairs[slot];
+
+    idx = const_pool_append(this, lo);
+    const_pool_append(this, hi);
+    this->pairs[slot] = idx;
+    if (++this->npairs * 2 > this->pairs_size) const_pool_rehash_pairs(this);
+    return idx;
+}
+
+/* Append the pool to code as an aligned .rodata section. */
+void const_pool_emit(ConstPool *this, AsmList *code)
+{
+    int i;
+
+    if (this->size == 0) return;
+
+    asm_append(code, X_SECTION, opd_of(OPD_IMM, SEC_RODATA), opd_none());
+    asm_append(code, X_ALIGN, opd_of(OPD_IMM, SZ_DOUBLE), opd_none());
+    for (i = 0; i < this->size; i++) {
+        asm_append(code, X_LABEL, opd_of(OPD_LABEL, i), opd_none());
+        asm_append(code, X_QUAD, opd_of(OPD_IMM, this->bits[i]), opd_none());
+    }
+}
+
+/* register classes */
+enum {
+    RC_GP,
+    RC_XMM,
+    NUM_REG_CLASSES,
+};
+
+/*
+Registers handed out to virtual registers. %rax and %rdx are kept out of
+the pool because idiv needs them, and %rax and %xmm15 are the scratch
+registers for values that live in the frame.
+*/
+static const int gp_pool[] = {
+    REG_RCX, REG_RSI, REG_RDI, REG_R8, REG_R9, REG_R10, REG_R11,
+};
+
+enum {
+    NUM_GP_REGS = sizeof(gp_pool) / sizeof(gp_pool[0]),
+    NUM_XMM_REGS = 15,
+    MAX_NUM_REGS = NUM_XMM_REGS,
+};
+
+int reg_class(int type) { return type == TY_LONG ? RC_GP : RC_XMM; }
+
+/* The physical register of the reg-th register of the pool of cls. */
+int pool_reg(int cls, int reg)
+{
+    return cls == RC_XMM ? REG_XMM0 + reg : gp_pool[reg];
+}
+
+int scratch_reg(int cls) { return cls == RC_XMM ? REG_XMM0 + 15 : REG_RAX; }
+
+/********** Runtime *************/
+
+/*
+The generated code prints through these routines, which format into a
+buffer in .bss that is written out with write(2) when it fills up and at
+the end of main. They produce exactly what "%ldi\n" and "%lff\n" do;
+only doubles they cannot format exactly (inf, nan and magnitudes of 2^63
+or more) go to snprintf.
+*/
+enum {
+    RT_BUF_SIZE = 1 << 16,
+    RT_BUF_SLACK = 512, /* more than one statement can print */
+};
+
+void rt_label(AsmList *code, int label)
+{
+    asm_append(code, X_LABEL, opd_of(OPD_LABEL, label), opd_none());
+}
+
+void rt_jump(AsmList *code, int op, int label)
+{
+    asm_append(code, op, opd_of(OPD_LABEL, label), opd_none());
+}
+
+void rt_call(AsmList *code, int sym)
+{
+    asm_append(code, X_CALL, opd_of(OPD_SYM, sym), opd_none());
+}
+
+Operand rt_imm(long val) { return opd_of(OPD_IMM, val); }
+
+/* Write all of the buffer to stdout and empty it. */
+void rt_emit_flush(AsmList *code, int label)
+{
+    Operand rax = opd_reg(REG_RAX), rdx = opd_reg(REG_RDX),
+            rsi = opd_reg(REG_RSI), len = opd_of(OPD_RIP_SYM, SYM_RT_LEN);
+
+    asm_append(code, X_LABEL, opd_of(OPD_SYM, SYM_RT_FLUSH), opd_none());
+    asm_append(code, X_LEA, opd_of(OPD_RIP_SYM, SYM_RT_BUF), rsi);
+    asm_append(code, X_MOV, len, rdx);
+    rt_label(code, label);
+    asm_append(code, X_TEST, rdx, rdx);
+    rt_jump(code, X_JE, label + 1);
+    asm_append(code, X_MOVL, rt_imm(1), rax); /* write(1, %rsi, %rdx) */
+    asm_append(code, X_MOVL, rt_imm(1), opd_reg(REG_RDI));
+    asm_append(code, X_SYSCALL, opd_none(), opd_none());
+    asm_append(code, X_CMP, rt_imm(-4), rax); /* EINTR */
+    rt_jump(code, X_JE, label);
+    asm_append(code, X_TEST, rax, rax);
+    rt_jump(code, X_JLE, label + 1); /* nothing more can be done */
+    asm_append(code, X_ADD, rax, rsi);
+    asm_append(code, X_SUB, rax, rdx);
+    rt_jump(code, X_JMP, label);
+    rt_label(code, label + 1);
+    asm_append(code, X_MOV, rt_imm(0), len);
+    asm_append(code, X_RET, opd_none(), opd_none());
+}
+
+/*
+put_ulong writes %rax in decimal to (%rdi); put_digits writes exactly %r9
+digits of it. Both advance %rdi and preserve %r8.
+*/
+void rt_emit_put_ulong(AsmList *code, int label)
+{
+    Operand rax = opd_reg(REG_RAX), rcx = opd_reg(REG_RCX),
+            rdx = opd_reg(REG_RDX), rsi = opd_reg(REG_RSI),
+            r9 = opd_reg(REG_R9), r10 = opd_reg(REG_R10),
+            r11 = opd_reg(REG_R11);
+
+    /* count the digits; the value is at most 2^63 */
+    asm_append(code, X_LABEL, opd_of(OPD_SYM, SYM_RT_PUT_ULONG), opd_none());
+    asm_append(code, X_MOVL, rt_imm(1), r9);
+    asm_append(code, X_MOV, rt_imm(10), r10);
+    rt_label(code, label);
+    asm_append(code, X_CMP, r10, rax);
+    rt_jump(code, X_JB, label + 1);
+    asm_append(code, X_ADD, rt_imm(1), r9);
+    asm_append(code, X_IMUL, rt_imm(10), r10);
+    rt_jump(code, X_JMP, label);
+    rt_label(code, label + 1);
+
+    /* from the last digit backwards; x / 10 = x * ceil(2^67 / 10) >> 67 */
+    asm_append(code, X_LABEL, opd_of(OPD_SYM, SYM_RT_PUT_DIGITS), opd_none());
+    asm_append(code, X_ADD, r9, opd_reg(REG_RDI));
+    asm_append(code, X_MOV, opd_reg(REG_RDI), rsi);
+    asm_append(code, X_MOV, rt_imm(0xcccccccccccccccdUL), r11);
+    rt_label(code, label + 2);
+    asm_append(code, X_MOV, rax, rcx);
+    asm_append(code, X_MUL, r11, opd_none());
+    asm_append(code, X_SHR, rt_imm(3), rdx);
+    asm_append(code, X_MOV, rdx, rax);
+    asm_append(code, X_IMUL, rt_imm(10), rdx);
+    asm_append(code, X_SUB, rdx, rcx);
+    asm_append(code, X_ADD, rt_imm('0'), rcx);
+    asm_append(code, X_SUB, rt_imm(1), rsi);
+    asm_append(code, X_MOVB, rcx, opd_mem(REG_RSI, 0));
+    asm_append(code, X_SUB, rt_imm(1), r9);
+    rt_jump(code, X_JNE, label + 2);
+    asm_append(code, X_RET, opd_none(), opd_none());
+}
+
+/* Make room for one statement and point %rdi at the end of the buffer. */
+void rt_emit_reserve(AsmList *code, int label)
+{
+    Operand rax = opd_reg(REG_RAX), len = opd_of(OPD_RIP_SYM, SYM_RT_LEN);
+
+    asm_append(code, X_MOV, len, rax);
+    asm_append(code, X_CMP, rt_imm(RT_BUF_SIZE - RT_BUF_SLACK), rax);
+    rt_jump(code, X_JBE, label);
+    rt_call(code, SYM_RT_FLUSH);
+    rt_label(code, label);
+}
+
+/* Append the suffix and '\n', and make the buffer end at %rdi. */
+void rt_emit_finish(AsmList *code, char suffix)
+{
+    Operand rax = opd_reg(REG_RAX), rdi = opd_reg(REG_RDI);
+
+    asm_append(code, X_MOVB, rt_imm(suffix), opd_mem(REG_RDI, 0));
+    asm_append(code, X_MOVB, rt_imm('\n'), opd_mem(REG_RDI, 1));
+    asm_append(code, X_ADD, rt_imm(2), rdi);
+    asm_append(code, X_LEA, opd_of(OPD_RIP_SYM, SYM_RT_BUF), rax);
+    asm_append(code, X_SUB, rax, rdi);
+    asm_append(code, X_MOV, rdi, opd_of(OPD_RIP_SYM, SYM_RT_LEN));
+    asm_append(code, X_RET, opd_none(), opd_none());
+}
+
+/* print_long(%rdi) */
+void rt_emit_print_long(AsmList *code, int label)
+{
+    Operand rax = opd_reg(REG_RAX), rdi = opd_reg(REG_RDI),
+            r8 = opd_reg(REG_R8);
+
+    asm_append(code, X_LABEL, opd_of(OPD_SYM, SYM_RT_PRINT_LONG), opd_none());
+    asm_append(code, X_MOV, rdi, r8);
+    rt_emit_reserve(code, label);
+    asm_append(code, X_LEA, opd_of(OPD_RIP_SYM, SYM_RT_BUF), rdi);
+    asm_append(code, X_ADD, opd_of(OPD_RIP_SYM, SYM_RT_LEN), rdi);
+    asm_append(code, X_MOV, r8, rax);
+    asm_append(code, X_TEST, rax, rax);
+    rt_jump(code, X_JNS, label + 1);
+    asm_append(code, X_MOVB, rt_imm('-'), opd_mem(REG_RDI, 0));
+    asm_append(code, X_ADD, rt_imm(1), rdi);
+    asm_append(code, X_NEG, opd_none(), rax); /* LONG_MIN is 2^63 unsigned */
+    rt_label(code, label + 1);
+    rt_call(code, SYM_RT_PUT_ULONG);
+    rt_emit_finish(code, 'i');
+}
+
+/*
+print_double(%xmm0). A finite x below 2^63 is m * 2^-k for a 53-bit m.
+Its integer part is m >> k, and the six decimals are the fraction
+F = m mod 2^k times 10^6 rounded half to even, which is decided exactly
+from q = F * 2 * 10^6 >> k and the bits shifted out of it.
+*/
+void rt_emit_print_double(AsmList *code, int label)
+{
+    Operand rax = opd_reg(REG_RAX), rcx = opd_reg(REG_RCX),
+            rdx = opd_reg(REG_RDX), rsi = opd_reg(REG_RSI),
+            rdi = opd_reg(REG_RDI), r8 = opd_reg(REG_R8),
+            r9 = opd_reg(REG_R9), r10 = opd_reg(REG_R10),
+            rsp = opd_reg(REG_RSP), len = opd_of(OPD_RIP_SYM, SYM_RT_LEN);
+    int slow = label, frac = label + 1, tiny = label + 2,
+        round = label + 3, done = label + 4;
+
+    /* snprintf(buf + len, RT_BUF_SIZE - len, doublefmt, x) */
+    rt_label(code, slow);
+    asm_append(code, X_LEA, opd_of(OPD_RIP_SYM, SYM_RT_BUF), rdi);
+    asm_append(code, X_MOV, len, rsi);
+    asm_append(code, X_ADD, rsi, rdi);
+    asm_append(code, X_NEG, opd_none(), rsi);
+    asm_append(code, X_ADD, rt_imm(RT_BUF_SIZE), rsi);
+    asm_append(code, X_LEA, opd_of(OPD_RIP_SYM, SYM_DOUBLEFMT), rdx);
+    asm_append(code, X_MOVL, rt_imm(1), rax);
+    asm_append(code, X_SUB, rt_imm(8), rsp); /* align the stack to 16 */
+    asm_append(code, X_CALL, opd_of(OPD_SYM, SYM_SNPRINTF), opd_none());
+    asm_append(code, X_ADD, rt_imm(8), rsp);
+    asm_append(code, X_ADD, rax, len);
+    asm_append(code, X_RET, opd_none(), opd_none());
+
+    asm_append(code, X_LABEL, opd_of(OPD_SYM, SYM_RT_PRINT_DOUBLE), opd_none());
+    rt_emit_reserve(code, label + 5);
+    asm_append(code, X_MOVQ, opd_reg(REG_XMM0), rax);
+    asm_append(code, X_MOV, rax, rdx);
+    asm_append(code, X_SHL, rt_imm(1), rdx);
+    asm_append(code, X_MOV, rt_imm(0x87c0000000000000UL), rcx); /* 2^63 << 1 */
+    asm_append(code, X_CMP, rcx, rdx);
+    rt_jump(code, X_JAE, slow);
+    asm_append(code, X_LEA, opd_of(OPD_RIP_SYM, SYM_RT_BUF), rdi);
+    asm_append(code, X_ADD, len, rdi);
+    asm_append(code, X_TEST, rax, rax);
+    rt_jump(code, X_JNS, label + 6);
+    asm_append(code, X_MOVB, rt_imm('-'), opd_mem(REG_RDI, 0));
+    asm_append(code, X_ADD, rt_imm(1), rdi);
+    rt_label(code, label + 6);
+
+    /* %rax = m, %rcx = k */
+    asm_append(code, X_MOV, rax, rcx);
+    asm_append(code, X_SHR, rt_imm(52), rcx);
+    asm_append(code, X_AND, rt_imm(0x7ff), rcx);
+    asm_append(code, X_MOV, rt_imm(0xfffffffffffffUL), rdx);
+    asm_append(code, X_AND, rdx, rax);
+    asm_append(code, X_TEST, rcx, rcx);
+    rt_jump(code, X_JNE, label + 7);
+    asm_append(code, X_MOVL, rt_imm(1), rcx); /* subnormal */
+    rt_jump(code, X_JMP, label + 8);
+    rt_label(code, label + 7);
+    asm_append(code, X_ADD, rt_imm(1), rdx);
+    asm_append(code, X_OR, rdx, rax);
+    rt_label(code, label + 8);
+    asm_append(code, X_NEG, opd_none(), rcx);
+    asm_append(code, X_ADD, rt_imm(1075), rcx);
+    rt_jump(code, X_JG, frac);
+
+    /* an integer: %r8 = m << -k, q = 0 and nothing shifted out */
+    asm_append(code, X_NEG, opd_none(), rcx);
+    asm_append(code, X_SHL, rcx, rax);
+    asm_append(code, X_MOV, rax, r8);
+    asm_append(code, X_MOVL, rt_imm(0), r9);
+    asm_append(code, X_MOVL, rt_imm(0), rax);
+    rt_jump(code, X_JMP, round);
+
+    /* q is 0 for any k over 74 */
+    rt_label(code, frac);
+    asm_append(code, X_CMP, rt_imm(100), rcx);
+    rt_jump(code, X_JBE, label + 9);
+    asm_append(code, X_MOVL, rt_imm(100), rcx);
+    rt_label(code, label + 9);
+    asm_append(code, X_CMP, rt_imm(64), rcx);
+    rt_jump(code, X_JAE, tiny);
+
+    /* k < 64: %r8 = m >> k, %rdx:%rax = F * 2 * 10^6 */
+    asm_append(code, X_MOV, rax, r8);
+    asm_append(code, X_SHR, rcx, r8);
+    asm_append(code, X_MOV, r8, rdx);
+    asm_append(code, X_SHL, rcx, rdx);
+    asm_append(code, X_SUB, rdx, rax);
+    asm_append(code, X_MOVL, rt_imm(2000000), rdx);
+    asm_append(code, X_MUL, rdx, opd_none());
+    asm_append(code, X_MOV, rax, r9);
+    asm_append(code, X_SHR, rcx, r9);
+    asm_append(code, X_MOV, r9, r10);
+    asm_append(code, X_SHL, rcx, r10);
+    asm_append(code, X_SUB, r10, rax);
+    asm_append(code, X_NEG, opd_none(), rcx);
+    asm_append(code, X_ADD, rt_imm(64), rcx);
+    asm_append(code, X_SHL, rcx, rdx);
+    asm_append(code, X_OR, rdx, r9);
+    rt_jump(code, X_JMP, round);
+
+    /* k >= 64: %r8 = 0, %rdx:%rax = m * 2 * 10^6 */
+    rt_label(code, tiny);
+    asm_append(code, X_MOVL, rt_imm(2000000), rdx);
+    asm_append(code, X_MUL, rdx, opd_none());
+    asm_append(code, X_SUB, rt_imm(64), rcx);
+    asm_append(code, X_MOV, rdx, r9);
+    asm_append(code, X_SHR, rcx, r9);
+    asm_append(code, X_MOV, r9, r10);
+    asm_append(code, X_SHL, rcx, r10);
+    asm_append(code, X_SUB, r10, rdx);
+    asm_append(code, X_OR, rdx, rax);
+    asm_append(code, X_MOVL, rt_imm(0), r8);
+
+    /* %r9 = q, %rax != 0 if bits below q are set */
+    rt_label(code, round);
+    asm_append(code, X_MOV, r9, r10);
+    asm_append(code, X_SHR, rt_imm(1), r10);
+    asm_append(code, X_TEST, rt_imm(1), r9);
+    rt_jump(code, X_JE, done);
+    asm_append(code, X_TEST, rax, rax);
+    rt_jump(code, X_JNE, label + 10);
+    asm_append(code, X_TEST, rt_imm(1), r10);
+    rt_jump(code, X_JE, done);
+    rt_label(code, label + 10);
+    asm_append(code, X_ADD, rt_imm(1), r10);
+    asm_append(code, X_CMP, rt_imm(1000000), r10);
+    rt_jump(code, X_JNE, done);
+    asm_append(code, X_MOVL, rt_imm(0), r10);
+    asm_append(code, X_ADD, rt_imm(1), r8);
+
+    rt_label(code, done);
+    asm_append(code, X_MOV, r8, rax);
+    asm_append(code, X_MOV, r10, r8);
+    rt_call(code, SYM_RT_PUT_ULONG);
+    asm_append(code, X_MOVB, rt_imm('.'), opd_mem(REG_RDI, 0));
+    asm_append(code, X_ADD, rt_imm(1), rdi);
+    asm_append(code, X_MOV, r8, rax);
+    asm_append(code, X_MOVL, rt_imm(6), r9);
+    rt_call(code, SYM_RT_PUT_DIGITS);
+    rt_emit_finish(code, 'f');
+}
+
+/*
+Append the runtime to code. Its local labels are numbered from label,
+which has to be past those of the constant pool. The values of nvars
+names live in anqoubc_vars between the chunks that use them.
+*/
+void runtime_emit(AsmList *code, int label, int nvars)
+{
+    asm_append(code, X_SECTION, rt_imm(SEC_RODATA), opd_none());
+    asm_append(code, X_LABEL, opd_of(OPD_SYM, SYM_DOUBLEFMT), opd_none());
+    asm_append(code, X_STRING, opd_of(OPD_SYM, SYM_DOUBLEFMT), opd_none());
+
+    asm_append(code, X_SECTION, rt_imm(SEC_BSS), opd_none());
+    asm_append(code, X_ALIGN, rt_imm(SZ_QWORD), opd_none());
+    asm_append(code, X_LABEL, opd_of(OPD_SYM, SYM_RT_LEN), opd_none());
+    asm_append(code, X_ZERO, rt_imm(SZ_QWORD), opd_none());
+    asm_append(code, X_LABEL, opd_of(OPD_SYM, SYM_RT_BUF), opd_none());
+    asm_append(code, X_ZERO, rt_imm(RT_BUF_SIZE), opd_none());
+    if (nvars > 0) {
+        asm_append(code, X_LABEL, opd_of(OPD_SYM, SYM_RT_VARS), opd_none());
+        asm_append(code, X_ZERO, rt_imm((long)nvars * SZ_QWORD), opd_none());
+    }
+
+    asm_append(code, X_SECTION, rt_imm(SEC_TEXT), opd_none());
+    rt_emit_flush(code, label);
+    rt_emit_put_ulong(code, label + 2);
+    rt_emit_print_long(code, label + 5);
+    rt_emit_print_double(code, label + 7);
+}
+
+/********** IR *************/
+
+/*
+A linear three-address code. Each instruction defines at most one virtual
+register and each virtual register is defined exactly once. Arithmetic
+is done in the type of its destination.
+*/
+
+/* types that only vregs have: two lanes in an %xmm register */
+enum {
+    TY_V2LONG = TY_DOUBLE + 1,
+    TY_V2DOUBLE,
+};
+
+enum {
+    IR_LOADI, /* dst = ival */
+    IR_LOADF, /* dst = fval */
+    IR_ADD,   /* dst = src1 + src2 */
+    IR_SUB,   /* dst = src1 - src2 */
+    IR_MUL,   /* dst = src1 * src2 */
+    IR_DIV,   /* dst = src1 / src2 */
+    IR_CVT,   /* dst = (double)src1 */
+    IR_PRINT, /* print src1 */
+    IR_LOADV,   /* dst = {lanes[0], lanes[1]} */
+    IR_PACK,    /* dst = {src1, src2} */
+    IR_EXTRACT, /* dst = src1[ival] */
+    IR_LOADVAR,  /* dst = the name of id ival */
+    IR_STOREVAR, /* the name of id ival = src1 */
+    IR_MULI,     /* dst = src1 * ival */
+    IR_DIVI,     /* dst = src1 / ival, where ival is not 0, 1 or -1 */
+};
+
+typedef struct {
+    int op;
+    int dst, src1, src2; /* -1 if unused */
+
+    union {
+        long ival;
+        double fval;
+        unsigned long lanes[2]; /* the bits of each lane */
+    };
+} IRInst;
+
+typedef struct {
+    int type;
+
+    /* filled by the register allocator */
+    int reg; /* -1 if the value lives in the frame */
+    int stack_idx;
+} VReg;
+
+typedef struct {
+    IRInst *insts;
+    int ninsts, rsved_insts;
+    VReg *vregs;
+    int nvregs, rsved_vregs;
+
+    int allocated;  /* true once every vreg has a location */
+    int stack_size; /* bytes of frame used by vregs */
+} IR;
+
+IR *new_ir()
+{
+    IR *ret;
+
+    ret = (IR *)malloc(sizeof(IR));
+    assert(ret != NULL);
+    ret->insts = NULL;
+    ret->ninsts = ret->rsved_insts = 0;
+    ret->vregs = NULL;
+    ret->nvregs = ret->rsved_vregs = 0;
+    ret->allocated = false;
+    ret->stack_size = 0;
+    return ret;
+}
+
+void free_ir(IR *this)
+{
+    free(this->insts);
+    free(this->vregs);
+    free(this);
+}
+
+int ir_new_vreg(IR *this, int type)
+{
+    VReg *vreg;
+
+    if (this->nvregs == this->rsved_vregs) {
+        this->rsved_vregs = max(this->rsved_vregs * 2, 16);
+        this->vregs = (VReg *)realloc(this->vregs,
+                                      sizeof(VReg) * this->rsved_vregs);
+        assert(this->vregs != NULL);
+    }
+
+    vreg = &this->vregs[this->nvregs];
+    vreg->type = type;
+    vreg->reg = -1;
+    vreg->stack_idx = 0;
+    return this->nvregs++;
+}
+
+/* The returned pointer is valid until the next append. */
+IRInst *ir_append(IR *this, int op, int dst, int src1, int src2)
+{
+    IRInst *inst;
+
+    if (this->ninsts == this->rsved_insts) {
+        this->rsved_insts = max(this->rsved_insts * 2, 16);
+        this->insts = (IRInst *)realloc(this->insts,
+                                        sizeof(IRInst) * this->rsved_insts);
+        assert(this->insts != NULL);
+    }
+
+    inst = &this->insts[this->ninsts++];
+    inst->op = op;
+    inst->dst = dst;
+    inst->src1 = src1;
+    inst->src2 = src2;
+    inst->ival = 0;
+    return inst;
+}
+
+/* Instructions that must stay even if their result is unused. */
+int ir_has_side_effect(IR *this, IRInst *inst)
+{
+    switch (inst->op) {
+        case IR_PRINT:
+        case IR_STOREVAR:
+            return true;
+
+        case IR_DIV:
+            /* idiv may trap */
+            return this->vregs[inst->dst].type == TY_LONG;
+    }
+
+    return false;
+}
+
+void dump_vreg(IR *ir, int v, FILE *fh)
+{
+    VReg *vreg = &ir->vregs[v];
+
+    fprintf(fh, "v%d", v);
+    if (!ir->allocated) return;
+    if (vreg->reg >= 0)
+        fprintf(fh, "(%s)",
+                reg64_names[pool_reg(reg_class(vreg->type), vreg->reg)]);
+    else
+        fprintf(fh, "(-%d(%%rbp))", vreg->stack_idx);
+}
+
+void dump_ir(IR *ir, FILE *fh)
+{
+    static const char *names[] = {
+        "loadi", "loadf", "add",     "sub",     "mul",     "div",
+        "cvt",   "print", "loadv",   "pack",    "extract", "loadvar",
+        "storevar", "muli", "divi"};
+    static const char *types[] = {"long", "double", "v2long", "v2double"};
+    int i;
+
+    for (i = 0; i < ir->ninsts; i++) {
+        IRInst *inst = &ir->insts[i];
+
+        fputs("    ", fh);
+        if (inst->dst >= 0) {
+            dump_vreg(ir, inst->dst, fh);
+            fprintf(fh, ":%s = ", types[ir->vregs[inst->dst].type]);
+        }
+        fputs(names[inst->op], fh);
+        switch (inst->op) {
+            case IR_LOADI:
+                fprintf(fh, " %ld", inst->ival);
+                break;
+
+            case IR_LOADF:
+                fprintf(fh, " %.17g", inst->fval);
+                break;
+
+            case IR_LOADV:
+                fprintf(fh, " 0x%lx, 0x%lx", inst->lanes[0], inst->lanes[1]);
+                break;
+
+            case IR_EXTRACT:
+                fputc(' ', fh);
+                dump_vreg(ir, inst->src1, fh);
+                fprintf(fh, "[%ld]", inst->ival);
+                break;
+
+            case IR_LOADVAR:
+                fprintf(fh, " $%ld", inst->ival);
+                break;
+
+            case IR_STOREVAR:
+                fprintf(fh, " $%ld, ", inst->ival);
+                dump_vreg(ir, inst->src1, fh);
+                break;
+
+            case IR_MULI:
+            case IR_DIVI:
+                fputc(' ', fh);
+                dump_vreg(ir, inst->src1, fh);
+                fprintf(fh, ", %ld", inst->ival);
+                break;
+
+            default:
+                fputc(' ', fh);
+                dump_vreg(ir, inst->src1, fh);
+                if (inst->src2 >= 0) {
+                    fputs(", ", fh);
+                    dump_vreg(ir, inst->src2, fh);
+                }
+        }
+        fputc('\n', fh);
+    }
+}
+
+/********** Lowering *************/
+
+/* Compute Sethi-Ullman numbers: how many registers a subtree needs. */
+int su_label(AstSpine *spine, AST *ast)
+{
+    int base = spine->size, need, rneed, i;
+
+    if (ast->need != 0) return ast->need;
+    if (ast->kind == AST_ASSIGN) {
+        ast->need = su_label(spine, ast->rhs);
+        return ast->need;
+    }
+
+    for (; ast->need == 0 && ast_is_binary_op(ast); ast = ast->lhs)
+        ast_spine_push(spine, ast);
+    if (ast->need == 0) {
+        assert(ast->kind == AST_LITERAL || ast->kind == AST_VAR);
+        ast->need = 1;
+    }
+
+    need = ast->need;
+    for (i = spine->size - 1; i >= base; i--) {
+        ast = spine->nodes[i].ast;
+        rneed = su_label(spine, ast->rhs);
+        ast->need = need == rneed ? need + 1 : max(need, rneed);
+        need = ast->need;
+    }
+    spine->size = base;
+
+    return need;
+}
+
+/*
+A name is kept in the vreg of its value for the rest of the program once
+it is assigned or first read, and stored back to memory only by its last
+assignment there, for the programs of the chunks after it.
+*/
+typedef struct {
+    IR *ir;
+    IntMap *vars;    /* name -> the vreg holding it */
+    IntMap *nassign; /* name -> assignments to it that are still ahead */
+    IntMap *cse;     /* AST.shared -> the vreg it was last computed in */
+    int stmt_vreg;   /* the first vreg of the statement being lowered */
+    AstSpine spine;  /* with the vregs of right operands lowered first */
+} LowerEnv;
+
+int lower_expr(LowerEnv *env, AST *ast);
+
+/* Convert src, which holds a value of type from, to type. */
+int lower_convert(LowerEnv *env, int src, int from, int type)
+{
+    int dst;
+
+    if (type == from) return src;
+
+    assert(type == TY_DOUBLE && from == TY_LONG);
+    dst = ir_new_vreg(env->ir, TY_DOUBLE);
+    ir_append(env->ir, IR_CVT, dst, src, -1);
+    return dst;
+}
+
+/* Lower an operand of an operation done in type. */
+int lower_operand(LowerEnv *env, AST *ast, int type)
+{
+    return lower_convert(env, lower_expr(env, ast), ast->type.kind, type);
+}
+
+/* Lower a literal or a name. */
+int lower_leaf(LowerEnv *env, AST *ast)
+{
+    IR *ir = env->ir;
+    int dst;
+
+    if (ast->kind == AST_LITERAL) {
+        dst = ir_new_vreg(ir, ast->type.kind);
+        if (ast->type.kind == TY_DOUBLE)
+            ir_append(ir, IR_LOADF, dst, -1, -1)->fval = ast->fval;
+        else
+            ir_append(ir, IR_LOADI, dst, -1, -1)->ival = ast->ival;
+        return dst;
+    }
+
+    assert(ast->kind == AST_VAR);
+    dst = int_map_get(env->vars, ast->var, -1);
+    if (dst >= 0) return dst;
+    dst = ir_new_vreg(ir, ast->type.kind);
+    ir_append(ir, IR_LOADVAR, dst, -1, -1)->ival = ast->var;
+    int_map_put(env->vars, ast->var, dst);
+    return dst;
+}
+
+/*
+Lower an expression and return the vreg holding its value. The operand
+that needs more registers is lowered first so that the other one does
+not stay live across it. Going down the spine, a right operand that goes
+first is lowered on the way; the rest are lowered on the way back up.
+*/
+int lower_expr(LowerEnv *env, AST *ast)
+{
+    static const int ops[] = {IR_ADD, IR_SUB, IR_MUL, IR_DIV};
+    AstSpine *spine = &env->spine;
+    IR *ir = env->ir;
+    int base = spine->size, dst, i;
+
+    for (;;) {
+        if (!ast_is_binary_op(ast)) {
+            dst = lower_leaf(env, ast);
+            break;
+        }
+
+        /* a shared node is computed once per statement */
+        if (ast->shared > 0) {
+            dst = int_map_get(env->cse, ast->shared, -1);
+            if (dst >= env->stmt_vreg) break;
+        }
+
+        i = ast_spine_push(spine, ast);
+        if (ast->lhs->need < ast->rhs->need) {
+            int rhs = lower_operand(env, ast->rhs, ast->type.kind);
+
+            spine->nodes[i].val = rhs;
+        }
+        ast = ast->lhs;
+    }
+
+    for (i = spine->size - 1; i >= base; i--) {
+        int type, lhs, rhs;
+
+        ast = spine->nodes[i].ast;
+        type = ast->type.kind;
+        lhs = lower_convert(env, dst, ast->lhs->type.kind, type);
+        if (ast->lhs->need >= ast->rhs->need)
+            rhs = lower_operand(env, ast->rhs, type);
+        else
+            rhs = spine->nodes[i].val;
+
+        dst = ir_new_vreg(ir, type);
+        ir_append(ir, ops[ast->kind - AST_ADD], dst, lhs, rhs);
+        if (ast->shared > 0) int_map_put(env->cse, ast->shared, dst);
+    }
+    spine->size = base;
+
+    return dst;
+}
+
+IR *lower_prog(AST *prog)
+{
+    LowerEnv env;
+    int i;
+
+    assert(prog->kind == AST_PROG);
+
+    env.ir = new_ir();
+    env.vars = new_int_map();
+    env.nassign = new_int_map();
+    env.cse = new_int_map();
+    init_ast_spine(&env.spine);
+    for (i = 0; i < prog->nstmts; i++) {
+        AST *stmt = prog->stmts[i];
+
+        if (stmt->kind == AST_ASSIGN)
+            int_map_put(env.nassign, stmt->var,
+                        int_map_get(env.nassign, stmt->var, 0) + 1);
+    }
+
+    for (i = 0; i < prog->nstmts; i++) {
+        AST *stmt = prog->stmts[i];
+        int src, left;
+
+        su_label(&env.spine, stmt);
+        env.stmt_vreg = env.ir->nvregs;
+        if (stmt->kind != AST_ASSIGN) {
+            ir_append(env.ir, IR_PRINT, -1, lower_expr(&env, stmt), -1);
+            continue;
+        }
+
+        src = lower_expr(&env, stmt->rhs);
+        int_map_put(env.vars, stmt->var, src);
+        left = int_map_get(env.nassign, stmt->var, 0) - 1;
+        int_map_put(env.nassign, stmt->var, left);
+        if (left == 0)
+            ir_append(env.ir, IR_STOREVAR, -1, src, -1)->ival = stmt->var;
+    }
+
+    free_int_map(env.vars);
+    free_int_map(env.nassign);
+    free_int_map(env.cse);
+    free(env.spine.nodes);
+    return env.ir;
+}
+
+/********** IR passes *************/
+
+/*
+Remove instructions whose results are never used. Return the number of
+removed instructions.
+*/
+int dce_ir(IR *ir)
+{
+    char *used, *keep;
+    int i, n = 0;
+
+    used = (char *)calloc(ir->nvregs + 1, sizeof(char));
+    keep = (char *)calloc(ir->ninsts + 1, sizeof(char));
+    assert(used != NULL && keep != NULL);
+
+    for (i = ir->ninsts - 1; i >= 0; i--) {
+        IRInst *inst = &ir->insts[i];
+
+        if (!ir_has_side_effect(ir, inst) && !used[inst->dst]) continue;
+        keep[i] = true;
+        if (inst->src1 >= 0) used[inst->src1] = true;
+        if (inst->src2 >= 0) used[inst->src2] = true;
+    }
+
+    for (i = 0; i < ir->ninsts; i++)
+        if (keep[i]) ir->insts[n++] = ir->insts[i];
+    i = ir->ninsts - n;
+    ir->ninsts = n;
+
+    free(used);
+    free(keep);
+    return i;
+}
+
+/*
+Split the magnitude of c into m * 2^k with an odd m, and return m if it is
+1, 3, 5 or 9, as lea and a shift then multiply by c. Otherwise return 0.
+*/
+int mul_shape(long c, int *k)
+{
+    unsigned long u = c < 0 ? -(unsigned long)c : (unsigned long)c;
+
+    *k = 0;
+    if (u == 0) return 0;
+    while ((u & 1) == 0) {
+        u >>= 1;
+        (*k)++;
+    }
+    return u == 1 || u == 3 || u == 5 || u == 9 ? (int)u : 0;
+}
+
+/*
+Turn multiplications and divisions of longs by literals into IR_MULI and
+IR_DIVI, which are emitted with shifts, lea and multiplications by magic
+numbers instead of imul and idiv. Divisions by 0 and -1 keep idiv, which
+traps on them, and a division by 1 becomes a multiplication. The literals
+are left to dce. Return the number of rewritten multiplications, and that
+of divisions in *ndivs.
+*/
+int strength_ir(IR *ir, int *ndivs)
+{
+    char *is_lit;
+    long *lit;
+    int i, nmuls = 0;
+
+    is_lit = (char *)calloc(ir->nvregs + 1, sizeof(char));
+    lit = (long *)malloc(sizeof(long) * (ir->nvregs + 1));
+    assert(is_lit != NULL && lit != NULL);
+
+    *ndivs = 0;
+    for (i = 0; i < ir->ninsts; i++) {
+        IRInst *inst = &ir->insts[i];
+        long c;
+        int k;
+
+        if (inst->op == IR_LOADI) {
+            is_lit[inst->dst] = true;
+            lit[inst->dst] = inst->ival;
+            continue;
+        }
+        if (inst->dst < 0 || ir->vregs[inst->dst].type != TY_LONG) continue;
+
+        if (inst->op == IR_MUL) {
+            /* multiplication commutes, so put a literal on the right */
+            if (!is_lit[inst->src2]) {
+                int src = inst->src1;
+
+                inst->src1 = inst->src2;
+                inst->src2 = src;
+            }
+            if (!is_lit[inst->src2]) continue;
+            c = lit[inst->src2];
+            if (mul_shape(c, &k) == 0 &&
+                (c < -2147483647L - 1 || c > 2147483647L))
+                continue;
+            nmuls++;
+        }
+        else if (inst->op == IR_DIV) {
+            if (!is_lit[inst->src2]) continue;
+            c = lit[inst->src2];
+            if (c == 0 || c == -1) continue;
+            (*ndivs)++;
+        }
+        else {
+            continue;
+        }
+
+        inst->op = inst->op == IR_MUL || c == 1 ? IR_MULI : IR_DIVI;
+        inst->ival = c;
+        inst->src2 = -1;
+    }
+
+    free(is_lit);
+    free(lit);
+    return nmuls;
+}
+
+/*
+Two adjacent statements whose instructions match one to one are computed
+together in the two lanes of %xmm registers. Double arithmetic and the
+additions and subtractions of longs are packed; everything else stays
+scalar and is packed where a packed instruction reads it. Packed longs
+are only ever built from literals, as SSE2 cannot pack general purpose
+registers cheaply. The lanes are extracted only to be printed.
+*/
+typedef struct {
+    IR *ir;
+    IRInst *insts; /* the instructions before the pass */
+    int *defpos;   /* index of the instruction defining each vreg */
+    char *escapes; /* whether a vreg is read by another statement */
+    char *packed;  /* per instruction of the statement being paired */
+    int *vec;      /* the packed vreg of those that are packed */
+} VectorizeEnv;
+
+/* The position of the definition of v in the statement at begin, or -1. */
+int vectorize_rel(VectorizeEnv *env, int v, int begin)
+{
+    if (v < 0 || env->defpos[v] < begin) return -1;
+    return env->defpos[v] - begin;
+}
+
+int vectorize_is_load(int op) { return op == IR_LOADI || op == IR_LOADF; }
+
+/* Whether the statements of n instructions at a and b are isomorphic. */
+int vectorize_match(VectorizeEnv *env, int a, int b, int n)
+{
+    int k, i;
+
+    for (k = 0; k < n; k++) {
+        IRInst *x = &env->insts[a + k], *y = &env->insts[b + k];
+        int xsrcs[2], ysrcs[2];
+
+        if (x->op != y->op || (x->dst < 0) != (y->dst < 0)) return false;
+        if (x->dst >= 0 &&
+            env->ir->vregs[x->dst].type != env->ir->vregs[y->dst].type)
+            return false;
+        /* a division that may trap has to stay in order */
+        if (x->op != IR_PRINT && ir_has_side_effect(env->ir, x)) return false;
+
+        xsrcs[0] = x->src1, xsrcs[1] = x->src2;
+        ysrcs[0] = y->src1, ysrcs[1] = y->src2;
+        for (i = 0; i < 2; i++) {
+            if ((xsrcs[i] < 0) != (ysrcs[i] < 0) ||
+                vectorize_rel(env, xsrcs[i], a) !=
+                    vectorize_rel(env, ysrcs[i], b))
+                return false;
+            /* the lanes run together, so b cannot read what a computes */
+            if (ysrcs[i] >= 0 && env->defpos[ysrcs[i]] >= a &&
+                env->defpos[ysrcs[i]] < b)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+Decide which instructions of the pair are packed. Return whether any
+arithmetic is, as packing only literals would not pay off.
+*/
+int vectorize_plan(VectorizeEnv *env, int a, int b, int n)
+{
+    IR *ir = env->ir;
+    int k, i, changed;
+
+    for (k = 0; k < n - 1; k++) {
+        IRInst *x = &env->insts[a + k];
+        int type = ir->vregs[x->dst].type;
+
+        switch (x->op) {
+            case IR_LOADI:
+            case IR_LOADF:
+            case IR_ADD:
+            case IR_SUB:
+                env->packed[k] = true;
+                break;
+            case IR_MUL:
+            case IR_DIV:
+                env->packed[k] = type == TY_DOUBLE;
+                break;
+            default:
+                env->packed[k] = false;
+        }
+        if (env->escapes[x->dst] || env->escapes[env->insts[b + k].dst])
+            env->packed[k] = false;
+    }
+    env->packed[n - 1] = false;
+
+    do {
+        changed = false;
+
+        /* packed longs need packed operands */
+        for (k = 0; k < n - 1; k++) {
+            IRInst *x = &env->insts[a + k];
+            int r1 = vectorize_rel(env, x->src1, a),
+                r2 = vectorize_rel(env, x->src2, a);
+
+            if (!env->packed[k] || ir->vregs[x->dst].type != TY_LONG ||
+                vectorize_is_load(x->op))
+                continue;
+            if (r1 < 0 || r2 < 0 || !env->packed[r1] || !env->packed[r2]) {
+                env->packed[k] = false;
+                changed = true;
+            }
+        }
+
+        /* scalar users other than the print need scalar operands */
+        for (k = n - 1; k >= 0; k--) {
+            IRInst *x = &env->insts[a + k];
+            int srcs[2];
+
+            if (env->packed[k]) continue;
+            srcs[0] = vectorize_rel(env, x->src1, a);
+            srcs[1] = vectorize_rel(env, x->src2, a);
+            for (i = 0; i < 2; i++) {
+                int r = srcs[i];
+
+                if (r < 0 || !env->packed[r]) continue;
+                if (x->op == IR_PRINT &&
+                    !vectorize_is_load(env->insts[a + r].op))
+                    continue;
+                env->packed[r] = false;
+                changed = true;
+            }
+        }
+    } while (changed);
+
+    for (k = 0; k < n - 1; k++)
+        if (env->packed[k] && !vectorize_is_load(env->insts[a + k].op))
+            return true;
+    return false;
+}
+
+/* The packed vreg for the operands x of a and y of b. */
+int vectorize_operand(VectorizeEnv *env, int a, int x, int y)
+{
+    int r = vectorize_rel(env, x, a), dst;
+
+    if (r >= 0 && env->packed[r]) return env->vec[r];
+
+    assert(env->ir->vregs[x].type == TY_DOUBLE);
+    dst = ir_new_vreg(env->ir, TY_V2DOUBLE);
+    ir_append(env->ir, IR_PACK, dst, x, y);
+    return dst;
+}
+
+void vectorize_emit_pair(VectorizeEnv *env, int a, int b, int n)
+{
+    IR *ir = env->ir;
+    IRInst *x, *y;
+    int k, r;
+
+    for (k = 0; k < n - 1; k++) {
+        IRInst *inst;
+        int dst, src1, src2;
+
+        x = &env->insts[a + k];
+        y = &env->insts[b + k];
+        if (!env->packed[k]) {
+            *ir_append(ir, x->op, x->dst, x->src1, x->src2) = *x;
+            *ir_append(ir, y->op, y->dst, y->src1, y->src2) = *y;
+            continue;
+        }
+
+        dst = ir_new_vreg(ir, ir->vregs[x->dst].type == TY_LONG
+                                  ? TY_V2LONG
+                                  : TY_V2DOUBLE);
+        env->vec[k] = dst;
+        if (vectorize_is_load(x->op)) {
+            inst = ir_append(ir, IR_LOADV, dst, -1, -1);
+            inst->lanes[0] = x->ival;
+            inst->lanes[1] = y->ival;
+            continue;
+        }
+        src1 = vectorize_operand(env, a, x->src1, y->src1);
+        src2 = vectorize_operand(env, a, x->src2, y->src2);
+        ir_append(ir, x->op, dst, src1, src2);
+    }
+
+    x = &env->insts[a + n - 1];
+    y = &env->insts[b + n - 1];
+    r = vectorize_rel(env, x->src1, a);
+    if (r >= 0 && env->packed[r]) {
+        int type = ir->vregs[x->src1].type;
+        int lo = ir_new_vreg(ir, type), hi = ir_new_vreg(ir, type);
+
+        /* the low lane last, so that it can take over the register */
+        ir_append(ir, IR_EXTRACT, hi, env->vec[r], -1)->ival = 1;
+        ir_append(ir, IR_EXTRACT, lo, env->vec[r], -1)->ival = 0;
+        ir_append(ir, IR_PRINT, -1, lo, -1);
+        ir_append(ir, IR_PRINT, -1, hi, -1);
+    }
+    else {
+        *ir_append(ir, x->op, x->dst, x->src1, x->src2) = *x;
+        *ir_append(ir, y->op, y->dst, y->src1, y->src2) = *y;
+    }
+}
+
+/* The index of the print that ends the statement at begin, or ninsts. */
+int vectorize_stmt_end(VectorizeEnv *env, int begin, int ninsts)
+{
+    while (begin < ninsts && env->insts[begin].op != IR_PRINT) begin++;
+    return begin;
+}
+
+/* Return the number of pairs of statements that got packed. */
+int vectorize_ir(IR *ir)
+{
+    VectorizeEnv env;
+    int ninsts = ir->ninsts, i, a, npairs = 0, begin = 0;
+
+    env.ir = ir;
+    env.insts = ir->insts;
+    env.defpos = (int *)malloc(sizeof(int) * (ir->nvregs + 1));
+    env.escapes = (char *)calloc(ir->nvregs + 1, sizeof(char));
+    env.packed = (char *)malloc(ninsts + 1);
+    env.vec = (int *)malloc(sizeof(int) * (ninsts + 1));
+    assert(env.defpos != NULL && env.escapes != NULL &&
+           env.packed != NULL && env.vec != NULL);
+
+    for (i = 0; i < ninsts; i++) {
+        IRInst *inst = &env.insts[i];
+
+        if (inst->dst >= 0) env.defpos[inst->dst] = i;
+        if (inst->src1 >= 0 && env.defpos[inst->src1] < begin)
+            env.escapes[inst->src1] = true;
+        if (inst->src2 >= 0 && env.defpos[inst->src2] < begin)
+            env.escapes[inst->src2] = true;
+        if (inst->op == IR_PRINT) begin = i + 1;
+    }
+
+    ir->insts = NULL;
+    ir->ninsts = ir->rsved_insts = 0;
+    for (a = 0; a < ninsts;) {
+        int ea = vectorize_stmt_end(&env, a, ninsts), b = ea + 1, eb;
+
+        eb = vectorize_stmt_end(&env, b, ninsts);
+        if (eb < ninsts && ea - a == eb - b &&
+            vectorize_match(&env, a, b, ea - a + 1) &&
+            vectorize_plan(&env, a, b, ea - a + 1)) {
+            vectorize_emit_pair(&env, a, b, ea - a + 1);
+            npairs++;
+            a = eb + 1;
+            continue;
+        }
+
+        for (; a <= ea && a < ninsts; a++) {
+            IRInst *inst = &env.insts[a];
+
+            *ir_append(ir, inst->op, inst->dst, inst->src1, inst->src2) =
+                *inst;
+        }
+    }
+
+    free(env.insts);
+    free(env.defpos);
+    free(env.escapes);
+    free(env.packed);
+    free(env.vec);
+    return npairs;
+}
+
+typedef struct {
+    IR *ir;
+    int *lastuse; /* index of the last instruction reading each vreg */
+    int *defined; /* index of the instruction defining each vreg */
+    int now;      /* index of the instruction being allocated */
+    int nregs[NUM_REG_CLASSES];
+    int owner[NUM_REG_CLASSES][MAX_NUM_REGS]; /* vreg or -1 if free */
+
+    /* freed frame slots of 8 and of 16 bytes, and when they were freed */
+    int *free_slots[2], *freed_at[2], nfree_slots[2];
+} RegAllocEnv;
+
+/*
+Give v a frame slot. A value that is spilled after its definition needs
+a slot that nobody has touched since then; one defined right now can
+take any. Packed values get 16-byte slots, aligned as their operands in
+memory have to be.
+*/
+void regalloc_assign_slot(RegAllocEnv *env, int v, int spilled)
+{
+    VReg *vreg = &env->ir->vregs[v];
+    int packed = vreg->type >= TY_V2LONG, i = env->nfree_slots[packed] - 1;
+    int since = spilled ? env->defined[v] : env->now;
+    int *slots = env->free_slots[packed], *freed_at = env->freed_at[packed];
+
+    vreg->reg = -1;
+    while (i >= 0 && freed_at[i] > since) i--;
+    if (i >= 0) {
+        vreg->stack_idx = slots[i];
+        env->nfree_slots[packed]--;
+        for (; i < env->nfree_slots[packed]; i++) {
+            slots[i] = slots[i + 1];
+            freed_at[i] = freed_at[i + 1];
+        }
+        return;
+    }
+
+    if (packed) env->ir->stack_size = (env->ir->stack_size + 15) / 16 * 16;
+    env->ir->stack_size += packed ? 2 * SZ_QWORD : SZ_QWORD;
+    vreg->stack_idx = env->ir->stack_size;
+}
+
+/* Move v to the frame for its whole lifetime. */
+void regalloc_spill(RegAllocEnv *env, int v)
+{
+    VReg *vreg = &env->ir->vregs[v];
+
+    env->owner[reg_class(vreg->type)][vreg->reg] = -1;
+    regalloc_assign_slot(env, v, true);
+}
+
+void regalloc_release(RegAllocEnv *env, int v)
+{
+    VReg *vreg = &env->ir->vregs[v];
+
+    if (vreg->reg >= 0) {
+        env->owner[reg_class(vreg->type)][vreg->reg] = -1;
+    }
+    else {
+        int packed = vreg->type >= TY_V2LONG, n = env->nfree_slots[packed]++;
+
+        env->free_slots[packed][n] = vreg->stack_idx;
+        env->freed_at[packed][n] = env->now;
+    }
+}
+
+/*
+Find a location for v, preferring the register of hint. If every register
+is taken, the value whose next use is furthest away goes to the frame.
+*/
+void regalloc_define(RegAllocEnv *env, int v, int hint)
+{
+    VReg *vregs = env->ir->vregs;
+    int cls = reg_class(vregs[v].type), i, victim = -1;
+
+    if (hint >= 0 && vregs[hint].reg >= 0 &&
+        reg_class(vregs[hint].type) == cls &&
+        env->owner[cls][vregs[hint].reg] < 0) {
+        vregs[v].reg = vregs[hint].reg;
+        env->owner[cls][vregs[v].reg] = v;
+        return;
+    }
+
+    for (i = 0; i < env->nregs[cls]; i++) {
+        int w = env->owner[cls][i];
+
+        if (w < 0) {
+            vregs[v].reg = i;
+            env->owner[cls][i] = v;
+            return;
+        }
+        if (victim < 0 || env->lastuse[w] > env->lastuse[victim]) victim = w;
+    }
+
+    if (victim >= 0 && env->lastuse[victim] > env->lastuse[v]) {
+        int reg = vregs[victim].reg;
+
+        regalloc_spill(env, victim);
+        vregs[v].reg = reg;
+        env->owner[cls][reg] = v;
+        return;
+    }
+
+    regalloc_assign_slot(env, v, false);
+}
+
+/*
+Linear scan register allocation over the straight-line IR. Without
+use_regs every vreg gets a frame slot; slots are still shared by values
+whose lifetimes do not overlap.
+*/
+void regalloc_ir(IR *ir, int use_regs)
+{
+    RegAllocEnv env;
+    int i, cls, reg;
+
+    env.ir = ir;
+    env.lastuse = (int *)malloc(sizeof(int) * (ir->nvregs + 1));
+    env.defined = (int *)malloc(sizeof(int) * (ir->nvregs + 1));
+    assert(env.lastuse != NULL && env.defined != NULL);
+    for (i = 0; i < 2; i++) {
+        env.free_slots[i] = (int *)malloc(sizeof(int) * (ir->nvregs + 1));
+        env.freed_at[i] = (int *)malloc(sizeof(int) * (ir->nvregs + 1));
+        assert(env.free_slots[i] != NULL && env.freed_at[i] != NULL);
+        env.nfree_slots[i] = 0;
+    }
+    env.nregs[RC_GP] = use_regs ? NUM_GP_REGS : 0;
+    env.nregs[RC_XMM] = use_regs ? NUM_XMM_REGS : 0;
+    for (cls = 0; cls < NUM_REG_CLASSES; cls++)
+        for (reg = 0; reg < MAX_NUM_REGS; reg++) env.owner[cls][reg] = -1;
+
+    for (i = 0; i < ir->nvregs; i++) env.lastuse[i] = -1;
+    for (i = 0; i < ir->ninsts; i++) {
+        IRInst *inst = &ir->insts[i];
+
+        if (inst->src1 >= 0) env.lastuse[inst->src1] = i;
+        if (inst->src2 >= 0) env.lastuse[inst->src2] = i;
+    }
+
+    ir->stack_size = 0;
+    for (i = 0; i < ir->ninsts; i++) {
+        IRInst *inst = &ir->insts[i];
+        int src1 = inst->src1, src2 = inst->src2, dst = inst->dst;
+
+        env.now = i;
+        if (inst->op == IR_PRINT) {
+            /* the runtime, and snprintf, clobber every register in the pool */
+            for (cls = 0; cls < NUM_REG_CLASSES; cls++) {
+                for (reg = 0; reg < env.nregs[cls]; reg++) {
+                    int w = env.owner[cls][reg];
+
+                    if (w >= 0 && env.lastuse[w] > i) regalloc_spill(&env, w);
+                }
+            }
+        }
+
+        /*
+        dst may share the register of src1 but never that of src2, which
+        is still read after dst is written, unless src2 is src1.
+        */
+        if (src1 >= 0 && env.lastuse[src1] == i) regalloc_release(&env, src1);
+        if (dst >= 0) {
+            env.defined[dst] = i;
+            regalloc_define(&env, dst, src1);
+            if (env.lastuse[dst] < 0) regalloc_release(&env, dst);
+        }
+        if (src2 >= 0 && src2 != src1 && env.lastuse[src2] == i)
+            regalloc_release(&env, src2);
+    }
+    ir->allocated = true;
+
+    free(env.lastuse);
+    free(env.defined);
+    for (i = 0; i < 2; i++) {
+        free(env.free_slots[i]);
+        free(env.freed_at[i]);
+    }
+}
+
+/********** Code generation *************/
+
+typedef struct {
+    AsmList *code;
+    ConstPool *pool;
+} ObjEnv;
+
+ObjEnv *new_objenv(ConstPool *pool)
+{
+    ObjEnv *ret;
+
+    ret = (ObjEnv *)malloc(sizeof(ObjEnv));
+    assert(ret != NULL);
+    ret->code = new_asm_list();
+    ret->pool = pool;
+    return ret;
+}
+
+void free_objenv(ObjEnv *this)
+{
+    free_asm_list(this->code);
+    free(this);
+}
+
+void objenv_emit(ObjEnv *this, int op, Operand src, Operand dst)
+{
+    asm_append(this->code, op, src, dst);
+}
+
+/* The operand of v: a register or a frame slot. */
+Operand vreg_operand(IR *ir, int v)
+{
+    VReg *vreg = &ir->vregs[v];
+
+    if (vreg->reg >= 0)
+        return opd_reg(pool_reg(reg_class(vreg->type), vreg->reg));
+    return opd_mem(REG_RBP, -vreg->stack_idx);
+}
+
+/* The register an instruction computes v in. */
+Operand vreg_target(IR *ir, int v)
+{
+    VReg *vreg = &ir->vregs[v];
+    int cls = reg_class(vreg->type);
+
+    return opd_reg(vreg->reg >= 0 ? pool_reg(cls, vreg->reg)
+                                  : scratch_reg(cls));
+}
+
+/* The instruction that copies a value of type. */
+int move_op(int type)
+{
+    if (type == TY_LONG) return X_MOV;
+    return type == TY_DOUBLE ? X_MOVSD : X_MOVAPD;
+}
+
+/* Store v from its scratch register if it lives in the frame. */
+void write_vreg_store(IR *ir, int v, ObjEnv *env)
+{
+    VReg *vreg = &ir->vregs[v];
+
+    if (vreg->reg >= 0) return;
+    objenv_emit(env, move_op(vreg->type),
+                opd_reg(scratch_reg(reg_class(vreg->type))),
+                vreg_operand(ir, v));
+}
+
+/* dst = src1 * ival with lea and shifts where mul_shape allows */
+void write_mul_imm(IR *ir, IRInst *inst, ObjEnv *env)
+{
+    Operand src = vreg_operand(ir, inst->src1),
+            target = vreg_target(ir, inst->dst);
+    int k, m = mul_shape(inst->ival, &k);
+
+    if (inst->ival == 0) {
+        objenv_emit(env, X_MOV, opd_of(OPD_IMM, 0), target);
+        write_vreg_store(ir, inst->dst, env);
+        return;
+    }
+
+    /* lea needs its operand in a register */
+    if (m == 0 || m == 1 || src.kind != OPD_REG) {
+        if (!opd_equal(&src, &target)) objenv_emit(env, X_MOV, src, target);
+        src = target;
+    }
+    if (m == 0) {
+        objenv_emit(env, X_IMUL, opd_of(OPD_IMM, inst->ival), target);
+    }
+    else {
+        /* (x,x,m-1) is x * m */
+        if (m > 1)
+            objenv_emit(env, X_LEA, opd_index(src.reg, src.reg, m - 1),
+                        target);
+        if (k > 0) objenv_emit(env, X_SHL, opd_of(OPD_IMM, k), target);
+        if (inst->ival < 0) objenv_emit(env, X_NEG, opd_none(), target);
+    }
+    write_vreg_store(ir, inst->dst, env);
+}
+
+/*
+Find the magic number m and the shift s of a division by d, which is not
+a power of two nor 0, 1 or -1: the quotient is the high half of n * m
+(plus n if d > 0 > m, minus n if d < 0 < m) shifted right by s, plus one
+if that is negative. This is the algorithm of Hacker's Delight, 10-4.
+*/
+void div_magic(long d, long *magic, int *shift)
+{
+    const unsigned long two63 = 1UL << 63;
+    unsigned long ad = d < 0 ? -(unsigned long)d : (unsigned long)d;
+    unsigned long t = two63 + ((unsigned long)d >> 63), anc, q1, r1, q2,
+                  r2, delta;
+    int p = 63;
+
+    anc = t - 1 - t % ad; /* |nc| */
+    q1 = two63 / anc;
+    r1 = two63 - q1 * anc;
+    q2 = two63 / ad;
+    r2 = two63 - q2 * ad;
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    *magic = (long)(d < 0 ? -(q2 + 1) : q2 + 1);
+    *shift = p - 64;
+}
+
+/*
+dst = src1 / ival without idiv, truncating toward zero as idiv does. A
+power of two 2^k is an arithmetic shift, after 2^k - 1 is added to a
+negative dividend. Anything else is a multiplication by the magic number
+of div_magic.
+*/
+void write_div_imm(IR *ir, IRInst *inst, ObjEnv *env)
+{
+    Operand src = vreg_operand(ir, inst->src1), rax = opd_reg(REG_RAX),
+            rdx = opd_reg(REG_RDX);
+    long d = inst->ival, magic;
+    unsigned long ad = d < 0 ? -(unsigned long)d : (unsigned long)d;
+    int k = 0;
+
+    if ((ad & (ad - 1)) == 0) {
+        while ((1UL << k) < ad) k++;
+        objenv_emit(env, X_MOV, src, rax);
+        objenv_emit(env, X_CQTO, opd_none(), opd_none());
+        objenv_emit(env, X_SHR, opd_of(OPD_IMM, 64 - k), rdx);
+        objenv_emit(env, X_ADD, rdx, rax);
+        objenv_emit(env, X_SAR, opd_of(OPD_IMM, k), rax);
+        if (d < 0) objenv_emit(env, X_NEG, opd_none(), rax);
+        objenv_emit(env, X_MOV, rax, vreg_operand(ir, inst->dst));
+        return;
+    }
+
+    div_magic(d, &magic, &k);
+    objenv_emit(env, X_MOV, opd_of(OPD_IMM, magic), rax);
+    objenv_emit(env, X_IMULQ, src, opd_none());
+    if (d > 0 && magic < 0) objenv_emit(env, X_ADD, src, rdx);
+    if (d < 0 && magic > 0) objenv_emit(env, X_SUB, src, rdx);
+    if (k > 0) objenv_emit(env, X_SAR, opd_of(OPD_IMM, k), rdx);
+    objenv_emit(env, X_MOV, rdx, rax);
+    objenv_emit(env, X_SHR, opd_of(OPD_IMM, 63), rax);
+    objenv_emit(env, X_ADD, rax, rdx);
+    objenv_emit(env, X_MOV, rdx, vreg_operand(ir, inst->dst));
+}
+
+void write_inst(IR *ir, IRInst *inst, ObjEnv *env)
+{
+    /* by IR_ADD.. and the type of dst */
+    static const int ops[][4] = {
+        {X_ADD, X_ADDSD, X_PADDQ, X_ADDPD},
+        {X_SUB, X_SUBSD, X_PSUBQ, X_SUBPD},
+        {X_IMUL, X_MULSD, X_NOP, X_MULPD},
+        {X_NOP, X_DIVSD, X_NOP, X_DIVPD},
+    };
+    Operand src1, src2, target;
+    int type, op;
+
+    switch (inst->op) {
+        case IR_LOADI:
+            objenv_emit(env, X_MOV, opd_of(OPD_IMM, inst->ival),
+                        vreg_target(ir, inst->dst));
+            write_vreg_store(ir, inst->dst, env);
+            return;
+
+        case IR_LOADF:
+            objenv_emit(env, X_MOVSD,
+                        opd_of(OPD_RIP_LABEL,
+                               const_pool_intern(env->pool, inst->fval)),
+                        vreg_target(ir, inst->dst));
+            write_vreg_store(ir, inst->dst, env);
+            return;
+
+        case IR_CVT:
+            objenv_emit(env, X_CVTSI2SDQ, vreg_operand(ir, inst->src1),
+                        vreg_target(ir, inst->dst));
+            write_vreg_store(ir, inst->dst, env);
+            return;
+
+        case IR_LOADV:
+            objenv_emit(env, X_MOVUPD,
+                        opd_of(OPD_RIP_LABEL,
+                               const_pool_intern_pair(env->pool,
+                                                      inst->lanes[0],
+                                                      inst->lanes[1])),
+                        vreg_target(ir, inst->dst));
+            write_vreg_store(ir, inst->dst, env);
+            return;
+
+        case IR_PACK:
+            src1 = vreg_operand(ir, inst->src1);
+            src2 = vreg_operand(ir, inst->src2);
+            target = vreg_target(ir, inst->dst);
+            if (src1.kind != OPD_REG)
+                objenv_emit(env, X_MOVSD, src1, target);
+            else if (!opd_equal(&src1, &target))
+                objenv_emit(env, X_MOVAPD, src1, target);
+            objenv_emit(env, src2.kind == OPD_REG ? X_UNPCKLPD : X_MOVHPD,
+                        src2, target);
+            write_vreg_store(ir, inst->dst, env);
+            return;
+
+        case IR_EXTRACT:
+            type = ir->vregs[inst->dst].type;
+            src1 = vreg_operand(ir, inst->src1);
+            target = vreg_target(ir, inst->dst);
+            if (src1.kind != OPD_REG) {
+                /* the lanes of a frame slot are just two quadwords */
+                src1.val += inst->ival * SZ_QWORD;
+                objenv_emit(env, move_op(type), src1, target);
+            }
+            else {
+                if (inst->ival == 1) {
+                    Operand low = type == TY_DOUBLE
+                                      ? target
+                                      : opd_reg(scratch_reg(RC_XMM));
+
+                    objenv_emit(env, X_MOVHLPS, src1, low);
+                    src1 = low;
+                }
+                if (type == TY_LONG)
+                    objenv_emit(env, X_MOVQ, src1, target);
+                else if (!opd_equal(&src1, &target))
+                    objenv_emit(env, X_MOVAPD, src1, target);
+            }
+            write_vreg_store(ir, inst->dst, env);
+            return;
+
+        case IR_LOADVAR:
+            type = ir->vregs[inst->dst].type;
+            objenv_emit(env, move_op(type), opd_of(OPD_RIP_VAR, inst->ival),
+                        vreg_target(ir, inst->dst));
+            write_vreg_store(ir, inst->dst, env);
+            return;
+
+        case IR_STOREVAR:
+            type = ir->vregs[inst->src1].type;
+            src1 = vreg_operand(ir, inst->src1);
+            if (src1.kind != OPD_REG) {
+                /* no memory-to-memory moves */
+                target = opd_reg(scratch_reg(reg_class(type)));
+                objenv_emit(env, move_op(type), src1, target);
+                src1 = target;
+            }
+            objenv_emit(env, move_op(type), src1,
+                        opd_of(OPD_RIP_VAR, inst->ival));
+            return;
+
+        case IR_MULI:
+            write_mul_imm(ir, inst, env);
+            return;
+
+        case IR_DIVI:
+            write_div_imm(ir, inst, env);
+            return;
+
+        case IR_PRINT: {
+            int sym;
+
+            src1 = vreg_operand(ir, inst->src1);
+            if (ir->vregs[inst->src1].type == TY_DOUBLE) {
+                target = opd_reg(REG_XMM0);
+                sym = SYM_RT_PRINT_DOUBLE;
+                if (!opd_equal(&src1, &target))
+                    objenv_emit(env, X_MOVSD, src1, target);
+            }
+            else {
+                target = opd_reg(REG_RDI);
+                sym = SYM_RT_PRINT_LONG;
+                if (!opd_equal(&src1, &target))
+                    objenv_emit(env, X_MOV, src1, target);
+            }
+            objenv_emit(env, X_CALL, opd_of(OPD_SYM, sym),
+                        opd_of(OPD_NONE, 1UL << target.reg));
+            return;
+        }
+    }
+
+    type = ir->vregs[inst->dst].type;
+    src1 = vreg_operand(ir, inst->src1);
+    src2 = vreg_operand(ir, inst->src2);
+
+    if (type == TY_LONG && inst->op == IR_DIV) {
+        objenv_emit(env, X_MOV, src1, opd_reg(REG_RAX));
+        objenv_emit(env, X_CQTO, opd_none(), opd_none());
+        objenv_emit(env, X_IDIV, src2, opd_none());
+        objenv_emit(env, X_MOV, opd_reg(REG_RAX), vreg_operand(ir, inst->dst));
+        return;
+    }
+
+    assert(IR_ADD <= inst->op && inst->op <= IR_DIV);
+    op = ops[inst->op - IR_ADD][type];
+    assert(op != X_NOP);
+
+    /* the allocator never puts dst in the register of src2 */
+    target = vreg_target(ir, inst->dst);
+    if (!opd_equal(&src1, &target))
+        objenv_emit(env, move_op(type), src1, target);
+    objenv_emit(env, op, src2, target);
+    write_vreg_store(ir, inst->dst, env);
+}
+
+/*
+Generate the machine code of ir, interning double literals into pool.
+This is only the body of main; gen_prologue and gen_epilogue go around it
+so that the bodies of several chunks can share one frame. The caller frees
+the returned list.
+*/
+AsmList *gen_asm(IR *ir, ConstPool *pool)
+{
+    ObjEnv *env;
+    AsmList *ret;
+    int i;
+
+    assert(ir->allocated);
+
+    env = new_objenv(pool);
+    for (i = 0; i < ir->ninsts; i++) write_inst(ir, &ir->insts[i], env);
+
+    ret = env->code;
+    env->code = NULL;
+    free(env);
+    return ret;
+}
+
+/* Append the allocation of a frame of stack_size bytes. */
+void gen_frame(AsmList *code, int stack_size)
+{
+    /* keep %rsp 16-byte aligned at calls */
+    if (stack_size > 0)
+        asm_append(code, X_SUB, opd_of(OPD_IMM, (stack_size + 15) / 16 * 16),
+                   opd_reg(REG_RSP));
+}
+
+/* Append the entry of main with a frame of stack_size bytes. */
+void gen_prologue(AsmList *code, int stack_size)
+{
+    asm_append(code, X_SECTION, opd_of(OPD_IMM, SEC_TEXT), opd_none());
+    asm_append(code, X_GLOBL, opd_of(OPD_SYM, SYM_MAIN), opd_none());
+    asm_append(code, X_LABEL, opd_of(OPD_SYM, SYM_MAIN), opd_none());
+    asm_append(code, X_PUSH, opd_reg(REG_RBP), opd_none());
+    asm_append(code, X_MOV, opd_reg(REG_RSP), opd_reg(REG_RBP));
+    gen_frame(code, stack_size);
+}
+
+void gen_epilogue(AsmList *code)
+{
+    asm_append(code, X_CALL, opd_of(OPD_SYM, SYM_RT_FLUSH), opd_none());
+    asm_append(code, X_MOVL, opd_of(OPD_IMM, 0), opd_reg(REG_RAX));
+    asm_append(code, X_LEAVE, opd_none(), opd_none());
+    asm_append(code, X_RET, opd_none(), opd_none());
+}
+
+/********** Peephole *************/
+
+enum {
+    PH_SELF_MOVE,
+    PH_STORE_FORWARD,
+    PH_CVT_IMM,
+    PH_FOLD_OPERAND,
+    PH_COPY_CHAIN,
+    PH_DEAD_DEF,
+    PH_DEAD_STORE,
+    NUM_PEEPHOLE_RULES,
+    PEEPHOLE_MAX_ROUNDS = 8,
+};
+
+static const char *peephole_rule_names[NUM_PEEPHOLE_RULES] = {
+    "self-move", "store-forward", "cvt-imm",    "fold-operand",
+    "copy-chain", "dead-def",     "dead-store",
+};
+
+typedef struct {
+    AsmList *code;
+    unsigned long *live_out; /* registers live after each instruction */
+    ConstPool *pool;
+    int *hits;
+} PeepholeEnv;
+
+/* %rsp and %rbp are never dead */
+#define ALWAYS_LIVE_REGS ((1UL << REG_RSP) | (1UL << REG_RBP))
+
+int x_is_directive(int op) { return op == X_NOP || op >= X_SECTION; }
+
+/* Instructions whose only effect is to write their destination. */
+int x_is_pure(int op)
+{
+    switch (op) {
+        case X_MOV:
+        case X_MOVL:
+        case X_MOVSD:
+        case X_ADD:
+        case X_SUB:
+        case X_IMUL:
+        case X_ADDSD:
+        case X_SUBSD:
+        case X_MULSD:
+        case X_DIVSD:
+        case X_CVTSI2SDQ:
+        case X_LEA:
+        case X_MOVAPD:
+        case X_MOVUPD:
+        case X_ADDPD:
+        case X_SUBPD:
+        case X_MULPD:
+        case X_DIVPD:
+        case X_PADDQ:
+        case X_PSUBQ:
+        case X_UNPCKLPD:
+        case X_MOVHPD:
+        case X_MOVHLPS:
+        case X_MOVQ:
+        case X_SHL:
+        case X_SHR:
+        case X_SAR:
+        case X_NEG:
+            return true;
+    }
+
+    return false;
+}
+
+/* Instructions that read their destination as well. */
+int x_reads_dst(int op)
+{
+    switch (op) {
+        case X_ADD:
+        case X_SUB:
+        case X_IMUL:
+        case X_ADDSD:
+        case X_SUBSD:
+        case X_MULSD:
+        case X_DIVSD:
+        case X_ADDPD:
+        case X_SUBPD:
+        case X_MULPD:
+        case X_DIVPD:
+        case X_PADDQ:
+        case X_PSUBQ:
+        case X_UNPCKLPD:
+        case X_MOVHPD:
+        case X_MOVHLPS:
+        case X_SHL:
+        case X_SHR:
+        case X_SAR:
+        case X_NEG:
+            return true;
+    }
+
+    return false;
+}
+
+int opd_is_reg(Operand *opd, int reg)
+{
+    return opd->kind == OPD_REG && opd->reg == reg;
+}
+
+int opd_is_memory(Operand *opd)
+{
+    return opd->kind == OPD_MEM || opd->kind == OPD_RIP_LABEL ||
+           opd->kind == OPD_RIP_SYM || opd->kind == OPD_RIP_VAR;
+}
+
+int opd_is_imm32(Operand *opd)
+{
+    return opd->kind == OPD_IMM && -2147483647L - 1 <= opd->val &&
+           opd->val <= 2147483647L;
+}
+
+unsigned long opd_regs(Operand *opd)
+{
+    if (opd->kind == OPD_REG || opd->kind == OPD_MEM) return 1UL << opd->reg;
+    if (opd->kind == OPD_INDEX)
+        return (1UL << opd->reg) | (1UL << opd->index);
+    return 0;
+}
+
+/* The frame slot opd refers to, or -1. */
+int opd_slot(Operand *opd)
+{
+    if (opd->kind != OPD_MEM || opd->reg != REG_RBP || opd->val >= 0)
+        return -1;
+    return -opd->val / SZ_QWORD;
+}
+
+/* Registers read and written by inst. */
+void asm_inst_regs(AsmInst *inst, unsigned long *use, unsigned long *def)
+{
+    static const unsigned long caller_saved =
+        (1UL << REG_RAX) | (1UL << REG_RCX) | (1UL << REG_RDX) |
+        (1UL << REG_RSI) | (1UL << REG_RDI) | (1UL << REG_R8) |
+        (1UL << REG_R9) | (1UL << REG_R10) | (1UL << REG_R11) |
+        (0xffffUL << REG_XMM0);
+
+    *use = opd_regs(&inst->src);
+    *def = 0;
+
+    switch (inst->op) {
+        case X_IDIV:
+            *use |= (1UL << REG_RAX) | (1UL << REG_RDX);
+            *def = (1UL << REG_RAX) | (1UL << REG_RDX);
+            return;
+
+        case X_CQTO:
+            *use = 1UL << REG_RAX;
+            *def = 1UL << REG_RDX;
+            return;
+
+        case X_IMULQ:
+        case X_MUL:
+            *use |= 1UL << REG_RAX;
+            *def = (1UL << REG_RAX) | (1UL << REG_RDX);
+            return;
+
+        case X_CALL:
+            *use = inst->dst.val;
+            *def = caller_saved;
+            return;
+
+        case X_RET:
+            *use = 1UL << REG_RAX;
+            return;
+    }
+
+    if (inst->dst.kind == OPD_REG) {
+        *def = 1UL << inst->dst.reg;
+        if (x_reads_dst(inst->op)) *use |= *def;
+    }
+    else {
+        *use |= opd_regs(&inst->dst);
+    }
+}
+
+/*
+The index of the instruction executed after the i-th one, skipping
+directives other than labels, or -1.
+*/
+int peephole_next(AsmList *code, int i)
+{
+    for (i++; i < code->size; i++) {
+        int op = code->data[i].op;
+
+        if (op == X_LABEL || !x_is_directive(op)) return i;
+    }
+
+    return -1;
+}
+
+void peephole_kill(AsmInst *inst)
+{
+    inst->op = X_NOP;
+    inst->src = inst->dst = opd_none();
+}
+
+int peephole_self_move(PeepholeEnv *env, AsmInst *a, AsmInst *b, int j)
+{
+    if ((a->op != X_MOV && a->op != X_MOVSD) || a->src.kind != OPD_REG ||
+        !opd_equal(&a->src, &a->dst))
+        return false;
+
+    peephole_kill(a);
+    return true;
+}
+
+/*
+mov %reg, slot; op slot, dst -> mov %reg, slot; op %reg, dst
+The store is left to dead-store.
+*/
+int peephole_store_forward(PeepholeEnv *env, AsmInst *a, AsmInst *b, int j)
+{
+    int gp;
+
+    if ((a->op != X_MOV && a->op != X_MOVSD) || a->src.kind != OPD_REG ||
+        opd_slot(&a->dst) < 0 || !opd_equal(&a->dst, &b->src))
+        return false;
+
+    gp = a->op == X_MOV;
+    switch (b->op) {
+        case X_MOV:
+        case X_ADD:
+        case X_SUB:
+        case X_IMUL:
+        case X_IDIV:
+        case X_CVTSI2SDQ:
+            if (!gp) return false;
+            break;
+
+        case X_MOVSD:
+        case X_ADDSD:
+        case X_SUBSD:
+        case X_MULSD:
+        case X_DIVSD:
+            if (gp) return false;
+            break;
+
+        default:
+            return false;
+    }
+
+    b->src = a->src;
+    return true;
+}
+
+/* mov $imm, %r; cvtsi2sdq %r, %xmm -> movsd .Lk(%rip), %xmm */
+int peephole_cvt_imm(PeepholeEnv *env, AsmInst *a, AsmInst *b, int j)
+{
+    if (a->op != X_MOV || a->src.kind != OPD_IMM || a->dst.kind != OPD_REG ||
+        b->op != X_CVTSI2SDQ || !opd_equal(&a->dst, &b->src) ||
+        env->live_out[j] & (1UL << a->dst.reg))
+        return false;
+
+    b->op = X_MOVSD;
+    b->src = opd_of(OPD_RIP_LABEL,
+                    const_pool_intern(env->pool, (double)a->src.val));
+    peephole_kill(a);
+    return true;
+}
+
+/* mov src, %r; op %r, %dst -> op src, %dst if op can take src directly */
+int peephole_fold_operand(PeepholeEnv *env, AsmInst *a, AsmInst *b, int j)
+{
+    int imm;
+
+    if ((a->op != X_MOV && a->op != X_MOVSD) || a->dst.kind != OPD_REG ||
+        !opd_equal(&a->dst, &b->src) || b->dst.kind != OPD_REG ||
+        opd_equal(&b->src, &b->dst) ||
+        env->live_out[j] & (1UL << a->dst.reg))
+        return false;
+
+    imm = opd_is_imm32(&a->src);
+    if (!imm && !opd_is_memory(&a->src)) return false;
+
+    switch (b->op) {
+        case X_ADD:
+        case X_SUB:
+        case X_IMUL:
+            if (a->op != X_MOV) return false;
+            break;
+
+        case X_CVTSI2SDQ:
+            if (a->op != X_MOV || imm) return false;
+            break;
+
+        case X_ADDSD:
+        case X_SUBSD:
+        case X_MULSD:
+        case X_DIVSD:
+            if (a->op != X_MOVSD) return false;
+            break;
+
+        default:
+            return false;
+    }
+
+    b->src = a->src;
+    peephole_kill(a);
+    return true;
+}
+
+/* mov src, %r; mov %r, dst -> mov src, dst */
+int peephole_copy_chain(PeepholeEnv *env, AsmInst *a, AsmInst *b, int j)
+{
+    if ((a->op != X_MOV && a->op != X_MOVSD) || a->op != b->op ||
+        a->dst.kind != OPD_REG || !opd_equal(&a->dst, &b->src) ||
+        opd_equal(&b->src, &b->dst) ||
+        env->live_out[j] & (1UL << a->dst.reg))
+        return false;
+
+    /* x86 has no memory-to-memory moves nor 64-bit immediate stores */
+    if (opd_is_memory(&b->dst) &&
+        (opd_is_memory(&a->src) ||
+         (a->src.kind == OPD_IMM && !opd_is_imm32(&a->src))))
+        return false;
+
+    b->src = a->src;
+    peephole_kill(a);
+    return true;
+}
+
+typedef int (*PeepholeRule)(PeepholeEnv *env, AsmInst *a, AsmInst *b, int j);
+
+/* rules on two consecutive instructions a and b = code->data[j] */
+static const PeepholeRule peephole_rules[] = {
+    peephole_self_move,    peephole_store_forward, peephole_cvt_imm,
+    peephole_fold_operand, peephole_copy_chain,
+};
+
+/*
+Compute live_out walking backward, removing pure instructions whose
+results are dead and stores to frame slots that are never read again.
+*/
+int peephole_backward(PeepholeEnv *env)
+{
+    AsmList *code = env->code;
+    unsigned long live = ALWAYS_LIVE_REGS;
+    char *slots;
+    int i, nslots = 1, changed = false;
+
+    for (i = 0; i < code->size; i++) {
+        nslots = max(nslots, opd_slot(&code->data[i].src) + 1);
+        nslots = max(nslots, opd_slot(&code->data[i].dst) + 1);
+    }
+    slots = (char *)calloc(nslots, sizeof(char));
+    assert(slots != NULL);
+
+    for (i = code->size - 1; i >= 0; i--) {
+        AsmInst *inst = &code->data[i];
+        unsigned long use, def;
+        int store;
+
+        env->live_out[i] = live;
+        if (x_is_directive(inst->op)) continue;
+
+        store = (inst->op == X_MOV || inst->op == X_MOVSD)
+                    ? opd_slot(&inst->dst)
+                    : -1;
+        if (store >= 0 && !slots[store]) {
+            peephole_kill(inst);
+            env->hits[PH_DEAD_STORE]++;
+            changed = true;
+            continue;
+        }
+        if (x_is_pure(inst->op) && inst->dst.kind == OPD_REG &&
+            !(live & (1UL << inst->dst.reg))) {
+            peephole_kill(inst);
+            env->hits[PH_DEAD_DEF]++;
+            changed = true;
+            continue;
+        }
+
+        asm_inst_regs(inst, &use, &def);
+        live = (live & ~def) | use | ALWAYS_LIVE_REGS;
+
+        if (store >= 0) slots[store] = false;
+        if (inst->op != X_LEA && opd_slot(&inst->src) >= 0)
+            slots[opd_slot(&inst->src)] = true;
+        if (store < 0 && opd_slot(&inst->dst) >= 0)
+            slots[opd_slot(&inst->dst)] = true;
+    }
+
+    free(slots);
+    return changed;
+}
+
+int peephole_forward(PeepholeEnv *env)
+{
+    AsmList *code = env->code;
+    int nrules = sizeof(peephole_rules) / sizeof(peephole_rules[0]);
+    int i, j, k, changed = false;
+
+    for (i = peephole_next(code, -1); i >= 0; i = j) {
+        AsmInst *a = &code->data[i], *b;
+
+        j = peephole_next(code, i);
+        if (j < 0) break;
+        b = &code->data[j];
+        if (a->op == X_LABEL || b->op == X_LABEL) continue;
+
+        for (k = 0; k < nrules; k++) {
+            if (!peephole_rules[k](env, a, b, j)) continue;
+            env->hits[k]++;
+            changed = true;
+            break;
+        }
+    }
+
+    return changed;
+}
+
+/*
+Rewrite code in place, counting how often each rule fired in hits.
+Literals the rules need are interned into pool.
+*/
+void peephole(AsmList *code, ConstPool *pool, int *hits)
+{
+    PeepholeEnv env;
+    int i, n, round;
+
+    env.code = code;
+    env.live_out = (unsigned long *)malloc(sizeof(unsigned long) *
+                                           (code->size + 1));
+    assert(env.live_out != NULL);
+    env.pool = pool;
+    env.hits = hits;
+
+    for (round = 0; round < PEEPHOLE_MAX_ROUNDS; round++) {
+        int changed = peephole_backward(&env);
+
+        if (!peephole_forward(&env) && !changed) break;
+    }
+
+    for (i = n = 0; i < code->size; i++)
+        if (code->data[i].op != X_NOP) code->data[n++] = code->data[i];
+    code->size = n;
+
+    free(env.live_out);
+}
+
+/********** Machine code *************/
+
+enum {
+    NUM_SECTIONS = SEC_BSS + 1,
+    EXE_BASE_ADDR = 0x400000,
+    EXE_PAGE_SIZE = 0x1000,
+};
+
+/* where a label or a symbol is defined */
+typedef struct {
+    int sec; /* -1 if not defined */
+    long offset;
+} Location;
+
+/* A pc-relative field to be filled once addresses are known. */
+typedef struct {
+    int sec;
+    long offset;
+    int size;       /* 1 for short jumps, otherwise 4 */
+    Operand target; /* OPD_LABEL or OPD_SYM */
+    long addend;    /* added to the address of target */
+    int got;        /* refer to the GOT entry of target instead */
+} Fixup;
+
+typedef struct {
+    ByteBuf *secs[NUM_SECTIONS];
+    int cur;
+    int exe; /* external functions are called through the GOT */
+
+    Location *labels;
+    int nlabels;
+    Location syms[NUM_SYMS];
+    int global[NUM_SYMS];
+
+    Fixup *fixups;
+    int nfixups, rsved_fixups;
+} Assembler;
+
+/* the functions called through the GOT, in the order of its entries */
+enum {
+    NUM_GOT_SYMS = 2,
+};
+static const int got_syms[NUM_GOT_SYMS] = {SYM_SNPRINTF, SYM_EXIT};
+
+int sym_is_external(int sym) { return sym == SYM_SNPRINTF || sym == SYM_EXIT; }
+
+int fits_int8(long val) { return -128 <= val && val <= 127; }
+
+/* the 4-bit number of a register in ModRM, SIB and REX */
+int reg_enc(int reg) { return reg >= REG_XMM0 ? reg - REG_XMM0 : reg; }
+
+Assembler *new_assembler(int exe)
+{
+    Assembler *ret;
+    int i;
+
+    ret = (Assembler *)malloc(sizeof(Assembler));
+    assert(ret != NULL);
+    for (i = 0; i < NUM_SECTIONS; i++) ret->secs[i] = new_byte_buf();
+    ret->cur = SEC_TEXT;
+    ret->exe = exe;
+    ret->labels = NULL;
+    ret->nlabels = 0;
+    for (i = 0; i < NUM_SYMS; i++) {
+        ret->syms[i].sec = -1;
+        ret->global[i] = sym_is_external(i);
+    }
+    ret->fixups = NULL;
+    ret->nfixups = ret->rsved_fixups = 0;
+    return ret;
+}
+
+void free_assembler(Assembler *this)
+{
+    int i;
+
+    for (i = 0; i < NUM_SECTIONS; i++) free_byte_buf(this->secs[i]);
+    free(this->labels);
+    free(this->fixups);
+    free(this);
+}
+
+long as_offset(Assembler *this) { return this->secs[this->cur]->size; }
+
+void as_byte(Assembler *this, int byte)
+{
+    byte_buf_putc(this->secs[this->cur], (char)byte);
+}
+
+/* Write the lowest size bytes of val in little endian. */
+void as_le(Assembler *this, unsigned long val, int size)
+{
+    int i;
+
+    for (i = 0; i < size; i++) as_byte(this, (val >> (i * 8)) & 0xff);
+}
+
+void as_define(Assembler *this, Operand *opd)
+{
+    Location *loc;
+
+    if (opd->kind == OPD_SYM) {
+        loc = &this->syms[opd->val];
+    }
+    else {
+        assert(opd->kind == OPD_LABEL);
+        if (opd->val >= this->nlabels) {
+            int n = max(opd->val + 1, this->nlabels * 2), i;
+
+            this->labels =
+                (Location *)realloc(this->labels, sizeof(Location) * n);
+            assert(this->labels != NULL);
+            for (i = this->nlabels; i < n; i++) this->labels[i].sec = -1;
+            this->nlabels = n;
+        }
+        loc = &this->labels[opd->val];
+    }
+
+    assert(loc->sec < 0);
+    loc->sec = this->cur;
+    loc->offset = as_offset(this);
+}
+
+/* Leave a zero field to be filled with target + addend - field. */
+void as_fixup(Assembler *this, int kind, long target, long addend, int got,
+              int size)
+{
+    Fixup *fixup;
+
+    if (this->nfixups == this->rsved_fixups) {
+        this->rsved_fixups = max(this->rsved_fixups * 2, 64);
+        this->fixups = (Fixup *)realloc(this->fixups,
+                                        sizeof(Fixup) * this->rsved_fixups);
+        assert(this->fixups != NULL);
+    }
+
+    fixup = &this->fixups[this->nfixups++];
+    fixup->sec = this->cur;
+    fixup->offset = as_offset(this);
+    fixup->target = opd_of(kind, target);
+    fixup->size = size;
+    fixup->addend = addend;
+    fixup->got = got;
+    as_le(this, 0, size);
+}
+
+/*
+Encode [prefix] [REX] opcode ModRM [SIB] [disp]. reg is a register or
+the digit of /digit opcodes. opcode holds oplen bytes, the first one in
+the highest byte. nimm is the size of the immediate that follows, which
+%rip-relative operands have to skip.
+*/
+void as_modrm(Assembler *this, int prefix, int rexw, long opcode, int oplen,
+              int reg, Operand *rm, int nimm)
+{
+    int rex = 0x40 | (rexw << 3) | ((reg_enc(reg) >> 3) << 2), i;
+
+    if (rm->kind == OPD_REG || rm->kind == OPD_MEM || rm->kind == OPD_INDEX)
+        rex |= reg_enc(rm->reg) >> 3;
+    if (rm->kind == OPD_INDEX) rex |= (reg_enc(rm->index) >> 3) << 1;
+
+    if (prefix != 0) as_byte(this, prefix);
+    if (rex != 0x40) as_byte(this, rex);
+    for (i = oplen - 1; i >= 0; i--) as_byte(this, (opcode >> (i * 8)) & 0xff);
+
+    reg = (reg_enc(reg) & 7) << 3;
+    switch (rm->kind) {
+        case OPD_REG:
+            as_byte(this, 0xc0 | reg | (reg_enc(rm->reg) & 7));
+            return;
+
+        case OPD_MEM: {
+            int base = reg_enc(rm->reg) & 7, mod;
+
+            /* base %rbp/%r13 with mod 0 means %rip or no base */
+            if (rm->val == 0 && base != 5)
+                mod = 0x00;
+            else if (fits_int8(rm->val))
+                mod = 0x40;
+            else
+                mod = 0x80;
+            as_byte(this, mod | reg | base);
+            /* %rsp/%r12 as a base needs a SIB byte */
+            if (base == 4) as_byte(this, 0x24);
+            if (mod == 0x40) as_le(this, rm->val, 1);
+            if (mod == 0x80) as_le(this, rm->val, 4);
+            return;
+        }
+
+        case OPD_INDEX: {
+            int base = reg_enc(rm->reg) & 7, scale = 0;
+
+            while ((1L << scale) < rm->val) scale++;
+            /* %rsp cannot be an index */
+            assert(rm->index != REG_RSP);
+            /* nor can %rbp/%r13 be a base without a displacement */
+            as_byte(this, (base == 5 ? 0x44 : 0x04) | reg);
+            as_byte(this, (scale << 6) | ((reg_enc(rm->index) & 7) << 3) |
+                              base);
+            if (base == 5) as_byte(this, 0);
+            return;
+        }
+
+        case OPD_RIP_LABEL:
+        case OPD_RIP_SYM:
+            as_byte(this, 0x05 | reg);
+            as_fixup(this, rm->kind == OPD_RIP_LABEL ? OPD_LABEL : OPD_SYM,
+                     rm->val, -4 - nimm, false, 4);
+            return;
+
+        case OPD_RIP_VAR:
+            as_byte(this, 0x05 | reg);
+            as_fixup(this, OPD_SYM, SYM_RT_VARS, rm->val * SZ_QWORD - 4 - nimm,
+                     false, 4);
+            return;
+    }
+
+    assert(false);
+}
+
+/* Encode the usual ALU forms: op r/m, r; op r, r/m; op $imm, r/m. */
+void as_alu(Assembler *this, AsmInst *inst, int op_to_rm, int op_from_rm,
+            int digit)
+{
+    if (inst->src.kind == OPD_IMM) {
+        assert(opd_is_imm32(&inst->src));
+        if (fits_int8(inst->src.val)) {
+            as_modrm(this, 0, 1, 0x83, 1, digit, &inst->dst, 1);
+            as_le(this, inst->src.val, 1);
+        }
+        else if (inst->dst.kind == OPD_REG && inst->dst.reg == REG_RAX) {
+            /* gas prefers the short accumulator form */
+            as_byte(this, 0x48);
+            as_byte(this, op_to_rm + 4);
+            as_le(this, inst->src.val, 4);
+        }
+        else {
+            as_modrm(this, 0, 1, 0x81, 1, digit, &inst->dst, 4);
+            as_le(this, inst->src.val, 4);
+        }
+    }
+    else if (inst->src.kind == OPD_REG) {
+        as_modrm(this, 0, 1, op_to_rm, 1, inst->src.reg, &inst->dst, 0);
+    }
+    else {
+        assert(inst->dst.kind == OPD_REG);
+        as_modrm(this, 0, 1, op_from_rm, 1, inst->dst.reg, &inst->src, 0);
+    }
+}
+
+void as_mov(Assembler *this, AsmInst *inst)
+{
+    Operand *src = &inst->src, *dst = &inst->dst;
+
+    if (src->kind == OPD_IMM && dst->kind == OPD_REG &&
+        !opd_is_imm32(src)) {
+        /* movabs */
+        as_byte(this, 0x48 | (reg_enc(dst->reg) >> 3));
+        as_byte(this, 0xb8 | (reg_enc(dst->reg) & 7));
+        as_le(this, src->val, 8);
+    }
+    else if (src->kind == OPD_IMM) {
+        assert(opd_is_imm32(src));
+        as_modrm(this, 0, 1, 0xc7, 1, 0, dst, 4);
+        as_le(this, src->val, 4);
+    }
+    else if (src->kind == OPD_REG) {
+        as_modrm(this, 0, 1, 0x89, 1, src->reg, dst, 0);
+    }
+    else {
+        assert(dst->kind == OPD_REG);
+        as_modrm(this, 0, 1, 0x8b, 1, dst->reg, src, 0);
+    }
+}
+
+void as_string(Assembler *this, const char *str)
+{
+    for (; *str != '\0'; str++) as_byte(this, *str);
+    as_byte(this, 0);
+}
+
+/* Encode one record into the current section. */
+void as_inst(Assembler *this, AsmInst *inst)
+{
+    Operand *src = &inst->src, *dst = &inst->dst;
+
+    switch (inst->op) {
+        case X_NOP:
+            return;
+
+        case X_MOV:
+            as_mov(this, inst);
+            return;
+
+        case X_MOVL:
+            if (src->kind == OPD_IMM) {
+                if (reg_enc(dst->reg) >= 8) as_byte(this, 0x41);
+                as_byte(this, 0xb8 | (reg_enc(dst->reg) & 7));
+                as_le(this, src->val, 4);
+            }
+            else {
+                as_modrm(this, 0, 0, 0x89, 1, src->reg, dst, 0);
+            }
+            return;
+
+        case X_MOVSD:
+            if (dst->kind == OPD_REG)
+                as_modrm(this, 0xf2, 0, 0x0f10, 2, dst->reg, src, 0);
+            else
+                as_modrm(this, 0xf2, 0, 0x0f11, 2, src->reg, dst, 0);
+            return;
+
+        case X_ADD:
+            as_alu(this, inst, 0x01, 0x03, 0);
+            return;
+
+        case X_SUB:
+            as_alu(this, inst, 0x29, 0x2b, 5);
+            return;
+
+        case X_IMUL:
+            if (src->kind == OPD_IMM) {
+                assert(opd_is_imm32(src));
+                if (fits_int8(src->val)) {
+                    as_modrm(this, 0, 1, 0x6b, 1, dst->reg, dst, 1);
+                    as_le(this, src->val, 1);
+                }
+                else {
+                    as_modrm(this, 0, 1, 0x69, 1, dst->reg, dst, 4);
+                    as_le(this, src->val, 4);
+                }
+            }
+            else {
+                as_modrm(this, 0, 1, 0x0faf, 2, dst->reg, src, 0);
+            }
+            return;
+
+        case X_IDIV:
+            as_modrm(this, 0, 1, 0xf7, 1, 7, src, 0);
+            return;
+
+        case X_CQTO:
+            as_byte(this, 0x48);
+            as_byte(this, 0x99);
+            return;
+
+        case X_ADDSD:
+            as_modrm(this, 0xf2, 0, 0x0f58, 2, dst->reg, src, 0);
+            return;
+
+        case X_SUBSD:
+            as_modrm(this, 0xf2, 0, 0x0f5c, 2, dst->reg, src, 0);
+            return;
+
+        case X_MULSD:
+            as_modrm(this, 0xf2, 0, 0x0f59, 2, dst->reg, src, 0);
+            return;
+
+        case X_DIVSD:
+            as_modrm(this, 0xf2, 0, 0x0f5e, 2, dst->reg, src, 0);
+            return;
+
+        case X_CVTSI2SDQ:
+            as_modrm(this, 0xf2, 1, 0x0f2a, 2, dst->reg, src, 0);
+            return;
+
+        case X_LEA:
+            as_modrm(this, 0, 1, 0x8d, 1, dst->reg, src, 0);
+            return;
+
+        case X_CALL:
+            assert(src->kind == OPD_SYM);
+            if (this->exe && sym_is_external(src->val)) {
+                /* call *sym@GOT(%rip) */
+                as_byte(this, 0xff);
+                as_byte(this, 0x15);
+                as_fixup(this, OPD_SYM, src->val, -4, true, 4);
+            }
+            else {
+                as_byte(this, 0xe8);
+                as_fixup(this, OPD_SYM, src->val, -4, false, 4);
+            }
+            return;
+
+        case X_PUSH:
+            if (reg_enc(src->reg) >= 8) as_byte(this, 0x41);
+            as_byte(this, 0x50 | (reg_enc(src->reg) & 7));
+            return;
+
+        case X_LEAVE:
+            as_byte(this, 0xc9);
+            return;
+
+        case X_RET:
+            as_byte(this, 0xc3);
+            return;
+
+        case X_MOVAPD:
+            if (dst->kind == OPD_REG)
+                as_modrm(this, 0x66, 0, 0x0f28, 2, dst->reg, src, 0);
+            else
+                as_modrm(this, 0x66, 0, 0x0f29, 2, src->reg, dst, 0);
+            return;
+
+        case X_MOVUPD:
+            as_modrm(this, 0x66, 0, 0x0f10, 2, dst->reg, src, 0);
+            return;
+
+        case X_ADDPD:
+            as_modrm(this, 0x66, 0, 0x0f58, 2, dst->reg, src, 0);
+            return;
+
+        case X_SUBPD:
+            as_modrm(this, 0x66, 0, 0x0f5c, 2, dst->reg, src, 0);
+            return;
+
+        case X_MULPD:
+            as_modrm(this, 0x66, 0, 0x0f59, 2, dst->reg, src, 0);
+            return;
+
+        case X_DIVPD:
+            as_modrm(this, 0x66, 0, 0x0f5e, 2, dst->reg, src, 0);
+            return;
+
+        case X_PADDQ:
+            as_modrm(this, 0x66, 0, 0x0fd4, 2, dst->reg, src, 0);
+            return;
+
+        case X_PSUBQ:
+            as_modrm(this, 0x66, 0, 0x0ffb, 2, dst->reg, src, 0);
+            return;
+
+        case X_UNPCKLPD:
+            as_modrm(this, 0x66, 0, 0x0f14, 2, dst->reg, src, 0);
+            return;
+
+        case X_MOVHPD:
+            as_modrm(this, 0x66, 0, 0x0f16, 2, dst->reg, src, 0);
+            return;
+
+        case X_MOVHLPS:
+            as_modrm(this, 0, 0, 0x0f12, 2, dst->reg, src, 0);
+            return;
+
+        case X_MOVQ:
+            as_modrm(this, 0x66, 1, 0x0f7e, 2, src->reg, dst, 0);
+            return;
+
+        case X_MOVB:
+            if (src->kind == OPD_IMM) {
+                as_modrm(this, 0, 0, 0xc6, 1, 0, dst, 1);
+                as_le(this, src->val, 1);
+            }
+            else {
+                /* without REX these would be %ah, %ch, %dh and %bh */
+                assert(src->reg < REG_RSP);
+                as_modrm(this, 0, 0, 0x88, 1, src->reg, dst, 0);
+            }
+            return;
+
+        case X_CMP:
+            as_alu(this, inst, 0x39, 0x3b, 7);
+            return;
+
+        case X_TEST:
+            if (src->kind == OPD_IMM) {
+                as_modrm(this, 0, 1, 0xf7, 1, 0, dst, 4);
+                as_le(this, src->val, 4);
+            }
+            else {
+                as_modrm(this, 0, 1, 0x85, 1, src->reg, dst, 0);
+            }
+            return;
+
+        case X_AND:
+            as_alu(this, inst, 0x21, 0x23, 4);
+            return;
+
+        case X_OR:
+            as_alu(this, inst, 0x09, 0x0b, 1);
+            return;
+
+        case X_SHL:
+        case X_SHR:
+        case X_SAR: {
+            int digit = inst->op == X_SHL ? 4 : inst->op == X_SHR ? 5 : 7;
+
+            if (src->kind == OPD_REG) {
+                assert(src->reg == REG_RCX);
+                as_modrm(this, 0, 1, 0xd3, 1, digit, dst, 0);
+            }
+            else if (src->val == 1) {
+                as_modrm(this, 0, 1, 0xd1, 1, digit, dst, 0);
+            }
+            else {
+                as_modrm(this, 0, 1, 0xc1, 1, digit, dst, 1);
+                as_le(this, src->val, 1);
+            }
+            return;
+        }
+
+        case X_IMULQ:
+            as_modrm(this, 0, 1, 0xf7, 1, 5, src, 0);
+            return;
+
+        case X_MUL:
+            as_modrm(this, 0, 1, 0xf7, 1, 4, src, 0);
+            return;
+
+        case X_NEG:
+            as_modrm(this, 0, 1, 0xf7, 1, 3, dst, 0);
+            return;
+
+        case X_SYSCALL:
+            as_byte(this, 0x0f);
+            as_byte(this, 0x05);
+            return;
+
+        case X_JMP:
+        case X_JB:
+        case X_JAE:
+        case X_JE:
+        case X_JNE:
+        case X_JBE:
+        case X_JA:
+        case X_JNS:
+        case X_JLE:
+        case X_JG: {
+            /* the condition codes of X_JB... */
+            static const int conds[] = {0x2, 0x3, 0x4, 0x5, 0x6,
+                                        0x7, 0x9, 0xe, 0xf};
+
+            assert(src->kind == OPD_LABEL);
+            if (inst->op == X_JMP)
+                as_byte(this, 0xeb);
+            else
+                as_byte(this, 0x70 | conds[inst->op - X_JB]);
+            as_fixup(this, OPD_LABEL, src->val, -1, false, 1);
+            return;
+        }
+
+        case X_SECTION:
+            this->cur = src->val;
+            return;
+
+        case X_GLOBL:
+            this->global[src->val] = true;
+            return;
+
+        case X_LABEL:
+            as_define(this, src);
+            return;
+
+        case X_ALIGN:
+            while (as_offset(this) % src->val != 0) as_byte(this, 0);
+            return;
+
+        case X_QUAD:
+            as_le(this, src->val, 8);
+            return;
+
+        case X_STRING:
+            as_string(this, sym_strings[src->val]);
+            return;
+
+        case X_ZERO: {
+            long i;
+
+            for (i = 0; i < src->val; i++) as_byte(this, 0);
+            return;
+        }
+    }
+
+    assert(false);
+}
+
+void assemble(Assembler *this, AsmList *code)
+{
+    int i;
+
+    for (i = 0; i < code->size; i++) as_inst(this, &code->data[i]);
+}
+
+Location *as_target(Assembler *this, Operand *target)
+{
+    Location *loc = target->kind == OPD_SYM ? &this->syms[target->val]
+                                            : &this->labels[target->val];
+
+    assert(target->kind == OPD_SYM || target->val < this->nlabels);
+    return loc;
+}
+
+/* Fill the field of fixup with val. */
+void as_patch(Assembler *this, Fixup *fixup, long val)
+{
+    char *p = this->secs[fixup->sec]->data + fixup->offset;
+    int i;
+
+    if (fixup->size == 1)
+        assert(fits_int8(val));
+    else
+        assert(-2147483647L - 1 <= val && val <= 2147483647L);
+    for (i = 0; i < fixup->size; i++) p[i] = (val >> (i * 8)) & 0xff;
+}
+
+/*
+Fill the fixups of .text, given where each section and the GOT will be
+in memory.
+*/
+void as_link(Assembler *this, unsigned long *sec_addr, unsigned long got_addr)
+{
+    int i, j;
+
+    for (i = 0; i < this->nfixups; i++) {
+        Fixup *fixup = &this->fixups[i];
+        unsigned long target, field;
+
+        assert(fixup->sec == SEC_TEXT);
+        field = sec_addr[SEC_TEXT] + fixup->offset;
+        if (fixup->got) {
+            for (j = 0; got_syms[j] != fixup->target.val; j++)
+                assert(j + 1 < NUM_GOT_SYMS);
+            target = got_addr + j * 8;
+        }
+        else {
+            Location *loc = as_target(this, &fixup->target);
+
+            assert(loc->sec >= 0);
+            target = sec_addr[loc->sec] + loc->offset;
+        }
+        as_patch(this, fixup, target + fixup->addend - field);
+    }
+}
+
+/* ELF section header indexes of the object file */
+enum {
+    OBJ_SHN_TEXT = 1,
+    OBJ_SHN_DATA,
+    OBJ_SHN_BSS,
+    OBJ_SHN_RODATA,
+    OBJ_SHN_RELA_TEXT,
+    OBJ_SHN_SYMTAB,
+    OBJ_SHN_STRTAB,
+    OBJ_SHN_SHSTRTAB,
+    OBJ_SHN_NOTE_STACK,
+    OBJ_NUM_SHDRS,
+};
+
+void byte_buf_align(ByteBuf *this, size_t align)
+{
+    while (this->size % align != 0) byte_buf_putc(this, 0);
+}
+
+/* Append a NUL-terminated string and return its offset. */
+int byte_buf_add_str(ByteBuf *this, const char *str)
+{
+    size_t ret = this->size;
+
+    byte_buf_append(this, str, strlen(str) + 1);
+    return ret;
+}
+
+/*
+Write a relocatable object. References to the data sections are
+relocated against their section symbols; the calls of the runtime to
+snprintf get R_X86_64_PLT32 against an undefined snprintf.
+*/
+void write_elf_obj(AsmList *code, FILE *fh)
+{
+    static const int sec_shndx[NUM_SECTIONS] = {OBJ_SHN_DATA, OBJ_SHN_RODATA,
+                                                OBJ_SHN_TEXT, OBJ_SHN_BSS};
+    Assembler *as;
+    ByteBuf *out, *symtab, *strtab, *shstrtab, *rela;
+    Elf64_Ehdr ehdr;
+    Elf64_Shdr shdrs[OBJ_NUM_SHDRS];
+    Elf64_Sym sym;
+    int sym_index[NUM_SYMS], nlocals, i, name[OBJ_NUM_SHDRS];
+
+    as = new_assembler(false);
+    assemble(as, code);
+
+    /* null, then the section symbols in the order of SEC_* */
+    symtab = new_byte_buf();
+    strtab = new_byte_buf();
+    byte_buf_add_str(strtab, "");
+    memset(&sym, 0, sizeof(sym));
+    byte_buf_append(symtab, (char *)&sym, sizeof(sym));
+    for (i = 0; i < NUM_SECTIONS; i++) {
+        sym.st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+        sym.st_shndx = sec_shndx[i];
+        byte_buf_append(symtab, (char *)&sym, sizeof(sym));
+    }
+    nlocals = 1 + NUM_SECTIONS;
+    for (i = 0; i < NUM_SYMS; i++) {
+        sym_index[i] = -1;
+        if (!as->global[i] || (as->syms[i].sec < 0 && !sym_is_external(i)))
+            continue;
+        memset(&sym, 0, sizeof(sym));
+        sym.st_name = byte_buf_add_str(strtab, sym_names[i]);
+        if (as->syms[i].sec >= 0) {
+            sym.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+            sym.st_shndx = sec_shndx[as->syms[i].sec];
+            sym.st_value = as->syms[i].offset;
+        }
+        else {
+            sym.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+            sym.st_shndx = SHN_UNDEF;
+        }
+        sym_index[i] = symtab->size / sizeof(sym);
+        byte_buf_append(symtab, (char *)&sym, sizeof(sym));
+    }
+
+    rela = new_byte_buf();
+    for (i = 0; i < as->nfixups; i++) {
+        Fixup *fixup = &as->fixups[i];
+        Location *loc = as_target(as, &fixup->target);
+        int local = fixup->target.kind == OPD_LABEL ||
+                    !as->global[fixup->target.val];
+        Elf64_Rela r;
+
+        /* only the code refers to other places */
+        assert(fixup->sec == SEC_TEXT && !fixup->got);
+        if (local && loc->sec == fixup->sec) {
+            /* known already, as gas does */
+            as_patch(as, fixup, loc->offset + fixup->addend - fixup->offset);
+            continue;
+        }
+
+        assert(fixup->size == 4);
+        r.r_offset = fixup->offset;
+        if (local) {
+            assert(loc->sec >= 0);
+            r.r_info = ELF64_R_INFO(1 + loc->sec, R_X86_64_PC32);
+            r.r_addend = loc->offset + fixup->addend;
+        }
+        else {
+            assert(sym_index[fixup->target.val] >= 0);
+            r.r_info = ELF64_R_INFO(sym_index[fixup->target.val],
+                                    loc->sec < 0 ? R_X86_64_PLT32
+                                                 : R_X86_64_PC32);
+            r.r_addend = fixup->addend;
+        }
+        byte_buf_append(rela, (char *)&r, sizeof(r));
+    }
+
+    shstrtab = new_byte_buf();
+    name[0] = byte_buf_add_str(shstrtab, "");
+    name[OBJ_SHN_TEXT] = byte_buf_add_str(shstrtab, ".text");
+    name[OBJ_SHN_DATA] = byte_buf_add_str(shstrtab, ".data");
+    name[OBJ_SHN_BSS] = byte_buf_add_str(shstrtab, ".bss");
+    name[OBJ_SHN_RODATA] = byte_buf_add_str(shstrtab, ".rodata");
+    name[OBJ_SHN_RELA_TEXT] = byte_buf_add_str(shstrtab, ".rela.text");
+    name[OBJ_SHN_SYMTAB] = byte_buf_add_str(shstrtab, ".symtab");
+    name[OBJ_SHN_STRTAB] = byte_buf_add_str(shstrtab, ".strtab");
+    name[OBJ_SHN_SHSTRTAB] = byte_buf_add_str(shstrtab, ".shstrtab");
+    name[OBJ_SHN_NOTE_STACK] = byte_buf_add_str(shstrtab, ".note.GNU-stack");
+
+    memset(shdrs, 0, sizeof(shdrs));
+    for (i = 1; i < OBJ_NUM_SHDRS; i++) {
+        shdrs[i].sh_name = name[i];
+        shdrs[i].sh_type = SHT_PROGBITS;
+        shdrs[i].sh_addralign = 1;
+    }
+    shdrs[OBJ_SHN_TEXT].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+    shdrs[OBJ_SHN_TEXT].sh_addralign = 16;
+    shdrs[OBJ_SHN_DATA].sh_flags = SHF_ALLOC | SHF_WRITE;
+    shdrs[OBJ_SHN_BSS].sh_type = SHT_NOBITS;
+    shdrs[OBJ_SHN_BSS].sh_flags = SHF_ALLOC | SHF_WRITE;
+    shdrs[OBJ_SHN_BSS].sh_size = as->secs[SEC_BSS]->size;
+    shdrs[OBJ_SHN_BSS].sh_addralign = SZ_QWORD;
+    shdrs[OBJ_SHN_RODATA].sh_flags = SHF_ALLOC;
+    shdrs[OBJ_SHN_RODATA].sh_addralign = SZ_DOUBLE;
+    shdrs[OBJ_SHN_RELA_TEXT].sh_type = SHT_RELA;
+    shdrs[OBJ_SHN_RELA_TEXT].sh_flags = SHF_INFO_LINK;
+    shdrs[OBJ_SHN_RELA_TEXT].sh_link = OBJ_SHN_SYMTAB;
+    shdrs[OBJ_SHN_RELA_TEXT].sh_info = OBJ_SHN_TEXT;
+    shdrs[OBJ_SHN_RELA_TEXT].sh_entsize = sizeof(Elf64_Rela);
+    shdrs[OBJ_SHN_RELA_TEXT].sh_addralign = 8;
+    shdrs[OBJ_SHN_SYMTAB].sh_type = SHT_SYMTAB;
+    shdrs[OBJ_SHN_SYMTAB].sh_link = OBJ_SHN_STRTAB;
+    shdrs[OBJ_SHN_SYMTAB].sh_info = nlocals;
+    shdrs[OBJ_SHN_SYMTAB].sh_entsize = sizeof(Elf64_Sym);
+    shdrs[OBJ_SHN_SYMTAB].sh_addralign = 8;
+    shdrs[OBJ_SHN_STRTAB].sh_type = SHT_STRTAB;
+    shdrs[OBJ_SHN_SHSTRTAB].sh_type = SHT_STRTAB;
+
+    /* lay the contents out after the ELF header */
+    out = new_byte_buf();
+    byte_buf_reserve(out, sizeof(ehdr));
+    out->size = sizeof(ehdr);
+    for (i = 1; i < OBJ_NUM_SHDRS; i++) {
+        ByteBuf *content = NULL;
+
+        switch (i) {
+            case OBJ_SHN_TEXT:
+                content = as->secs[SEC_TEXT];
+                break;
+            case OBJ_SHN_DATA:
+                content = as->secs[SEC_DATA];
+                break;
+            case OBJ_SHN_RODATA:
+                content = as->secs[SEC_RODATA];
+                break;
+            case OBJ_SHN_RELA_TEXT:
+                content = rela;
+                break;
+            case OBJ_SHN_SYMTAB:
+                content = symtab;
+                break;
+            case OBJ_SHN_STRTAB:
+                content = strtab;
+                break;
+            case OBJ_SHN_SHSTRTAB:
+                content = shstrtab;
+                break;
+        }
+
+        byte_buf_align(out, shdrs[i].sh_addralign);
+        shdrs[i].sh_offset = out->size;
+        if (content == NULL) continue;
+        shdrs[i].sh_size = content->size;
+        if (content->size > 0)
+            byte_buf_append(out, content->data, content->size);
+    }
+    byte_buf_align(out, 8);
+
+    memset(&ehdr, 0, sizeof(ehdr));
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    ehdr.e_type = ET_REL;
+    ehdr.e_machine = EM_X86_64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_shoff = out->size;
+    ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr.e_shentsize = sizeof(Elf64_Shdr);
+    ehdr.e_shnum = OBJ_NUM_SHDRS;
+    ehdr.e_shstrndx = OBJ_SHN_SHSTRTAB;
+    memcpy(out->data, &ehdr, sizeof(ehdr));
+    byte_buf_append(out, (char *)shdrs, sizeof(shdrs));
+
+    fwrite(out->data, 1, out->size, fh);
+
+    free_byte_buf(out);
+    free_byte_buf(symtab);
+    free_byte_buf(strtab);
+    free_byte_buf(shstrtab);
+    free_byte_buf(rela);
+    free_assembler(as);
+}
+
+/*
+Write a non-PIE executable that needs no linker: the runtime calls
+snprintf, and _start calls main and passes its result to exit, both
+through a GOT that the dynamic loader fills from libc.so.6.
+*/
+void write_elf_exe(AsmList *code, FILE *fh)
+{
+    static const char interp[] = "/lib64/ld-linux-x86-64.so.2";
+    enum {
+        NUM_PHDRS = 5,
+        NUM_DYNS = 10,
+    };
+    Assembler *as;
+    ByteBuf *out, *dynstr;
+    Elf64_Ehdr ehdr;
+    Elf64_Phdr phdrs[NUM_PHDRS];
+    Elf64_Sym dynsym[1 + NUM_GOT_SYMS];
+    Elf64_Rela rela[NUM_GOT_SYMS];
+    Elf64_Dyn dyn[NUM_DYNS];
+    Elf32_Word hash[2 + 1 + 1 + NUM_GOT_SYMS];
+    unsigned long sec_addr[NUM_SECTIONS], got_addr;
+    size_t interp_off, dynsym_off, dynstr_off, hash_off, rela_off,
+        sec_off[NUM_SECTIONS], rw_off, dyn_off, got_off;
+    AsmList *stub;
+    int i, libc;
+
+    /* _start: call main; mov %eax, %edi; call *exit@GOT(%rip) */
+    stub = new_asm_list();
+    asm_append(stub, X_SECTION, opd_of(OPD_IMM, SEC_TEXT), opd_none());
+    asm_append(stub, X_LABEL, opd_of(OPD_SYM, SYM_START), opd_none());
+    asm_append(stub, X_CALL, opd_of(OPD_SYM, SYM_MAIN), opd_none());
+    asm_append(stub, X_MOVL, opd_reg(REG_RAX), opd_reg(REG_RDI));
+    asm_append(stub, X_CALL, opd_of(OPD_SYM, SYM_EXIT),
+               opd_of(OPD_NONE, 1UL << REG_RDI));
+    as = new_assembler(true);
+    assemble(as, code);
+    assemble(as, stub);
+    free_asm_list(stub);
+
+    dynstr = new_byte_buf();
+    byte_buf_add_str(dynstr, "");
+    libc = byte_buf_add_str(dynstr, "libc.so.6");
+    memset(dynsym, 0, sizeof(dynsym));
+    for (i = 0; i < NUM_GOT_SYMS; i++) {
+        dynsym[1 + i].st_name =
+            byte_buf_add_str(dynstr, sym_names[got_syms[i]]);
+        dynsym[1 + i].st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+    }
+
+    /* a single empty bucket: nothing is looked up in this file */
+    memset(hash, 0, sizeof(hash));
+    hash[0] = 1;
+    hash[1] = 1 + NUM_GOT_SYMS;
+
+    /* the read-only segment: headers, dynamic linking tables and code */
+    out = new_byte_buf();
+    byte_buf_reserve(out, sizeof(ehdr) + sizeof(phdrs));
+    memset(out->data, 0, sizeof(ehdr) + sizeof(phdrs));
+    out->size = sizeof(ehdr) + sizeof(phdrs);
+    interp_off = out->size;
+    byte_buf_append(out, interp, sizeof(interp));
+    byte_buf_align(out, 8);
+    dynsym_off = out->size;
+    byte_buf_append(out, (char *)dynsym, sizeof(dynsym));
+    dynstr_off = out->size;
+    byte_buf_append(out, dynstr->data, dynstr->size);
+    byte_buf_align(out, 8);
+    hash_off = out->size;
+    byte_buf_append(out, (char *)hash, sizeof(hash));
+    byte_buf_align(out, 8);
+    rela_off = out->size;
+    byte_buf_append(out, (char *)rela, sizeof(rela)); /* filled later */
+    byte_buf_align(out, 16);
+    sec_off[SEC_TEXT] = out->size;
+    byte_buf_append(out, as->secs[SEC_TEXT]->data, as->secs[SEC_TEXT]->size);
+    byte_buf_align(out, 16);
+    sec_off[SEC_RODATA] = out->size;
+    if (as->secs[SEC_RODATA]->size > 0)
+        byte_buf_append(out, as->secs[SEC_RODATA]->data,
+                        as->secs[SEC_RODATA]->size);
+
+    /* the writable segment starts on a new page */
+    byte_buf_align(out, EXE_PAGE_SIZE);
+    rw_off = dyn_off = out->size;
+    byte_buf_append(out, (char *)dyn, sizeof(dyn)); /* filled later */
+    got_off = out->size;
+    byte_buf_reserve(out, NUM_GOT_SYMS * 8);
+    memset(out->data + out->size, 0, NUM_GOT_SYMS * 8);
+    out->size += NUM_GOT_SYMS * 8;
+    sec_off[SEC_DATA] = out->size;
+    if (as->secs[SEC_DATA]->size > 0)
+        byte_buf_append(out, as->secs[SEC_DATA]->data,
+                        as->secs[SEC_DATA]->size);
+    /* .bss only takes memory */
+    byte_buf_align(out, SZ_QWORD);
+    sec_off[SEC_BSS] = out->size;
+
+    for (i = 0; i < NUM_SECTIONS; i++)
+        sec_addr[i] = EXE_BASE_ADDR + sec_off[i];
+    got_addr = EXE_BASE_ADDR + got_off;
+
+    as_link(as, sec_addr, got_addr);
+    memcpy(out->data + sec_off[SEC_TEXT], as->secs[SEC_TEXT]->data,
+           as->secs[SEC_TEXT]->size);
+
+    for (i = 0; i < NUM_GOT_SYMS; i++) {
+        rela[i].r_offset = got_addr + i * 8;
+        rela[i].r_info = ELF64_R_INFO(1 + i, R_X86_64_GLOB_DAT);
+        rela[i].r_addend = 0;
+    }
+    memcpy(out->data + rela_off, rela, sizeof(rela));
+
+    memset(dyn, 0, sizeof(dyn));
+    dyn[0].d_tag = DT_NEEDED;
+    dyn[0].d_un.d_val = libc;
+    dyn[1].d_tag = DT_HASH;
+    dyn[1].d_un.d_ptr = EXE_BASE_ADDR + hash_off;
+    dyn[2].d_tag = DT_STRTAB;
+    dyn[2].d_un.d_ptr = EXE_BASE_ADDR + dynstr_off;
+    dyn[3].d_tag = DT_SYMTAB;
+    dyn[3].d_un.d_ptr = EXE_BASE_ADDR + dynsym_off;
+    dyn[4].d_tag = DT_STRSZ;
+    dyn[4].d_un.d_val = dynstr->size;
+    dyn[5].d_tag = DT_SYMENT;
+    dyn[5].d_un.d_val = sizeof(Elf64_Sym);
+    dyn[6].d_tag = DT_RELA;
+    dyn[6].d_un.d_ptr = EXE_BASE_ADDR + rela_off;
+    dyn[7].d_tag = DT_RELASZ;
+    dyn[7].d_un.d_val = sizeof(rela);
+    dyn[8].d_tag = DT_RELAENT;
+    dyn[8].d_un.d_val = sizeof(Elf64_Rela);
+    dyn[9].d_tag = DT_NULL;
+    memcpy(out->data + dyn_off, dyn, sizeof(dyn));
+
+    memset(phdrs, 0, sizeof(phdrs));
+    phdrs[0].p_type = PT_INTERP;
+    phdrs[0].p_flags = PF_R;
+    phdrs[0].p_offset = interp_off;
+    phdrs[0].p_vaddr = phdrs[0].p_paddr = EXE_BASE_ADDR + interp_off;
+    phdrs[0].p_filesz = phdrs[0].p_memsz = sizeof(interp);
+    phdrs[0].p_align = 1;
+    phdrs[1].p_type = PT_LOAD;
+    phdrs[1].p_flags = PF_R | PF_X;
+    phdrs[1].p_offset = 0;
+    phdrs[1].p_vaddr = phdrs[1].p_paddr = EXE_BASE_ADDR;
+    phdrs[1].p_filesz = phdrs[1].p_memsz = rw_off;
+    phdrs[1].p_align = EXE_PAGE_SIZE;
+    phdrs[2].p_type = PT_LOAD;
+    phdrs[2].p_flags = PF_R | PF_W;
+    phdrs[2].p_offset = rw_off;
+    phdrs[2].p_vaddr = phdrs[2].p_paddr = EXE_BASE_ADDR + rw_off;
+    phdrs[2].p_filesz = out->size - rw_off;
+    phdrs[2].p_memsz = phdrs[2].p_filesz + as->secs[SEC_BSS]->size;
+    phdrs[2].p_align = EXE_PAGE_SIZE;
+    phdrs[3].p_type = PT_DYNAMIC;
+    phdrs[3].p_flags = PF_R | PF_W;
+    phdrs[3].p_offset = dyn_off;
+    phdrs[3].p_vaddr = phdrs[3].p_paddr = EXE_BASE_ADDR + dyn_off;
+    phdrs[3].p_filesz = phdrs[3].p_memsz = sizeof(dyn);
+    phdrs[3].p_align = 8;
+    phdrs[4].p_type = PT_GNU_STACK;
+    phdrs[4].p_flags = PF_R | PF_W;
+    phdrs[4].p_align = 16;
+
+    memset(&ehdr, 0, sizeof(ehdr));
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    ehdr.e_type = ET_EXEC;
+    ehdr.e_machine = EM_X86_64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_entry = sec_addr[SEC_TEXT] + as->syms[SYM_START].offset;
+    ehdr.e_phoff = sizeof(ehdr);
+    ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr.e_phentsize = sizeof(Elf64_Phdr);
+    ehdr.e_phnum = NUM_PHDRS;
+    memcpy(out->data, &ehdr, sizeof(ehdr));
+    memcpy(out->data + sizeof(ehdr), phdrs, sizeof(phdrs));
+
+    fwrite(out->data, 1, out->size, fh);
+
+    free_byte_buf(out);
+    free_byte_buf(dynstr);
+    free_assembler(as);
+}
+
+/*
+Load the code into this process and call its main: .text and .rodata go
+to an executable page, .data, the GOT and .bss to a writable one after
+it.
+*/
+int jit_run(AsmList *code)
+{
+    Assembler *as = new_assembler(true);
+    unsigned long sec_addr[NUM_SECTIONS], got[NUM_GOT_SYMS];
+    size_t sec_off[NUM_SECTIONS], rw_off, got_off, size;
+    char *base;
+    int (*entry)(void), i, ret;
+
+    assemble(as, code);
+    assert(as->syms[SYM_MAIN].sec == SEC_TEXT);
+
+    sec_off[SEC_TEXT] = 0;
+    sec_off[SEC_RODATA] = (as->secs[SEC_TEXT]->size + 15) / 16 * 16;
+    rw_off = sec_off[SEC_RODATA] + as->secs[SEC_RODATA]->size;
+    rw_off = (rw_off + EXE_PAGE_SIZE - 1) / EXE_PAGE_SIZE * EXE_PAGE_SIZE;
+    sec_off[SEC_DATA] = rw_off;
+    got_off = (sec_off[SEC_DATA] + as->secs[SEC_DATA]->size + 7) / 8 * 8;
+    sec_off[SEC_BSS] = got_off + sizeof(got);
+    size = sec_off[SEC_BSS] + as->secs[SEC_BSS]->size;
+
+    base = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(base != MAP_FAILED);
+
+    /* in the order of got_syms */
+    got[0] = (unsigned long)snprintf;
+    got[1] = (unsigned long)exit;
+    memcpy(base + got_off, got, sizeof(got));
+    for (i = 0; i < NUM_SECTIONS; i++)
+        sec_addr[i] = (unsigned long)(base + sec_off[i]);
+    as_link(as, sec_addr, (unsigned long)(base + got_off));
+    for (i = 0; i < NUM_SECTIONS; i++) {
+        if (as->secs[i]->size == 0) continue;
+        memcpy(base + sec_off[i], as->secs[i]->data, as->secs[i]->size);
+    }
+    if (mprotect(base, rw_off, PROT_READ | PROT_EXEC) != 0) assert(false);
+
+    entry = (int (*)(void))(base + as->syms[SYM_MAIN].offset);
+    free_assembler(as);
+    /* the code writes to the file descriptor directly */
+    fflush(stdout);
+    ret = entry();
+
+    fflush(stdout);
+    munmap(base, size);
+    return ret;
+}
+
+/********** Interpreter *************/
+
+/*
+A register-based bytecode compiled from the AST, so that programs can be
+run without the backend and the toolchain. It evaluates the unfolded AST
+and thereby serves as the reference for the native code.
+*/
+
+/* the suffix is the type of the operands */
+enum {
+    BC_LOAD, /* r[dst] = consts[a] */
+    BC_MOVE, /* r[dst] = r[a] */
+    BC_CVT,  /* r[dst].fval = r[a].ival */
+    BC_ADDL, /* r[dst] = r[a] op r[b] */
+    BC_SUBL,
+    BC_MULL,
+    BC_DIVL,
+    BC_ADDD,
+    BC_SUBD,
+    BC_MULD,
+    BC_DIVD,
+    BC_PRINTL, /* print r[a] */
+    BC_PRINTD,
+    BC_HALT,
+    NUM_BC_OPS,
+};
+
+typedef union {
+    long ival;
+    double fval;
+} BCValue;
+
+typedef struct {
+    const void *label; /* the handler of op, filled by bc_run */
+    int op, dst, a, b;
+} BCInst;
+
+typedef struct {
+    BCInst *insts;
+    int ninsts, rsved_insts;
+    BCValue *consts;
+    int nconsts, rsved_consts;
+    int nregs;
+    int threaded; /* the labels are filled */
+} Bytecode;
+
+Bytecode *new_bytecode()
+{
+    Bytecode *ret;
+
+    ret = (Bytecode *)malloc(sizeof(Bytecode));
+    assert(ret != NULL);
+    ret->insts = NULL;
+    ret->ninsts = ret->rsved_insts = 0;
+    ret->consts = NULL;
+    ret->nconsts = ret->rsved_consts = 0;
+    ret->nregs = 0;
+    ret->threaded = false;
+    return ret;
+}
+
+void free_bytecode(Bytecode *this)
+{
+    if (this == NULL) return;
+    free(this->insts);
+    free(this->consts);
+    free(this);
+}
+
+void bc_emit(Bytecode *this, int op, int dst, int a, int b)
+{
+    BCInst *inst;
+
+    if (this->ninsts == this->rsved_insts) {
+        this->rsved_insts = max(this->rsved_insts * 2, 256);
+        this->insts = (BCInst *)realloc(this->insts,
+                                        sizeof(BCInst) * this->rsved_insts);
+        assert(this->insts != NULL);
+    }
+
+    inst = &this->insts[this->ninsts++];
+    inst->label = NULL;
+    inst->op = op;
+    inst->dst = dst;
+    inst->a = a;
+    inst->b = b;
+}
+
+int bc_const(Bytecode *this, BCValue val)
+{
+    if (this->nconsts == this->rsved_consts) {
+        this->rsved_consts = max(this->rsved_consts * 2, 256);
+        this->consts = (BCValue *)realloc(
+            this->consts, sizeof(BCValue) * this->rsved_consts);
+        assert(this->consts != NULL);
+    }
+
+    this->consts[this->nconsts] = val;
+    return this->nconsts++;
+}
+
+/*
+Compile ast so that its value ends up in r[reg]. Every operation on the
+spine keeps its left operand in r[reg] and its right one in r[reg + 1].
+*/
+void bc_compile_expr(Bytecode *this, AstSpine *spine, AST *ast, int reg)
+{
+    static const int ops[2][4] = {{BC_ADDL, BC_SUBL, BC_MULL, BC_DIVL},
+                                  {BC_ADDD, BC_SUBD, BC_MULD, BC_DIVD}};
+    int base = spine->size, is_double, i;
+
+    this->nregs = max(this->nregs, reg + 1);
+
+    for (; ast_is_binary_op(ast); ast = ast->lhs) ast_spine_push(spine, ast);
+    if (ast->kind == AST_LITERAL) {
+        BCValue val;
+
+        if (ast->type.kind == TY_DOUBLE)
+            val.fval = ast->fval;
+        else
+            val.ival = ast->ival;
+        bc_emit(this, BC_LOAD, reg, bc_const(this, val), 0);
+    }
+    else {
+        assert(ast->kind == AST_VAR);
+        bc_emit(this, BC_MOVE, reg, ast->var, 0);
+    }
+
+    for (i = spine->size - 1; i >= base; i--) {
+        ast = spine->nodes[i].ast;
+        is_double = ast->type.kind == TY_DOUBLE;
+        if (is_double && ast->lhs->type.kind == TY_LONG)
+            bc_emit(this, BC_CVT, reg, reg, 0);
+        bc_compile_expr(this, spine, ast->rhs, reg + 1);
+        if (is_double && ast->rhs->type.kind == TY_LONG)
+            bc_emit(this, BC_CVT, reg + 1, reg + 1, 0);
+        bc_emit(this, ops[is_double][ast->kind - AST_ADD], reg, reg, reg + 1);
+    }
+    spine->size = base;
+}
+
+/* The name of id i lives in r[i]; the registers after nvars are scratch. */
+Bytecode *bc_compile(AST *prog, int nvars)
+{
+    Bytecode *bc = new_bytecode();
+    AstSpine spine;
+    int i;
+
+    assert(prog->kind == AST_PROG);
+    init_ast_spine(&spine);
+    bc->nregs = nvars;
+    for (i = 0; i < prog->nstmts; i++) {
+        AST *stmt = prog->stmts[i];
+
+        if (stmt->kind == AST_ASSIGN) {
+            bc_compile_expr(bc, &spine, stmt->rhs, nvars);
+            bc_emit(bc, BC_MOVE, stmt->var, nvars, 0);
+            continue;
+        }
+        bc_compile_expr(bc, &spine, stmt, nvars);
+        bc_emit(bc, stmt->type.kind == TY_DOUBLE ? BC_PRINTD : BC_PRINTL,
+                0, nvars, 0);
+    }
+    bc_emit(bc, BC_HALT, 0, 0, 0);
+    free(spine.nodes);
+
+    return bc;
+}
+
+/*
+Dispatch jumps straight to the handler stored in each instruction where
+the compiler takes the address of labels, and goes through a switch
+elsewhere.
+*/
+#ifdef __GNUC__
+#define BC_CASE(op) L_##op:
+#define BC_NEXT goto *(++pc)->label
+#else
+#define BC_CASE(op) case BC_##op:
+#define BC_NEXT \
+    pc++;       \
+    continue
+#endif
+
+/* Run the bytecode, printing the values of the statements to fh. */
+void bc_run(Bytecode *this, FILE *fh)
+{
+    BCValue *r;
+    BCInst *pc = this->insts;
+
+#ifdef __GNUC__
+    static const void *labels[NUM_BC_OPS] = {
+        &&L_LOAD, &&L_MOVE, &&L_CVT,  &&L_ADDL, &&L_SUBL,   &&L_MULL,
+        &&L_DIVL, &&L_ADDD, &&L_SUBD, &&L_MULD, &&L_DIVD,   &&L_PRINTL,
+        &&L_PRINTD, &&L_HALT};
+
+    if (!this->threaded) {
+        int i;
+
+        for (i = 0; i < this->ninsts; i++)
+            this->insts[i].label = labels[this->insts[i].op];
+        this->threaded = true;
+    }
+#endif
+
+    r = (BCValue *)malloc(sizeof(BCValue) * max(this->nregs, 1));
+    assert(r != NULL);
+
+#ifdef __GNUC__
+    goto *pc->label;
+#else
+    for (;;) switch (pc->op) {
+#endif
+
+    BC_CASE(LOAD)
+    r[pc->dst] = this->consts[pc->a];
+    BC_NEXT;
+
+    BC_CASE(MOVE)
+    r[pc->dst] = r[pc->a];
+    BC_NEXT;
+
+    BC_CASE(CVT)
+    r[pc->dst].fval = (double)r[pc->a].ival;
+    BC_NEXT;
+
+    /* add, sub and imul wrap around */
+    BC_CASE(ADDL)
+    r[pc->dst].ival =
+        (long)((unsigned long)r[pc->a].ival + (unsigned long)r[pc->b].ival);
+    BC_NEXT;
+
+    BC_CASE(SUBL)
+    r[pc->dst].ival =
+        (long)((unsigned long)r[pc->a].ival - (unsigned long)r[pc->b].ival);
+    BC_NEXT;
+
+    BC_CASE(MULL)
+    r[pc->dst].ival =
+        (long)((unsigned long)r[pc->a].ival * (unsigned long)r[pc->b].ival);
+    BC_NEXT;
+
+    /* idiv traps on these; do what the native code does */
+    BC_CASE(DIVL)
+    if (r[pc->b].ival == 0 ||
+        (r[pc->a].ival == LONG_MIN && r[pc->b].ival == -1))
+        raise(SIGFPE);
+    r[pc->dst].ival = r[pc->a].ival / r[pc->b].ival;
+    BC_NEXT;
+
+    BC_CASE(ADDD)
+    r[pc->dst].fval = r[pc->a].fval + r[pc->b].fval;
+    BC_NEXT;
+
+    BC_CASE(SUBD)
+    r[pc->dst].fval = r[pc->a].fval - r[pc->b].fval;
+    BC_NEXT;
+
+    BC_CASE(MULD)
+    r[pc->dst].fval = r[pc->a].fval * r[pc->b].fval;
+    BC_NEXT;
+
+    BC_CASE(DIVD)
+    r[pc->dst].fval = r[pc->a].fval / r[pc->b].fval;
+    BC_NEXT;
+
+    BC_CASE(PRINTL)
+    fprintf(fh, sym_strings[SYM_LONGFMT], r[pc->a].ival);
+    BC_NEXT;
+
+    BC_CASE(PRINTD)
+    fprintf(fh, sym_strings[SYM_DOUBLEFMT], r[pc->a].fval);
+    BC_NEXT;
+
+    BC_CASE(HALT)
+    free(r);
+    return;
+
+#ifndef __GNUC__
+    }
+#endif
+}
+
+#undef BC_CASE
+#undef BC_NEXT
+
+/********** Pass pipeline *************/
+
+/* passes that can be switched with -f<name> / -fno-<name> */
+enum {
+    OPT_FOLD,
+    OPT_DCE,
+    OPT_REGALLOC,
+    OPT_PEEPHOLE,
+    OPT_VECTORIZE,
+    OPT_CSE,
+    OPT_STRENGTH,
+    NUM_OPTS,
+};
+
+static const char *opt_names[NUM_OPTS] = {
+    "fold", "dce", "regalloc", "peephole", "vectorize", "cse", "strength"};
+
+/* what --emit= writes to DST */
+enum {
+    EMIT_ASM,
+    EMIT_OBJ,
+    EMIT_EXE,
+    EMIT_RUN,    /* --run: no DST, the code is called in this process */
+    EMIT_INTERP, /* --interp: no DST, the AST is run as bytecode */
+    NUM_EMITS,
+};
+
+/* the JSON written to stderr */
+enum {
+    REPORT_NONE,
+    REPORT_STATS, /* --stats: the totals of every phase */
+    REPORT_TRACE, /* --trace: and then every chunk on its own */
+};
+
+/* the default of --cache-limit= */
+enum { CACHE_LIMIT_MB = 256 };
+
+static const char *emit_names[NUM_EMITS] = {"asm", "obj", "exe", "run",
+                                            "interp"};
+
+typedef struct {
+    int verbose;
+    int time_passes; /* -ftime-passes */
+    int dump_ir;     /* -fdump-ir */
+    int stats;       /* -fstats */
+    int emit;        /* --emit=, EMIT_* */
+    int jobs;        /* -j<n>: threads that compile chunks */
+    int report;      /* --stats or --trace, REPORT_* */
+    const char *cache_dir; /* --cache=, or NULL */
+    long cache_limit;      /* --cache-limit=, in bytes */
+    int enabled[NUM_OPTS];
+    FILE *report_fh; /* stderr, or that of the client under --server */
+} Options;
+
+/* what a phase did to one chunk, summed over the chunks by compile */
+typedef struct {
+    double msec;      /* CPU time of the thread that ran it */
+    double wall_msec;
+    long runs;
+    long nallocs, nbytes; /* from the arena of the chunk */
+    int has_ir, has_code; /* which of the counts below mean anything */
+    long ninsts, nvregs, nrecords;
+} PassStats;
+
+/* where a phase started, see phase_start */
+typedef struct {
+    double cpu, wall;
+    size_t nallocs, used;
+} PhaseMark;
+
+/*
+One chunk of the source, compiled on its own into the body of main. Labels
+of its pool are numbered from 0 until label_base is added to them.
+*/
+typedef struct {
+    Options *opts;
+    const char *src;
+    size_t size;
+    SymTab *syms; /* shared by the chunks of the program */
+    Arena *arena;
+    TokenList *tokens;
+    char *path; /* of the entry in the cache, or NULL */
+    AST *prog;
+    IR *ir;
+    AsmList *code;
+    ConstPool *pool;
+    int stack_size;
+    int label_base;
+    ByteBuf *text; /* code rendered for --emit=asm */
+
+    PassStats *stats; /* one per phase, PHASE_* after the passes */
+    PhaseMark mark;
+    double epoch, begin_ms, end_ms; /* wall clock, for --trace */
+    int id;
+    long ntokens, nnodes;
+    ByteBuf *trace; /* the chunks so far, in the total */
+    int npairs;
+    long cse_saved, cse_reused; /* AST nodes and values, see hashcons_ast */
+    long nmuls, ndivs;          /* by literals, see strength_ir */
+    int hits[NUM_PEEPHOLE_RULES];
+    long peephole_in;
+    size_t arena_used, arena_peak;
+    int cache_hits, cache_misses, cache_evicted;
+} CompileEnv;
+
+void options_set_level(Options *this, int level)
+{
+    int i;
+
+    for (i = 0; i < NUM_OPTS; i++) this->enabled[i] = level >= 1;
+}
+
+void init_options(Options *this)
+{
+    this->verbose = this->time_passes = this->dump_ir = this->stats = false;
+    this->emit = EMIT_ASM;
+    this->jobs = 1;
+    this->report = REPORT_NONE;
+    this->cache_dir = NULL;
+    this->cache_limit = (long)CACHE_LIMIT_MB * 1024 * 1024;
+    options_set_level(this, 1);
+    this->report_fh = stderr;
+}
+
+/*
+Handle -v, -j<n>, -O<level>, -f<flag>, --emit=<kind>, --run, --interp,
+--stats, --trace, --cache=<dir> and --cache-limit=<MiB>. Return false for
+anything else.
+*/
+int options_parse(Options *this, const char *arg)
+{
+    int i, enable = true;
+
+    if (strcmp(arg, "-v") == 0) {
+        this->verbose = true;
+        return true;
+    }
+    if (strncmp(arg, "-j", 2) == 0) {
+        char *end;
+        long n = strtol(arg + 2, &end, 10);
+
+        if (*end != '\0' || n < 1 || n > 256) return false;
+        this->jobs = n;
+        return true;
+    }
+    if (strcmp(arg, "--run") == 0) {
+        this->emit = EMIT_RUN;
+        return true;
+    }
+    if (strcmp(arg, "--interp") == 0) {
+        this->emit = EMIT_INTERP;
+        return true;
+    }
+    if (strcmp(arg, "--stats") == 0 || strcmp(arg, "--trace") == 0) {
+        this->report = arg[2] == 's' ? REPORT_STATS : REPORT_TRACE;
+        return true;
+    }
+    if (strncmp(arg, "--cache=", 8) == 0) {
+        this->cache_dir = arg + 8;
+        return *this->cache_dir != '\0';
+    }
+    if (strncmp(arg, "--cache-limit=", 14) == 0) {
+        char *end;
+        long n = strtol(arg + 14, &end, 10);
+
+        if (*end != '\0' || end == arg + 14 || n < 0) return false;
+        this->cache_limit = n * 1024 * 1024;
+        return true;
+    }
+    if (strncmp(arg, "--emit=", 7) == 0) {
+        for (i = 0; i < NUM_EMITS; i++) {
+            if (strcmp(arg + 7, emit_names[i]) == 0) {
+                this->emit = i;
+                return true;
+            }
+        }
+        return false;
+    }
+    if (strcmp(arg, "-O0") == 0 || strcmp(arg, "-O1") == 0) {
+        options_set_level(this, arg[2] - '0');
+        return true;
+    }
+    if (strncmp(arg, "-f", 2) != 0) return false;
+    arg += 2;
+
+    if (strcmp(arg, "time-passes") == 0) {
+        this->time_passes = true;
+        return true;
+    }
+    if (strcmp(arg, "dump-ir") == 0) {
+        this->dump_ir = true;
+        return true;
+    }
+    if (strcmp(arg, "stats") == 0) {
+        this->stats = true;
+        return true;
+    }
+
+    if (strncmp(arg, "no-", 3) == 0) {
+        enable = false;
+        arg += 3;
+    }
+    for (i = 0; i < NUM_OPTS; i++) {
+        if (strcmp(arg, opt_names[i]) == 0) {
+            this->enabled[i] = enable;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+Sort argv into options, which go to this, and SRC and DST. Return false
+if they do not make a command line that usage shows.
+*/
+int options_parse_args(Options *this, int argc, char **argv, const char **src,
+                       const char **dst)
+{
+    int i;
+
+    *src = *dst = NULL;
+    for (i = 1; i < argc; i++) {
+        if (options_parse(this, argv[i])) continue;
+        if (*src == NULL)
+            *src = argv[i];
+        else if (*dst == NULL)
+            *dst = argv[i];
+        else
+            return false;
+    }
+
+    return *src != NULL && (*dst == NULL) == (this->emit == EMIT_RUN ||
+                                              this->emit == EMIT_INTERP);
+}
+
+void pass_fold(CompileEnv *env)
+{
+    env->prog = fold_ast(env->arena, env->prog);
+}
+
+void pass_cse(CompileEnv *env)
+{
+    env->cse_saved += hashcons_ast(env->prog, &env->cse_reused);
+}
+
+void pass_lower(CompileEnv *env) { env->ir = lower_prog(env->prog); }
+
+void pass_strength(CompileEnv *env)
+{
+    int ndivs;
+
+    env->nmuls += strength_ir(env->ir, &ndivs);
+    env->ndivs += ndivs;
+}
+
+void pass_dce(CompileEnv *env) { dce_ir(env->ir); }
+
+void pass_vectorize(CompileEnv *env) { env->npairs += vectorize_ir(env->ir); }
+
+void pass_regalloc(CompileEnv *env)
+{
+    regalloc_ir(env->ir, env->opts->enabled[OPT_REGALLOC]);
+}
+
+void pass_isel(CompileEnv *env)
+{
+    env->code = gen_asm(env->ir, env->pool);
+    env->stack_size = env->ir->stack_size;
+}
+
+void pass_peephole(CompileEnv *env)
+{
+    env->peephole_in += env->code->size;
+    peephole(env->code, env->pool, env->hits);
+}
+
+typedef struct {
+    const char *name;
+    int opt; /* index into Options.enabled, or -1 if always run */
+    void (*run)(CompileEnv *env);
+} Pass;
+
+/*
+regalloc always runs because the emitter needs a location for every
+vreg; -fno-regalloc only keeps it from handing out registers.
+*/
+static const Pass pipeline[] = {
+    {"fold", OPT_FOLD, pass_fold},
+    {"cse", OPT_CSE, pass_cse},
+    {"lower", -1, pass_lower},
+    {"strength", OPT_STRENGTH, pass_strength},
+    {"dce", OPT_DCE, pass_dce},
+    {"vectorize", OPT_VECTORIZE, pass_vectorize},
+    {"regalloc", -1, pass_regalloc},
+    {"isel", -1, pass_isel},
+    {"peephole", OPT_PEEPHOLE, pass_peephole},
+};
+
+enum {
+    NUM_PASSES = sizeof(pipeline) / sizeof(pipeline[0]),
+
+    /* see compile_chunk_cut */
+    COMPILE_CHUNK_SIZE = 1024 * 1024,
+    COMPILE_CHUNK_MAX = 4 * COMPILE_CHUNK_SIZE,
+    COMPILE_CUT_WINDOW = 16,
+    COMPILE_CUT_MASK = 63,
+};
+
+/* phases that are not passes, counted in CompileEnv.stats after them */
+enum {
+    PHASE_EMIT = NUM_PASSES,
+    PHASE_TOKENIZE,
+    PHASE_PARSE,
+    PHASE_DUMP, /* -v and -fdump-ir */
+    NUM_PHASES,
+};
+
+static const char *phase_names[NUM_PHASES - NUM_PASSES] = {
+    "emit", "tokenize", "parse", "dump"};
+
+/* the i-th phase in the order they run in */
+int phase_at(int i)
+{
+    if (i < 2) return i == 0 ? PHASE_TOKENIZE : PHASE_PARSE;
+    if (i < NUM_PASSES + 2) return i - 2;
+    return i == NUM_PASSES + 2 ? PHASE_EMIT : PHASE_DUMP;
+}
+
+const char *phase_name(int phase)
+{
+    return phase < NUM_PASSES ? pipeline[phase].name
+                              : phase_names[phase - NUM_PASSES];
+}
+
+/* the CPU time of the calling thread, which the passes of a chunk run on */
+double thread_msec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+double wall_msec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+void phase_start(CompileEnv *env)
+{
+    PhaseMark *mark = &env->mark;
+
+    mark->cpu = thread_msec();
+    mark->wall = wall_msec();
+    mark->nallocs = env->arena != NULL ? env->arena->nallocs : 0;
+    mark->used = env->arena != NULL ? env->arena->used : 0;
+}
+
+/* Count what happened since phase_start towards phase. */
+void phase_stop(CompileEnv *env, int phase)
+{
+    PhaseMark *mark = &env->mark;
+    PassStats *stats = &env->stats[phase];
+
+    stats->msec += thread_msec() - mark->cpu;
+    stats->wall_msec += wall_msec() - mark->wall;
+    stats->runs++;
+    if (env->arena != NULL) {
+        stats->nallocs += env->arena->nallocs - mark->nallocs;
+        stats->nbytes += env->arena->used - mark->used;
+    }
+}
+
+/* Count the nodes of ast, with a stack of those still to visit. */
+int ast_count(AST *ast)
+{
+    AstSpine todo;
+    int ret = 0, i;
+
+    init_ast_spine(&todo);
+    ast_spine_push(&todo, ast);
+    while (todo.size > 0) {
+        ast = todo.nodes[--todo.size].ast;
+        ret++;
+        switch (ast->kind) {
+            case AST_PROG:
+                for (i = 0; i < ast->nstmts; i++)
+                    ast_spine_push(&todo, ast->stmts[i]);
+                break;
+            case AST_LITERAL:
+            case AST_VAR:
+                break;
+            case AST_ASSIGN:
+                ast_spine_push(&todo, ast->rhs);
+                break;
+            default:
+                ast_spine_push(&todo, ast->lhs);
+                ast_spine_push(&todo, ast->rhs);
+                break;
+        }
+    }
+    free(todo.nodes);
+
+    return ret;
+}
+
+/*
+--cache=<dir> keeps the code of every chunk in <dir>, under a hash of its
+tokens, the passes enabled and the build of the compiler, which are all
+that the code depends on. An entry is the body before compile_relocate
+with the constant pool it numbers its labels by, so splicing it in gives
+what compiling the chunk again would.
+*/
+enum { CACHE_VERSION = 1 };
+
+typedef struct {
+    char magic[4]; /* "anqc" */
+    int version;
+    int inst_size; /* sizeof(AsmInst) of the compiler that wrote it */
+    int ninsts, npool, stack_size;
+} CacheHeader;
+
+void cache_hash(unsigned long *h, const void *data, size_t size)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        h[0] = (h[0] ^ p[i]) * 0x100000001b3UL;
+        h[1] = (h[1] ^ p[i] ^ (h[1] >> 29)) * 0x9e3779b97f4a7c15UL;
+    }
+}
+
+/*
+Return the malloc'd path of the entry of tokens. Names are told apart by
+their ids, and the types they have on the way in are part of the key.
+*/
+char *cache_path(Options *opts, SymTab *syms, TokenList *tokens)
+{
+    static const char build[] = __DATE__ " " __TIME__;
+    unsigned long h[2] = {0xcbf29ce484222325UL, 0x84222325cbf29ce4UL};
+    int version = CACHE_VERSION, i;
+    char *ret;
+
+    cache_hash(h, build, sizeof(build));
+    cache_hash(h, &version, sizeof(version));
+    cache_hash(h, opts->enabled, sizeof(opts->enabled));
+    for (i = 0; i < tokens->size; i++) {
+        cache_hash(h, &tokens->kind[i], 1);
+        if (tokens->kind[i] == tINTEGER || tokens->kind[i] == tFLOAT)
+            cache_hash(h, &tokens->value[i], sizeof(TokenValue));
+        if (tokens->kind[i] == tVARIABLE) {
+            int type = syms->types[tokens->value[i].ival];
+
+            cache_hash(h, &tokens->value[i], sizeof(TokenValue));
+            cache_hash(h, &type, sizeof(type));
+        }
+    }
+
+    ret = (char *)malloc(strlen(opts->cache_dir) + 34);
+    assert(ret != NULL);
+    sprintf(ret, "%s/%016lx%016lx", opts->cache_dir, h[0], h[1]);
+    return ret;
+}
+
+/* Fill the code, pool and stack size of env from path if it is there. */
+int cache_load(CompileEnv *env, const char *path)
+{
+    CacheHeader header;
+    FILE *fh;
+    int i, ok;
+
+    fh = fopen(path, "rb");
+    if (fh == NULL) return false;
+    ok = fread(&header, sizeof(header), 1, fh) == 1 &&
+         memcmp(header.magic, "anqc", 4) == 0 &&
+         header.version == CACHE_VERSION &&
+         header.inst_size == (int)sizeof(AsmInst);
+    if (ok) {
+        env->code = new_asm_list();
+        env->code->rsved_size = max(header.ninsts, 1);
+        env->code->data =
+            (AsmInst *)malloc(sizeof(AsmInst) * env->code->rsved_size);
+        assert(env->code->data != NULL);
+        env->code->size = header.ninsts;
+        ok = (int)fread(env->code->data, sizeof(AsmInst), header.ninsts,
+                        fh) == header.ninsts;
+        env->pool = new_const_pool();
+        for (i = 0; ok && i < header.npool; i++) {
+            unsigned long bits;
+
+            ok = fread(&bits, sizeof(bits), 1, fh) == 1;
+            const_pool_append(env->pool, bits);
+        }
+        env->stack_size = header.stack_size;
+    }
+    fclose(fh);
+
+    if (!ok) {
+        if (env->code != NULL) free_asm_list(env->code);
+        if (env->pool != NULL) free_const_pool(env->pool);
+        env->code = NULL;
+        env->pool = NULL;
+        return false;
+    }
+    /* what was used last is evicted last */
+    utime(path, NULL);
+    return true;
+}
+
+/*
+Write the entry of env to path. It goes to a file of its own first, so
+that other threads and processes never see half of it.
+*/
+void cache_store(CompileEnv *env, const char *path)
+{
+    CacheHeader header;
+    char *temp;
+    FILE *fh;
+    int ok;
+
+    memcpy(header.magic, "anqc", 4);
+    header.version = CACHE_VERSION;
+    header.inst_size = sizeof(AsmInst);
+    header.ninsts = env->code->size;
+    header.npool = env->pool->size;
+    header.stack_size = env->stack_size;
+
+    temp = (char *)malloc(strlen(path) + 64);
+    assert(temp != NULL);
+    sprintf(temp, "%s.%d.%lx", path, (int)getpid(), (unsigned long)env);
+    fh = fopen(temp, "wb");
+    if (fh == NULL) {
+        free(temp);
+        return;
+    }
+    ok = fwrite(&header, sizeof(header), 1, fh) == 1 &&
+         (int)fwrite(env->code->data, sizeof(AsmInst), env->code->size,
+                     fh) == env->code->size &&
+         (int)fwrite(env->pool->bits, sizeof(unsigned long),
+                     env->pool->size, fh) == env->pool->size;
+    ok = fclose(fh) == 0 && ok;
+    if (!ok || rename(temp, path) != 0) remove(temp);
+    free(temp);
+}
+
+typedef struct {
+    char *name;
+    time_t mtime;
+    long size;
+} CacheEntry;
+
+int cache_entry_cmp(const void *lhs, const void *rhs)
+{
+    const CacheEntry *a = (const CacheEntry *)lhs, *b = (const CacheEntry *)rhs;
+
+    if (a->mtime != b->mtime) return a->mtime < b->mtime ? -1 : 1;
+    return strcmp(a->name, b->name);
+}
+
+/*
+Remove the entries used least recently until the cache holds no more than
+limit bytes, and return how many went.
+*/
+int cache_evict(const char *dir, long limit)
+{
+    CacheEntry *entries = NULL;
+    struct dirent *ent;
+    DIR *dp;
+    char *path;
+    long total = 0;
+    int nentries = 0, rsved = 0, ret = 0, i;
+
+    dp = opendir(dir);
+    if (dp == NULL) return 0;
+    path = (char *)malloc(strlen(dir) + 256 + 2);
+    assert(path != NULL);
+    while ((ent = readdir(dp)) != NULL) {
+        struct stat st;
+
+        /* entries are named by 32 hex digits; skip files being written */
+        if (strlen(ent->d_name) != 32 ||
+            strspn(ent->d_name, "0123456789abcdef") != 32)
+            continue;
+        sprintf(path, "%s/%s", dir, ent->d_name);
+        if (stat(path, &st) != 0) continue;
+
+        if (nentries == rsved) {
+            rsved = max(rsved * 2, 64);
+            entries =
+                (CacheEntry *)realloc(entries, sizeof(CacheEntry) * rsved);
+            assert(entries != NULL);
+        }
+        entries[nentries].name = (char *)malloc(33);
+        assert(entries[nentries].name != NULL);
+        strcpy(entries[nentries].name, ent->d_name);
+        entries[nentries].mtime = st.st_mtime;
+        entries[nentries].size = st.st_size;
+        total += st.st_size;
+        nentries++;
+    }
+    closedir(dp);
+
+    qsort(entries, nentries, sizeof(CacheEntry), cache_entry_cmp);
+    for (i = 0; i < nentries; i++) {
+        if (total > limit) {
+            sprintf(path, "%s/%s", dir, entries[i].name);
+            if (remove(path) == 0) ret++;
+            total -= entries[i].size;
+        }
+        free(entries[i].name);
+    }
+    free(entries);
+    free(path);
+    return ret;
+}
+
+void compile_chunk_parse(CompileEnv *env)
+{
+    phase_start(env);
+    env->prog = parse(env->tokens, env->arena, env->syms, env->opts->verbose);
+    assert(env->prog != NULL);
+    phase_stop(env, PHASE_PARSE);
+    if (env->opts->report != REPORT_NONE) env->nnodes = ast_count(env->prog);
+}
+
+/*
+Tokenize the chunk and find its entry in the cache. With parse, parse it
+too, which a chunk with names needs whether the cache has it or not, as
+the chunks after it depend on the types it gives them.
+*/
+void compile_chunk_front(CompileEnv *env, int parse)
+{
+    env->begin_ms = wall_msec();
+    env->arena = new_arena();
+    phase_start(env);
+    env->tokens = tokenize_buffer(env->arena, env->syms, env->src, env->size);
+    assert(env->tokens != NULL);
+    phase_stop(env, PHASE_TOKENIZE);
+    env->ntokens = env->tokens->size;
+    if (env->opts->verbose) {
+        phase_start(env);
+        dump_token_list(env->tokens, 0, -1);
+        phase_stop(env, PHASE_DUMP);
+    }
+    if (env->opts->cache_dir != NULL)
+        env->path = cache_path(env->opts, env->syms, env->tokens);
+    if (parse) compile_chunk_parse(env);
+}
+
+/*
+Whether the chunk has names in it. Those read the types the chunks before
+them left in syms and leave theirs for the chunks after them.
+*/
+int compile_chunk_has_names(CompileEnv *env)
+{
+    size_t i;
+
+    for (i = 0; i < env->size; i++)
+        if (isalpha((unsigned char)env->src[i]) || env->src[i] == '_')
+            return true;
+    return false;
+}
 
-            case tMINUS:
-                printf("- ");
-                break;
+/*
+Run the front end of the chunks with names one after another, in order;
+compile_chunk does the rest on any thread.
+*/
+void compile_fronts(CompileEnv *envs, int nenvs)
+{
+    int i;
 
-            case tSTAR:
-                printf("* ");
-                break;
+    for (i = 0; i < nenvs; i++)
+        if (compile_chunk_has_names(&envs[i]))
+            compile_chunk_front(&envs[i], true);
+}
 
-            case tSLASH:
-                printf("/ ");
-                break;
+/*
+Tokenize, parse and run the pipeline on one chunk, or take its code from
+the cache.
+*/
+void compile_chunk(CompileEnv *env)
+{
+    int i;
 
-            case tLPAREN:
-                printf("( ");
-                break;
+    if (env->tokens == NULL) compile_chunk_front(env, false);
+    if (env->path != NULL) {
+        if (cache_load(env, env->path)) {
+            env->cache_hits++;
+            goto done;
+        }
+        env->cache_misses++;
+    }
+    if (env->prog == NULL) compile_chunk_parse(env);
+    env->pool = new_const_pool();
 
-            case tRPAREN:
-                printf(") ");
-                break;
+    for (i = 0; i < NUM_PASSES; i++) {
+        const Pass *pass = &pipeline[i];
+        PassStats *stats = &env->stats[i];
 
-            case tSEMICOLON:
-                printf("; ");
-                break;
+        if (pass->opt >= 0 && !env->opts->enabled[pass->opt]) continue;
 
-            case tEOF:
-                printf("<EOF> ");
-                break;
+        phase_start(env);
+        pass->run(env);
+        phase_stop(env, i);
 
-            default:
-                printf("???%d\n", token->kind);
-                assert(false);
+        if (env->code != NULL) {
+            stats->has_code = true;
+            stats->nrecords += env->code->size;
+        }
+        else if (env->ir != NULL) {
+            stats->has_ir = true;
+            stats->ninsts += env->ir->ninsts;
+            stats->nvregs += env->ir->nvregs;
+        }
+        if (env->opts->dump_ir && env->ir != NULL && env->code == NULL) {
+            phase_start(env);
+            fprintf(stderr, "*** IR after %s ***\n", pass->name);
+            dump_ir(env->ir, stderr);
+            phase_stop(env, PHASE_DUMP);
         }
     }
+    if (env->path != NULL) cache_store(env, env->path);
+
+done:
+    if (env->ir != NULL) free_ir(env->ir);
+    env->ir = NULL;
+    free(env->path);
+    env->path = NULL;
+    env->arena_used = env->arena->used;
+    env->arena_peak = env->arena->peak;
+    free_arena(env->arena);
+    env->arena = NULL;
+    env->tokens = NULL;
+    env->prog = NULL;
+    env->end_ms = wall_msec();
+}
+
+/*
+Move the labels of the chunk to its place in the merged pool, and render
+it as text if that is what is written out.
+*/
+void compile_relocate(CompileEnv *env)
+{
+    int i;
+
+    phase_start(env);
+    for (i = 0; i < env->code->size; i++) {
+        AsmInst *inst = &env->code->data[i];
+
+        if (inst->src.kind == OPD_LABEL || inst->src.kind == OPD_RIP_LABEL)
+            inst->src.val += env->label_base;
+        if (inst->dst.kind == OPD_LABEL || inst->dst.kind == OPD_RIP_LABEL)
+            inst->dst.val += env->label_base;
+    }
 
-    puts("");
+    if (env->opts->emit == EMIT_ASM) {
+        env->text = new_byte_buf();
+        for (i = 0; i < env->code->size; i++)
+            render_inst(env->text, &env->code->data[i]);
+    }
+    phase_stop(env, PHASE_EMIT);
 }
 
 typedef struct {
-    char **data;
-    int size, rsved_size;
-} Codes;
+    CompileEnv *envs;
+    int nenvs;
+    int next; /* the next env nobody has taken */
+    pthread_mutex_t lock;
+    void (*run)(CompileEnv *env);
+} WorkQueue;
+
+void *work_queue_worker(void *arg)
+{
+    WorkQueue *this = (WorkQueue *)arg;
+
+    while (true) {
+        int i;
+
+        pthread_mutex_lock(&this->lock);
+        i = this->next++;
+        pthread_mutex_unlock(&this->lock);
+        if (i >= this->nenvs) return NULL;
+        this->run(&this->envs[i]);
+    }
+}
 
-Codes *new_codes()
+/* Call run on every env from njobs threads, the calling one included. */
+void run_parallel(CompileEnv *envs, int nenvs, int njobs,
+                  void (*run)(CompileEnv *env))
 {
-    Codes *ret;
+    WorkQueue queue;
+    pthread_t *threads;
+    int i, nthreads = (njobs < nenvs ? njobs : nenvs) - 1;
+
+    queue.envs = envs;
+    queue.nenvs = nenvs;
+    queue.next = 0;
+    queue.run = run;
+    pthread_mutex_init(&queue.lock, NULL);
+
+    threads = (pthread_t *)malloc(sizeof(pthread_t) * max(nthreads, 1));
+    assert(threads != NULL);
+    for (i = 0; i < nthreads; i++) {
+        int ret = pthread_create(&threads[i], NULL, work_queue_worker, &queue);
+
+        assert(ret == 0);
+    }
+    work_queue_worker(&queue);
+    for (i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
 
-    ret = (Codes *)malloc(sizeof(Codes));
-    assert(ret != NULL);
-    ret->data = NULL;
-    ret->size = 0;
-    ret->rsved_size = 1;
-    return ret;
+    free(threads);
+    pthread_mutex_destroy(&queue.lock);
 }
 
-void free_codes(Codes *this)
+/*
+Return the length of the chunk at the start of the len bytes of src, or 0
+if more bytes are needed to tell; the ones before from have been looked at
+already. A chunk of COMPILE_CHUNK_SIZE bytes or more ends at a ';' whose
+last COMPILE_CUT_WINDOW bytes hash to a multiple of COMPILE_CUT_MASK + 1,
+or at any ';' once it reaches COMPILE_CHUNK_MAX.
+
+The cuts depend only on the bytes around them, so an edit moves at most
+the cuts next to it and the other chunks still hit the cache. Nor do they
+depend on -j, so neither does the output, and a source shorter than
+COMPILE_CHUNK_SIZE is compiled exactly as one program.
+*/
+size_t compile_chunk_cut(const char *src, size_t len, size_t from, int eof)
 {
-    int i;
+    size_t i = from > COMPILE_CHUNK_SIZE - 1 ? from : COMPILE_CHUNK_SIZE - 1;
 
-    for (i = 0; i < this->size; i++) free(this->data[i]);
-    free(this);
+    for (; i < len; i++) {
+        unsigned long h = 0xcbf29ce484222325UL;
+        int j;
+
+        if (src[i] != ';') continue;
+        if (i + 1 >= COMPILE_CHUNK_MAX) return i + 1;
+        for (j = 0; j < COMPILE_CUT_WINDOW; j++)
+            h = (h ^ (unsigned char)src[i - j]) * 0x100000001b3UL;
+        if (((h >> 32) & COMPILE_CUT_MASK) == 0) return i + 1;
+    }
+    return eof ? len : 0;
+}
+
+/* Return where the chunk that starts at begin ends. */
+size_t compile_chunk_end(const char *src, size_t size, size_t begin)
+{
+    return begin + compile_chunk_cut(src + begin, size - begin, 0, true);
+}
+
+void write_code(AsmList *code, FILE *fh, int emit)
+{
+    switch (emit) {
+        case EMIT_ASM:
+            asm_dump(code, fh);
+            break;
+        case EMIT_OBJ:
+            write_elf_obj(code, fh);
+            break;
+        case EMIT_EXE:
+            write_elf_exe(code, fh);
+            break;
+        case EMIT_RUN:
+            jit_run(code);
+            break;
+    }
+}
+
+/* -v and -fdump-ir print as they go and have to keep the chunks in order */
+int compile_jobs(Options *opts)
+{
+    return opts->verbose || opts->dump_ir ? 1 : opts->jobs;
+}
+
+/* Write the phases that ran as a JSON object. */
+void json_phases(ByteBuf *buf, PassStats *stats)
+{
+    char line[256];
+    int i, first = true;
+
+    byte_buf_putc(buf, '{');
+    for (i = 0; i < NUM_PHASES; i++) {
+        int phase = phase_at(i);
+        PassStats *s = &stats[phase];
+
+        if (s->runs == 0) continue;
+        sprintf(line,
+                "%s\"%s\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f, "
+                "\"arena_allocs\": %ld, \"arena_bytes\": %ld}",
+                first ? "" : ", ", phase_name(phase), s->wall_msec, s->msec,
+                s->nallocs, s->nbytes);
+        byte_buf_puts(buf, line);
+        first = false;
+    }
+    byte_buf_putc(buf, '}');
 }
 
-void codes_dump(Codes *this, FILE *fh)
+/* Add what happened to env to the counts of total. */
+void compile_env_add(CompileEnv *total, CompileEnv *env)
 {
     int i;
 
-    for (i = 0; i < this->size; i++) {
-        fputs(this->data[i], fh);
-        fputc('\n', fh);
+    if (total->opts->report == REPORT_TRACE) {
+        char line[256];
+
+        if (total->trace == NULL)
+            total->trace = new_byte_buf();
+        else
+            byte_buf_putc(total->trace, ',');
+        sprintf(line,
+                "\n    {\"chunk\": %d, \"bytes\": %lu, \"begin_ms\": %.3f, "
+                "\"end_ms\": %.3f, \"cached\": %s, \"tokens\": %ld, "
+                "\"ast_nodes\": %ld, \"phases\": ",
+                env->id, (unsigned long)env->size,
+                env->begin_ms - total->epoch, env->end_ms - total->epoch,
+                env->cache_hits > 0 ? "true" : "false", env->ntokens,
+                env->nnodes);
+        byte_buf_puts(total->trace, line);
+        json_phases(total->trace, env->stats);
+        byte_buf_putc(total->trace, '}');
     }
+
+    for (i = 0; i < NUM_PHASES; i++) {
+        PassStats *sum = &total->stats[i], *stats = &env->stats[i];
+
+        sum->msec += stats->msec;
+        sum->wall_msec += stats->wall_msec;
+        sum->runs += stats->runs;
+        sum->nallocs += stats->nallocs;
+        sum->nbytes += stats->nbytes;
+        sum->has_ir |= stats->has_ir;
+        sum->has_code |= stats->has_code;
+        sum->ninsts += stats->ninsts;
+        sum->nvregs += stats->nvregs;
+        sum->nrecords += stats->nrecords;
+    }
+    for (i = 0; i < NUM_PEEPHOLE_RULES; i++) total->hits[i] += env->hits[i];
+    total->npairs += env->npairs;
+    total->cse_saved += env->cse_saved;
+    total->cse_reused += env->cse_reused;
+    total->nmuls += env->nmuls;
+    total->ndivs += env->ndivs;
+    total->peephole_in += env->peephole_in;
+    total->cache_hits += env->cache_hits;
+    total->cache_misses += env->cache_misses;
+    total->size += env->size;
+    total->ntokens += env->ntokens;
+    total->nnodes += env->nnodes;
+    total->arena_used += env->arena_used;
+    if (env->arena_peak > total->arena_peak)
+        total->arena_peak = env->arena_peak;
 }
 
-void codes_append(Codes *this, const char *code)
+/* Write the summary of --stats and --trace as JSON. */
+void compile_report_json(CompileEnv *total, Options *opts, long nrecords)
 {
-    char *data;
+    ByteBuf *buf = new_byte_buf();
+    char line[512];
+
+    sprintf(line,
+            "{\n  \"source_bytes\": %lu,\n  \"chunks\": %ld,\n"
+            "  \"jobs\": %d,\n  \"wall_ms\": %.3f,\n  \"tokens\": %ld,\n"
+            "  \"ast_nodes\": %ld,\n  \"instructions\": %ld,\n"
+            "  \"cache\": {\"hits\": %d, \"misses\": %d, \"evicted\": %d},"
+            "\n  \"phases\": ",
+            (unsigned long)total->size, total->stats[PHASE_TOKENIZE].runs,
+            compile_jobs(opts), wall_msec() - total->epoch, total->ntokens,
+            total->nnodes, nrecords, total->cache_hits, total->cache_misses,
+            total->cache_evicted);
+    byte_buf_puts(buf, line);
+    json_phases(buf, total->stats);
+    if (opts->report == REPORT_TRACE) {
+        byte_buf_puts(buf, ",\n  \"trace\": [");
+        if (total->trace != NULL)
+            byte_buf_append(buf, total->trace->data, total->trace->size);
+        byte_buf_puts(buf, "\n  ]");
+    }
+    byte_buf_puts(buf, "\n}\n");
 
-    if (this->data == NULL || this->size == this->rsved_size) {
-        this->data =
-            (char **)realloc(this->data, sizeof(char *) * this->rsved_size * 2);
-        assert(this->data != NULL);
-        this->rsved_size *= 2;
+    fwrite(buf->data, 1, buf->size, opts->report_fh);
+    free_byte_buf(buf);
+}
+
+/*
+Print what -fstats, -ftime-passes, -v, --stats and --trace ask for about
+all chunks to opts->report_fh.
+*/
+void compile_report(CompileEnv *total, Options *opts, long nrecords)
+{
+    PassStats *stats = total->stats;
+    FILE *fh = opts->report_fh;
+    double msec = 0;
+    int i;
+
+    if (opts->report != REPORT_NONE)
+        compile_report_json(total, opts, nrecords);
+
+    if (opts->stats && opts->cache_dir != NULL)
+        fprintf(fh, "cache: %d hits, %d misses, %d evicted\n",
+                total->cache_hits, total->cache_misses, total->cache_evicted);
+    if (opts->stats && opts->enabled[OPT_CSE])
+        fprintf(fh, "cse: %ld AST nodes shared, %ld values reused\n",
+                total->cse_saved, total->cse_reused);
+    if (opts->stats && opts->enabled[OPT_STRENGTH])
+        fprintf(fh, "strength: %ld multiplications, %ld divisions\n",
+                total->nmuls, total->ndivs);
+    if (opts->stats && opts->enabled[OPT_VECTORIZE])
+        fprintf(fh, "vectorize: %d pairs of statements\n", total->npairs);
+    if (opts->stats && opts->enabled[OPT_PEEPHOLE]) {
+        fprintf(fh, "peephole: %ld -> %ld records\n", total->peephole_in,
+                stats[NUM_PASSES - 1].nrecords);
+        for (i = 0; i < NUM_PEEPHOLE_RULES; i++)
+            fprintf(fh, "    %-14s %10d\n", peephole_rule_names[i],
+                    total->hits[i]);
+    }
+
+    if (opts->time_passes) {
+        for (i = 0; i < NUM_PASSES; i++) {
+            const Pass *pass = &pipeline[i];
+
+            if (pass->opt >= 0 && !opts->enabled[pass->opt]) continue;
+            fprintf(fh, "%-10s %10.3f ms", pass->name, stats[i].msec);
+            if (stats[i].has_code)
+                fprintf(fh, " %10ld records", stats[i].nrecords);
+            else if (stats[i].has_ir)
+                fprintf(fh, " %10ld insts %10ld vregs", stats[i].ninsts,
+                        stats[i].nvregs);
+            fputc('\n', fh);
+            msec += stats[i].msec;
+        }
+        fprintf(fh, "%-10s %10.3f ms %10ld records\n", "emit",
+                stats[PHASE_EMIT].msec, nrecords);
+        msec += stats[PHASE_EMIT].msec;
+        fprintf(fh, "%-10s %10.3f ms\n", "total", msec);
     }
 
-    data = (char *)malloc(sizeof(char) * (strlen(code) + 1));
-    assert(data != NULL);
-    strcpy(data, code);
-    this->data[this->size++] = data;
+    if (opts->verbose)
+        fprintf(fh, "arena: %lu bytes used, %lu bytes peak\n",
+                (unsigned long)total->arena_used,
+                (unsigned long)total->arena_peak);
 }
 
-void codes_appendf(Codes *this, const char *format, ...)
+void init_compile_env(CompileEnv *this, Options *opts, const char *src,
+                      size_t size)
 {
-    va_list args;
-    char buf[256]; /* TODO:should be enough??? */
+    memset(this, 0, sizeof(CompileEnv));
+    this->opts = opts;
+    this->src = src;
+    this->size = size;
+    this->stats = (PassStats *)calloc(NUM_PHASES, sizeof(PassStats));
+    assert(this->stats != NULL);
+}
+
+void free_compile_env(CompileEnv *this)
+{
+    if (this->code != NULL) free_asm_list(this->code);
+    if (this->pool != NULL) free_const_pool(this->pool);
+    if (this->text != NULL) free_byte_buf(this->text);
+    if (this->trace != NULL) free_byte_buf(this->trace);
+    free(this->stats);
+}
 
-    va_start(args, format);
-    vsprintf(buf, format, args);
-    va_end(args);
 
-    codes_append(this, buf);
+/*
+Compile src into assembly, an object or an executable written to fh.
+
+The source is cut into chunks at ';' and each chunk is compiled into its
+own body of main and its own constant pool by one of opts->jobs threads,
+after the chunks with names have been parsed in order.
+The pools are then laid end to end, the labels of every chunk are moved
+past the pools of the chunks before it, and the bodies are written in
+order inside one prologue whose frame fits the largest of them.
+*/
+void compile(const char *src, size_t size, FILE *fh, Options *opts)
+{
+    CompileEnv *envs, total;
+    AsmList *code;
+    ConstPool *pool;
+    SymTab *syms = new_symtab();
+    size_t begin;
+    long nrecords = 0;
+    int nchunks = 0, stack_size = 0, njobs = compile_jobs(opts), i, j;
+
+    for (begin = 0; begin < size || nchunks == 0;
+         begin = compile_chunk_end(src, size, begin))
+        nchunks++;
+    envs = (CompileEnv *)malloc(sizeof(CompileEnv) * nchunks);
+    assert(envs != NULL);
+    for (begin = 0, i = 0; i < nchunks; i++) {
+        size_t end = compile_chunk_end(src, size, begin);
+
+        init_compile_env(&envs[i], opts, src + begin, end - begin);
+        envs[i].id = i;
+        envs[i].syms = syms;
+        begin = end;
+    }
+    init_compile_env(&total, opts, NULL, 0);
+    total.epoch = wall_msec();
+
+    compile_fronts(envs, nchunks);
+    run_parallel(envs, nchunks, njobs, compile_chunk);
+
+    phase_start(&total);
+    pool = new_const_pool();
+    for (i = 0; i < nchunks; i++) {
+        envs[i].label_base = pool->size;
+        for (j = 0; j < envs[i].pool->size; j++)
+            const_pool_append(pool, envs[i].pool->bits[j]);
+        stack_size = max(stack_size, envs[i].stack_size);
+    }
+    phase_stop(&total, PHASE_EMIT);
+
+    run_parallel(envs, nchunks, njobs, compile_relocate);
+
+    phase_start(&total);
+    code = new_asm_list();
+    gen_prologue(code, stack_size);
+    if (opts->emit == EMIT_ASM) {
+        asm_dump(code, fh);
+        nrecords = code->size;
+        code->size = 0;
+        for (i = 0; i < nchunks; i++) {
+            if (envs[i].text->size > 0)
+                fwrite(envs[i].text->data, 1, envs[i].text->size, fh);
+            nrecords += envs[i].code->size;
+        }
+    }
+    else {
+        for (i = 0; i < nchunks; i++) {
+            AsmList *body = envs[i].code;
+
+            for (j = 0; j < body->size; j++)
+                asm_append(code, body->data[j].op, body->data[j].src,
+                           body->data[j].dst);
+        }
+    }
+    gen_epilogue(code);
+    const_pool_emit(pool, code);
+    runtime_emit(code, pool->size, syms->size);
+    nrecords += code->size;
+    write_code(code, fh, opts->emit);
+    phase_stop(&total, PHASE_EMIT);
+
+    for (i = 0; i < nchunks; i++) {
+        compile_env_add(&total, &envs[i]);
+        free_compile_env(&envs[i]);
+    }
+    if (opts->cache_dir != NULL)
+        total.cache_evicted = cache_evict(opts->cache_dir, opts->cache_limit);
+    compile_report(&total, opts, nrecords);
+
+    free_compile_env(&total);
+    free(envs);
+    free_asm_list(code);
+    free_const_pool(pool);
+    free_symtab(syms);
 }
 
+/* reads a stream a chunk at a time */
 typedef struct {
-    Codes *codes;
-    int stack_idx, stack_max_idx;
-    int nlabel;
-} ObjEnv;
+    FILE *fp;
+    char *buf;
+    size_t len, cap;
+    size_t scanned; /* where to go on looking for the cut */
+    int eof;
+} SourceReader;
 
-ObjEnv *new_objenv()
+/*
+Return the next chunk of the stream, cut where compile_chunk_cut would cut
+the whole of it, or NULL at its end. The caller frees the chunk.
+*/
+char *source_reader_next(SourceReader *this, size_t *size)
 {
-    ObjEnv *ret;
+    size_t end, nread;
+    char *ret;
 
-    ret = (ObjEnv *)malloc(sizeof(ObjEnv));
+    while (true) {
+        end = compile_chunk_cut(this->buf, this->len, this->scanned,
+                                this->eof);
+        this->scanned = this->len;
+        if (end > 0 || this->eof) break;
+
+        if (this->cap - this->len < READ_BLOCK_SIZE) {
+            this->cap = this->cap == 0 ? READ_BLOCK_SIZE : this->cap * 2;
+            this->buf = (char *)realloc(this->buf, this->cap);
+            assert(this->buf != NULL);
+        }
+        nread = fread(this->buf + this->len, 1, this->cap - this->len,
+                      this->fp);
+        assert(!ferror(this->fp));
+        this->len += nread;
+        this->eof = nread == 0;
+    }
+    if (end == 0) return NULL;
+
+    ret = (char *)malloc(end);
     assert(ret != NULL);
-    ret->codes = new_codes();
-    ret->stack_idx = ret->stack_max_idx = ret->nlabel = 0;
+    memcpy(ret, this->buf, end);
+    memmove(this->buf, this->buf + end, this->len - end);
+    this->len -= end;
+    this->scanned = 0;
+    *size = end;
     return ret;
 }
 
-void free_objenv(ObjEnv *this)
+/* the labels of the frame stub of compile_stream, before those of pools */
+enum {
+    STREAM_FRAME_LABEL,
+    STREAM_BODY_LABEL,
+    NUM_STREAM_LABELS,
+};
+
+/*
+Compile the source read from in into assembly written to fh, holding no
+more than opts->jobs chunks of it at a time. Each chunk is written out with
+its constant pool as soon as it is compiled. The frame size is known only
+at the end, so main jumps to a stub after its epilogue that makes the
+frame and jumps back; gas widens the jumps, which the assembler here
+cannot, hence assembly only.
+*/
+void compile_stream(FILE *in, FILE *fh, Options *opts)
 {
-    free_codes(this->codes);
-    free(this);
+    SourceReader reader;
+    CompileEnv *envs, total;
+    AsmList *code;
+    SymTab *syms = new_symtab();
+    long nrecords;
+    int njobs = compile_jobs(opts), nenvs, label = NUM_STREAM_LABELS, i;
+    int stack_size = 0, nchunks = 0;
+
+    assert(opts->emit == EMIT_ASM);
+
+    memset(&reader, 0, sizeof(reader));
+    reader.fp = in;
+    envs = (CompileEnv *)malloc(sizeof(CompileEnv) * njobs);
+    assert(envs != NULL);
+    init_compile_env(&total, opts, NULL, 0);
+    total.epoch = wall_msec();
+
+    phase_start(&total);
+    code = new_asm_list();
+    gen_prologue(code, 0);
+    asm_append(code, X_JMP, opd_of(OPD_LABEL, STREAM_FRAME_LABEL),
+               opd_none());
+    asm_append(code, X_LABEL, opd_of(OPD_LABEL, STREAM_BODY_LABEL),
+               opd_none());
+    asm_dump(code, fh);
+    nrecords = code->size;
+    code->size = 0;
+    phase_stop(&total, PHASE_EMIT);
+
+    while (true) {
+        for (nenvs = 0; nenvs < njobs; nenvs++) {
+            size_t size;
+            char *src = source_reader_next(&reader, &size);
+
+            if (src == NULL) break;
+            init_compile_env(&envs[nenvs], opts, src, size);
+            envs[nenvs].id = nchunks++;
+            envs[nenvs].syms = syms;
+        }
+        if (nenvs == 0) break;
+
+        compile_fronts(envs, nenvs);
+        run_parallel(envs, nenvs, njobs, compile_chunk);
+        for (i = 0; i < nenvs; i++) {
+            CompileEnv *env = &envs[i];
+
+            env->label_base = label;
+            label += env->pool->size;
+            stack_size = max(stack_size, env->stack_size);
+            if (env->pool->size == 0) continue;
+            const_pool_emit(env->pool, env->code);
+            asm_append(env->code, X_SECTION, opd_of(OPD_IMM, SEC_TEXT),
+                       opd_none());
+        }
+        run_parallel(envs, nenvs, njobs, compile_relocate);
+
+        for (i = 0; i < nenvs; i++) {
+            CompileEnv *env = &envs[i];
+
+            phase_start(env);
+            if (env->text->size > 0)
+                fwrite(env->text->data, 1, env->text->size, fh);
+            phase_stop(env, PHASE_EMIT);
+            nrecords += env->code->size;
+            compile_env_add(&total, env);
+            free((char *)env->src);
+            free_compile_env(env);
+        }
+    }
+
+    phase_start(&total);
+    gen_epilogue(code);
+    asm_append(code, X_LABEL, opd_of(OPD_LABEL, STREAM_FRAME_LABEL),
+               opd_none());
+    gen_frame(code, stack_size);
+    asm_append(code, X_JMP, opd_of(OPD_LABEL, STREAM_BODY_LABEL),
+               opd_none());
+    runtime_emit(code, label, syms->size);
+    nrecords += code->size;
+    asm_dump(code, fh);
+    phase_stop(&total, PHASE_EMIT);
+
+    if (opts->cache_dir != NULL)
+        total.cache_evicted = cache_evict(opts->cache_dir, opts->cache_limit);
+    compile_report(&total, opts, nrecords);
+
+    free_compile_env(&total);
+    free(envs);
+    free(reader.buf);
+    free_asm_list(code);
+    free_symtab(syms);
 }
 
-Codes *objenv_swap_codes(ObjEnv *this, Codes *rhs)
+/* Run the program in buf as bytecode, printing its values to out. */
+void interpret(const char *buf, size_t size, FILE *out, Options *opts)
 {
-    Codes *tmp;
-
-    tmp = this->codes;
-    this->codes = rhs;
-    return tmp;
+    Arena *arena = new_arena();
+    SymTab *syms = new_symtab();
+    TokenList *tokens;
+    AST *prog;
+    Bytecode *bc;
+
+    tokens = tokenize_buffer(arena, syms, buf, size);
+    assert(tokens != NULL);
+    if (opts->verbose) dump_token_list(tokens, 0, -1);
+    prog = parse(tokens, arena, syms, opts->verbose);
+    assert(prog != NULL);
+
+    bc = bc_compile(prog, syms->size);
+    bc_run(bc, out);
+    free_bytecode(bc);
+    free_symtab(syms);
+
+    if (opts->verbose)
+        fprintf(opts->report_fh, "arena: %lu bytes used, %lu bytes peak\n",
+                (unsigned long)arena->used, (unsigned long)arena->peak);
+    free_arena(arena);
 }
 
-void objenv_add_stack_idx(ObjEnv *this, int nbytes)
+/*
+Do what opts ask for with the source read from in, writing the output to
+out. Assembly from stdin is written out as it is read; anything else
+reads all of the source first.
+*/
+void compile_input(FILE *in, int is_stdin, FILE *out, Options *opts)
 {
-    this->stack_idx += nbytes;
-    this->stack_max_idx = max(this->stack_max_idx, this->stack_idx);
+    char *buf;
+    size_t size;
+
+    if (is_stdin && opts->emit == EMIT_ASM) {
+        compile_stream(in, out, opts);
+        return;
+    }
+
+    buf = read_all(in, &size);
+    if (opts->emit == EMIT_INTERP)
+        interpret(buf, size, out, opts);
+    else
+        compile(buf, size, out, opts);
+    free(buf);
 }
 
-void objenv_sub_stack_idx(ObjEnv *this, int nbytes)
+#include "test.c"
+#include "bench.c"
+
+void usage(const char *progname)
 {
-    this->stack_idx -= nbytes;
+    fprintf(stderr,
+            "usage: %s [-v] [-O0|-O1] [-f[no-]<pass>] [-ftime-passes] "
+            "[-fdump-ir] [-fstats]\n"
+            "          [-j<n>] [--stats|--trace] [--cache=<dir>] "
+            "[--cache-limit=<MiB>]\n"
+            "          [--emit=asm|obj|exe] SRC|- DST\n"
+            "       %s [options] --run SRC\n"
+            "       %s --interp SRC\n"
+            "       %s --bench\n"
+            "       %s --gen [stmts=<n>|size=<KiB>] [depth=<n>] "
+            "[ops=<+>,<->,<*>,</>]\n"
+            "                [doubles=<percent>] [seed=<n>]\n"
+            "       %s --bench-suite [--save=FILE] [BASELINE]\n"
+            "       %s --server=SOCKET [-j<n>]\n"
+            "       %s --client=SOCKET [options] SRC|- DST\n"
+            "       %s            (run unit tests)\n",
+            progname, progname, progname, progname, progname, progname,
+            progname, progname, progname);
+    exit(1);
 }
 
-void write_obj_detail(AST *ast, ObjEnv *env)
+/* Compile, run or interpret a source as the arguments in argv ask. */
+int compile_main(int argc, char **argv)
 {
-    if (ast == NULL) return;
+    FILE *in = stdin, *out = NULL;
+    Options opts;
+    const char *src, *dst;
 
-    switch (ast->kind) {
-        case AST_PROG: {
-            write_obj_detail(ast->stmt, env);
-            switch (ast->stmt->type.kind) {
-                case TY_DOUBLE:
-                    codes_append(env->codes, "lea doublefmt(%rip), %rdi");
-                    break;
-
-                case TY_LONG:
-                    codes_append(env->codes, "mov %rax, %rsi");
-                    codes_append(env->codes, "lea longfmt(%rip), %rdi");
-                    break;
-            }
-            codes_append(env->codes, "mov $1, %eax");
-            codes_append(env->codes, "call printf");
+    init_options(&opts);
+    if (!options_parse_args(&opts, argc, argv, &src, &dst)) usage(argv[0]);
 
-            write_obj_detail(ast->next, env);
-            return;
-        }
+    if (strcmp(src, "-") != 0) {
+        in = fopen(src, "r");
+        assert(in != NULL);
+    }
+    if (opts.emit == EMIT_INTERP) {
+        out = stdout;
+    }
+    else if (opts.emit != EMIT_RUN) {
+        out = fopen(dst, "wb");
+        assert(out != NULL);
+    }
 
-        case AST_ADD:
-        case AST_SUB:
-        case AST_MUL:
-        case AST_DIV: {
-            char op[32];
-
-            if (ast->lhs->type.kind == TY_LONG &&
-                ast->rhs->type.kind == TY_LONG) {
-                write_obj_detail(ast->rhs, env);
-                objenv_add_stack_idx(env, SZ_QWORD);
-                codes_appendf(env->codes, "mov %%rax, -%d(%%rbp)",
-                              env->stack_idx);
-                write_obj_detail(ast->lhs, env);
-                if (ast->kind == AST_DIV) {
-                    codes_append(env->codes, "cltd");
-                    codes_appendf(env->codes, "idivq -%d(%%rbp)",
-                                  env->stack_idx);
-                }
-                else {
-                    switch (ast->kind) {
-                        case AST_ADD:
-                            strcpy(op, "add");
-                            break;
-                        case AST_SUB:
-                            strcpy(op, "sub");
-                            break;
-                        case AST_MUL:
-                            strcpy(op, "imul");
-                            break;
-                    }
-                    codes_appendf(env->codes, "%s -%d(%%rbp), %%rax", op,
-                                  env->stack_idx);
-                }
-                objenv_sub_stack_idx(env, SZ_QWORD);
-                break;
-            }
+    compile_input(in, in == stdin, out, &opts);
 
-            /* TODO: duplicate code */
-            write_obj_detail(ast->rhs, env);
-            objenv_add_stack_idx(env, SZ_QWORD);
-            if (ast->lhs->type.kind == TY_LONG &&
-                ast->rhs->type.kind == TY_DOUBLE) {
-                codes_appendf(env->codes, "movsd %%xmm0, -%d(%%rbp)",
-                              env->stack_idx);
-                write_obj_detail(ast->lhs, env);
-                codes_append(env->codes, "cvtsi2sd %rax, %xmm0");
-            }
-            else if (ast->lhs->type.kind == TY_DOUBLE &&
-                     ast->rhs->type.kind == TY_LONG) {
-                codes_append(env->codes, "cvtsi2sd %rax, %xmm0");
-                codes_appendf(env->codes, "movsd %%xmm0, -%d(%%rbp)",
-                              env->stack_idx);
-                write_obj_detail(ast->lhs, env);
-            }
-            else {
-                assert(ast->lhs->type.kind == TY_DOUBLE &&
-                       ast->rhs->type.kind == TY_DOUBLE);
+    if (in != stdin) fclose(in);
+    if (out != NULL && out != stdout) {
+        fclose(out);
+        if (opts.emit == EMIT_EXE) chmod(dst, 0755);
+    }
 
-                codes_appendf(env->codes, "movsd %%xmm0, -%d(%%rbp)",
-                              env->stack_idx);
-                write_obj_detail(ast->lhs, env);
-            }
+    return 0;
+}
 
-            switch (ast->kind) {
-                case AST_ADD:
-                    strcpy(op, "addsd");
-                    break;
-                case AST_SUB:
-                    strcpy(op, "subsd");
-                    break;
-                case AST_MUL:
-                    strcpy(op, "mulsd");
-                    break;
-                case AST_DIV:
-                    strcpy(op, "divsd");
-                    break;
-            }
+/********** Server *************/
 
-            codes_appendf(env->codes, "%s -%d(%%rbp), %%xmm0", op,
-                          env->stack_idx);
-            objenv_sub_stack_idx(env, SZ_QWORD);
+/*
+--server=SOCKET keeps a compiler running behind a Unix domain socket, and
+--client=SOCKET hands it a command line with the descriptors of SRC, DST
+and stderr instead of compiling itself. Every thread of the server waits
+in accept for a request of its own, and the arenas of the requests before
+it stay faulted in, in the pool of free_arena. Each request writes a line
+with its latency to the stderr of the server.
+*/
+enum {
+    SERVER_BACKLOG = 64,
+    SERVER_ARENA_POOL_MB = 512,
+    SERVER_MAX_ARGS = 64 * 1024, /* bytes of a command line */
+};
 
-            return;
-        }
+/* sent with the descriptors, before size bytes of '\0'-ended arguments */
+typedef struct {
+    char magic[4]; /* "anqs" */
+    int argc, size;
+} ServerRequest;
 
-        case AST_LITERAL: {
-            switch (ast->type.kind) {
-                case TY_DOUBLE:
-                    codes_append(env->codes, ".data");
-                    codes_appendf(env->codes, ".L%d:", env->nlabel++);
-                    codes_appendf(env->codes, ".double %lf", ast->fval);
-                    codes_append(env->codes, ".text");
-                    codes_appendf(env->codes, "movsd .L%d(%%rip), %%xmm0",
-                                  env->nlabel - 1);
-                    break;
+/* the descriptors that come with a request */
+enum {
+    SERVER_FD_SRC,
+    SERVER_FD_DST, /* stdout for --interp */
+    SERVER_FD_ERR,
+    NUM_SERVER_FDS,
+};
 
-                case TY_LONG:
-                    codes_appendf(env->codes, "mov $%ld, %%rax", ast->ival);
-                    break;
-            }
-            return;
-        }
-    }
+typedef union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * NUM_SERVER_FDS)];
+} ServerControl;
+
+/*
+-v and -fdump-ir print as they go and --run prints from generated code,
+all of them to the stdout and stderr of the process, so the client does
+those itself.
+*/
+int server_can_serve(Options *opts)
+{
+    return !opts->verbose && !opts->dump_ir && opts->emit != EMIT_RUN;
 }
 
-void write_obj(AST *prog, FILE *fh)
+int read_full(int fd, void *buf, size_t size)
 {
-    ObjEnv *env;
-    Codes *header;
+    char *p = (char *)buf;
 
-    assert(prog->kind == AST_PROG);
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
 
-    env = new_objenv();
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
 
-    codes_append(env->codes, ".data");
-    codes_append(env->codes, "doublefmt:");
-    codes_append(env->codes, ".string \"%lff\\n\"");
-    codes_append(env->codes, "longfmt:");
-    codes_append(env->codes, ".string \"%ldi\\n\"");
-    codes_append(env->codes, ".text");
-    codes_append(env->codes, ".globl main");
-    codes_append(env->codes, "main:");
-    codes_append(env->codes, "push %rbp");
-    codes_append(env->codes, "mov %rsp, %rbp");
-    header = objenv_swap_codes(env, new_codes());
+int write_full(int fd, const void *buf, size_t size)
+{
+    const char *p = (const char *)buf;
 
-    write_obj_detail(prog, env);
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
 
-    if (env->stack_max_idx > 0)
-        codes_appendf(header, "sub $%d, %%rsp",
-                      ((env->stack_max_idx * 8 / 16) + 1) * 16);
-    codes_append(env->codes, "mov $0, %eax");
-    codes_append(env->codes, "leave");
-    codes_append(env->codes, "ret");
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
 
-    codes_dump(header, fh);
-    codes_dump(env->codes, fh);
+int server_address(struct sockaddr_un *addr, const char *path)
+{
+    if (strlen(path) >= sizeof(addr->sun_path)) return false;
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return true;
+}
 
-    free_codes(header);
-    free_objenv(env);
+/* Return a socket connected to the server at path, or -1. */
+int server_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    if (!server_address(&addr, path)) return -1;
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
 
-    return;
+int client_send(int sock, ServerRequest *req, const char *args, int *fds)
+{
+    ServerControl control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = req;
+    iov.iov_len = sizeof(*req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * NUM_SERVER_FDS);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * NUM_SERVER_FDS);
+
+    return sendmsg(sock, &msg, 0) == sizeof(*req) &&
+           write_full(sock, args, req->size);
 }
 
-#include "test.c"
+/* Receive the header of a request and its descriptors into fds. */
+int server_recv(int conn, ServerRequest *req, int *fds)
+{
+    ServerControl control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = req;
+    iov.iov_len = sizeof(*req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    n = recvmsg(conn, &msg, 0);
+    if (n <= 0) return false;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * NUM_SERVER_FDS))
+        return false;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * NUM_SERVER_FDS);
+
+    if (read_full(conn, (char *)req + n, sizeof(*req) - n) &&
+        memcmp(req->magic, "anqs", 4) == 0 && req->argc >= 0 &&
+        req->size >= 0 && req->size <= SERVER_MAX_ARGS)
+        return true;
+
+    for (n = 0; n < NUM_SERVER_FDS; n++) close(fds[n]);
+    return false;
+}
 
-int main(int argc, char **argv)
+/*
+Compile what the client on conn asks for as compile_main would, and send
+it back 0 when it is done, or 1 for a command line that the server does
+not take.
+*/
+void server_serve(int conn)
 {
-    Token *token_list;
-    AST *prog;
-    FILE *fh;
+    ServerRequest req;
+    Options opts;
+    ByteBuf *line;
+    FILE *in, *out;
+    char *args, **argv;
+    const char *src, *dst;
+    double begin = wall_msec();
+    int fds[NUM_SERVER_FDS], status = 1, argc = 1, i;
+
+    if (!server_recv(conn, &req, fds)) return;
+
+    args = (char *)malloc(req.size + 1);
+    argv = (char **)malloc(sizeof(char *) * (req.argc + 2));
+    assert(args != NULL && argv != NULL);
+    args[req.size] = '\0';
+    argv[0] = "anqoubc";
+    line = new_byte_buf();
+    if (read_full(conn, args, req.size)) {
+        for (i = 0; i < req.size && argc <= req.argc; i++) {
+            argv[argc++] = &args[i];
+            byte_buf_putc(line, ' ');
+            byte_buf_puts(line, &args[i]);
+            i += strlen(&args[i]);
+        }
+        argv[argc] = NULL;
+    }
 
-    if (argc == 1) {
-        execute_test();
-        return 0;
+    init_options(&opts);
+    if (argc == req.argc + 1 &&
+        options_parse_args(&opts, argc, argv, &src, &dst) &&
+        server_can_serve(&opts)) {
+        in = fdopen(fds[SERVER_FD_SRC], "rb");
+        out = fdopen(fds[SERVER_FD_DST], "wb");
+        opts.report_fh = fdopen(fds[SERVER_FD_ERR], "w");
+        assert(in != NULL && out != NULL && opts.report_fh != NULL);
+
+        compile_input(in, strcmp(src, "-") == 0, out, &opts);
+        fclose(in);
+        fclose(out);
+        fclose(opts.report_fh);
+        status = 0;
+    }
+    else {
+        for (i = 0; i < NUM_SERVER_FDS; i++) close(fds[i]);
     }
 
-    assert(argc == 3);
-    fh = fopen(argv[1], "r");
-    assert(fh != NULL);
+    byte_buf_putc(line, '\0');
+    fprintf(stderr, "%.3f ms, status %d:%s\n", wall_msec() - begin, status,
+            line->data);
+    write_full(conn, &status, sizeof(status));
 
-    token_list = tokenize(fh);
-    assert(token_list != NULL);
-    fclose(fh);
-    dump_token_list(token_list);
+    free_byte_buf(line);
+    free(args);
+    free(argv);
+}
 
-    prog = parse(token_list);
+void *server_worker(void *arg)
+{
+    int sock = *(int *)arg;
 
-    fh = fopen(argv[2], "w");
-    assert(fh != NULL);
-    write_obj(prog, fh);
-    fclose(fh);
+    while (true) {
+        int conn = accept(sock, NULL, NULL);
+
+        if (conn < 0) continue;
+        server_serve(conn);
+        close(conn);
+    }
+    return NULL;
+}
+
+/* Serve requests at path on -j<n> threads, one per CPU by default. */
+int server_main(const char *progname, const char *path, int argc,
+                char **argv)
+{
+    struct sockaddr_un addr;
+    pthread_t *threads;
+    Options opts;
+    int sock, ret, i;
+
+    init_options(&opts);
+    opts.jobs = max(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    for (i = 0; i < argc; i++)
+        if (strncmp(argv[i], "-j", 2) != 0 || !options_parse(&opts, argv[i]))
+            usage(progname);
+    if (!server_address(&addr, path)) usage(progname);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(sock >= 0);
+    /* the socket of a server before this one */
+    unlink(path);
+    ret = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    assert(ret == 0);
+    ret = listen(sock, SERVER_BACKLOG);
+    assert(ret == 0);
+
+    /*
+    A source that fails an assert takes down the process serving it, so
+    that is a child, and another one takes over the socket after it.
+    */
+    while (true) {
+        pid_t parent = getpid(), pid = fork();
+
+        assert(pid >= 0);
+        if (pid == 0) {
+            /* and goes when the server is killed */
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            if (getppid() != parent) return 1;
+            break;
+        }
+        waitpid(pid, NULL, 0);
+    }
+
+    /* a client that goes away must not take the server with it */
+    signal(SIGPIPE, SIG_IGN);
+    arena_pool.limit = (size_t)SERVER_ARENA_POOL_MB * 1024 * 1024;
+
+    threads = (pthread_t *)malloc(sizeof(pthread_t) * opts.jobs);
+    assert(threads != NULL);
+    for (i = 1; i < opts.jobs; i++) {
+        ret = pthread_create(&threads[i], NULL, server_worker, &sock);
+        assert(ret == 0);
+    }
+    server_worker(&sock);
 
-    free_token_list(token_list);
-    free_ast((AST *)prog);
+    return 0;
+}
+
+/*
+Copy stdin to an unlinked file, so that a request the server does not
+finish can still be compiled here from the start.
+*/
+FILE *client_buffer_stdin(void)
+{
+    char buf[BUFSIZ];
+    FILE *fh = tmpfile();
+    size_t n;
+
+    if (fh == NULL) return NULL;
+    while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0)
+        assert(fwrite(buf, 1, n, fh) == n);
+    assert(!ferror(stdin) && fflush(fh) == 0);
+    rewind(fh);
+    return fh;
+}
+
+/*
+Have the server at path do what compile_main would do with argv. Without
+a server, or if the source makes it fail, compile_main does it here.
+*/
+int client_main(const char *path, int argc, char **argv)
+{
+    ServerRequest req;
+    Options opts;
+    ByteBuf *args;
+    FILE *in = NULL;
+    const char *src, *dst;
+    char cwd[PATH_MAX];
+    int fds[NUM_SERVER_FDS], sock, status, ok, i;
+
+    init_options(&opts);
+    if (!options_parse_args(&opts, argc, argv, &src, &dst) ||
+        !server_can_serve(&opts))
+        return compile_main(argc, argv);
+
+    /* the server has a working directory of its own */
+    args = new_byte_buf();
+    for (i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--cache=", 8) == 0 && argv[i][8] != '/' &&
+            getcwd(cwd, sizeof(cwd)) != NULL) {
+            byte_buf_puts(args, "--cache=");
+            byte_buf_puts(args, cwd);
+            byte_buf_putc(args, '/');
+            byte_buf_puts(args, argv[i] + 8);
+        }
+        else {
+            byte_buf_puts(args, argv[i]);
+        }
+        byte_buf_putc(args, '\0');
+    }
 
+    if (strcmp(src, "-") == 0) {
+        in = client_buffer_stdin();
+        if (in == NULL) {
+            free_byte_buf(args);
+            return compile_main(argc, argv);
+        }
+        fds[SERVER_FD_SRC] = fileno(in);
+    }
+    else {
+        fds[SERVER_FD_SRC] = open(src, O_RDONLY);
+    }
+    fds[SERVER_FD_DST] =
+        dst == NULL ? STDOUT_FILENO
+                    : open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    fds[SERVER_FD_ERR] = STDERR_FILENO;
+    sock = server_connect(path);
+
+    memcpy(req.magic, "anqs", 4);
+    req.argc = argc - 1;
+    req.size = args->size;
+    ok = fds[SERVER_FD_SRC] >= 0 && fds[SERVER_FD_DST] >= 0 && sock >= 0 &&
+         client_send(sock, &req, args->data, fds) &&
+         read_full(sock, &status, sizeof(status)) && status == 0;
+
+    if (sock >= 0) close(sock);
+    if (in == NULL && fds[SERVER_FD_SRC] >= 0) close(fds[SERVER_FD_SRC]);
+    if (fds[SERVER_FD_DST] > STDERR_FILENO) close(fds[SERVER_FD_DST]);
+    free_byte_buf(args);
+
+    /* the server may have read some of stdin; give all of it back */
+    if (in != NULL) {
+        if (!ok) {
+            assert(lseek(fileno(in), 0, SEEK_SET) == 0 &&
+                   dup2(fileno(in), STDIN_FILENO) == STDIN_FILENO);
+            clearerr(stdin);
+        }
+        fclose(in);
+    }
+    if (!ok) return compile_main(argc, argv);
+    if (opts.emit == EMIT_EXE) chmod(dst, 0755);
     return 0;
 }
+
+int main(int argc, char **argv)
+{
+    if (argc == 1) {
+        execute_test();
+        return 0;
+    }
+
+    if (argc == 2 && strcmp(argv[1], "--bench") == 0) {
+        execute_bench();
+        return 0;
+    }
+    if (argc >= 2 && strcmp(argv[1], "--gen") == 0)
+        return bench_gen_main(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "--bench-suite") == 0)
+        return bench_suite_main(argv[0], argc - 2, argv + 2);
+    if (argc >= 2 && strncmp(argv[1], "--server=", 9) == 0)
+        return server_main(argv[0], argv[1] + 9, argc - 2, argv + 2);
+
+    /* the rest of the arguments are those of compile_main */
+    if (argc >= 2 && strncmp(argv[1], "--client=", 9) == 0) {
+        const char *path = argv[1] + 9;
+
+        argv[1] = argv[0];
+        return client_main(path, argc - 1, argv + 1);
+    }
+
+    return compile_main(argc, argv);
+}
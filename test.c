@@ -8,36 +8,718 @@ void test_tokenize(const char *program, ...)
 {
     va_list answers;
     FILE *fh;
-    Token *token;
+    Arena *arena;
+    TokenList *tokens;
+    int i;
 
+    arena = new_arena();
     fh = fmemopen((void *)program, strlen(program), "rb");
-    token = tokenize(fh);
-    ANQOU_ASSERT(token != NULL);
+    tokens = tokenize(fh, arena);
+    ANQOU_ASSERT(tokens != NULL);
     fclose(fh);
 
     va_start(answers, program);
-    while (token != NULL) {
+    for (i = 0; i < tokens->size; i++) {
         int ans = va_arg(answers, int);
 
-        ANQOU_ASSERT(token->kind == ans);
-        token = token->next;
-
-        ANQOU_ASSERT(token != NULL || ans == tEOF);
-        ANQOU_ASSERT(ans != tEOF || token == NULL);
+        ANQOU_ASSERT(tokens->kind[i] == ans);
+        ANQOU_ASSERT(ans != tEOF || i == tokens->size - 1);
     }
     va_end(answers);
+
+    free_arena(arena);
+}
+
+void test_tokenize_float(const char *program, double ans)
+{
+    FILE *fh;
+    Arena *arena;
+    TokenList *tokens;
+
+    arena = new_arena();
+    fh = fmemopen((void *)program, strlen(program), "rb");
+    tokens = tokenize(fh, arena);
+    ANQOU_ASSERT(tokens != NULL);
+    fclose(fh);
+
+    ANQOU_ASSERT(tokens->kind[0] == tFLOAT);
+    ANQOU_ASSERT(tokens->value[0].fval == ans);
+    free_arena(arena);
+}
+
+void test_arena()
+{
+    Arena *arena;
+    char *p, *q;
+    int i;
+
+    arena = new_arena();
+
+    p = (char *)arena_alloc(arena, 3);
+    q = (char *)arena_alloc(arena, 5);
+    ANQOU_ASSERT((size_t)p % ARENA_ALIGN == 0);
+    ANQOU_ASSERT((size_t)q % ARENA_ALIGN == 0);
+    ANQOU_ASSERT(p + ARENA_ALIGN == q);
+
+    /* the latest allocation grows in place */
+    strcpy(q, "abcd");
+    ANQOU_ASSERT(arena_realloc(arena, q, 5, 100) == q);
+    /* others are copied */
+    strcpy(p, "xy");
+    p = (char *)arena_realloc(arena, p, 3, 10);
+    ANQOU_ASSERT(strcmp(p, "xy") == 0 && strcmp(q, "abcd") == 0);
+
+    /* bigger than a chunk */
+    p = (char *)arena_alloc(arena, ARENA_CHUNK_SIZE * 3);
+    for (i = 0; i < ARENA_CHUNK_SIZE * 3; i++) p[i] = i;
+    ANQOU_ASSERT(arena->peak >= arena->used);
+    ANQOU_ASSERT(arena->used >= ARENA_CHUNK_SIZE * 3);
+
+    free_arena(arena);
+
+    /* with a pool, the next arena gets the chunk the last one gave back */
+    arena_pool.limit = ARENA_CHUNK_SIZE * 4;
+    arena = new_arena();
+    p = (char *)arena_alloc(arena, ARENA_CHUNK_SIZE);
+    free_arena(arena);
+    ANQOU_ASSERT(arena_pool.size == ARENA_CHUNK_SIZE);
+    arena = new_arena();
+    ANQOU_ASSERT(arena_alloc(arena, 8) == p && arena_pool.size == 0);
+    free_arena(arena);
+
+    /* but not more than the limit */
+    arena = new_arena();
+    arena_alloc(arena, ARENA_CHUNK_SIZE * 5);
+    free_arena(arena);
+    ANQOU_ASSERT(arena_pool.size == ARENA_CHUNK_SIZE);
+    while ((p = (char *)arena_pool_take(0)) != NULL) free(p);
+    arena_pool.limit = 0;
+}
+
+void test_parse_many_stmts()
+{
+    Arena *arena;
+    TokenList *tokens;
+    AST *prog;
+    char *src;
+    int i, nstmts = 1000000;
+
+    /* deep enough to overflow the stack if statements were recursed */
+    src = (char *)malloc(nstmts * 2 + 1);
+    for (i = 0; i < nstmts; i++) {
+        src[i * 2] = '0' + i % 10;
+        src[i * 2 + 1] = ';';
+    }
+
+    arena = new_arena();
+    tokens = tokenize_buffer(arena, NULL, src, nstmts * 2);
+    ANQOU_ASSERT(tokens != NULL);
+    prog = parse(tokens, arena, NULL, false);
+    ANQOU_ASSERT(prog != NULL && prog->kind == AST_PROG);
+    ANQOU_ASSERT(prog->nstmts == nstmts);
+    ANQOU_ASSERT(prog->stmts[nstmts - 1]->ival == (nstmts - 1) % 10);
+
+    free_arena(arena);
+    free(src);
+}
+
+AST *test_parse_expr(Arena *arena, const char *program)
+{
+    TokenList *tokens;
+    AST *prog;
+
+    tokens = tokenize_buffer(arena, NULL, program, strlen(program));
+    ANQOU_ASSERT(tokens != NULL);
+    prog = parse(tokens, arena, NULL, false);
+    ANQOU_ASSERT(prog != NULL && prog->nstmts == 1);
+    return prog->stmts[0];
+}
+
+void test_parse_long_expr()
+{
+    enum { NTERMS = 1000000 };
+    Arena *arena = new_arena();
+    char *src = (char *)malloc(NTERMS * 2 + 1), *p = src;
+    AST *ast;
+    int i;
+
+    /* the usual precedence; every operator is left-associative */
+    ast = test_parse_expr(arena, "1 - 2 * 3 / -4 + (5 - (6 - 7));");
+    ANQOU_ASSERT(ast->kind == AST_ADD && ast->rhs->kind == AST_SUB);
+    ANQOU_ASSERT(ast->rhs->rhs->kind == AST_SUB);
+    ast = ast->lhs;
+    ANQOU_ASSERT(ast->kind == AST_SUB && ast->rhs->kind == AST_DIV);
+    ANQOU_ASSERT(ast->rhs->lhs->kind == AST_MUL);
+    ANQOU_ASSERT(ast->rhs->rhs->ival == -4);
+
+    /* a chain as long as this takes no more stack than a short one */
+    ANQOU_ASSERT(src != NULL);
+    for (i = 0; i < NTERMS; i++) {
+        *p++ = '1';
+        *p++ = '-';
+    }
+    p[-1] = ';';
+    *p = '\0';
+    ast = test_parse_expr(arena, src);
+    ANQOU_ASSERT(ast_count(ast) == NTERMS * 2 - 1);
+    for (i = 1; i < NTERMS; i++, ast = ast->lhs)
+        ANQOU_ASSERT(ast->kind == AST_SUB && ast->rhs->kind == AST_LITERAL);
+    ANQOU_ASSERT(ast->kind == AST_LITERAL && ast->ival == 1);
+
+    ast = fold_ast(arena, test_parse_expr(arena, src));
+    ANQOU_ASSERT(ast->kind == AST_LITERAL && ast->ival == 2 - NTERMS);
+
+    free(src);
+    free_arena(arena);
+}
+
+void test_fold()
+{
+    Arena *arena;
+    AST *ast;
+
+    arena = new_arena();
+
+    ast = fold_ast(arena, test_parse_expr(arena, "(1 + 2) * 3 - -7 / 2;"));
+    ANQOU_ASSERT(ast->kind == AST_LITERAL && ast->type.kind == TY_LONG);
+    ANQOU_ASSERT(ast->ival == 12);
+
+    ast = fold_ast(arena, test_parse_expr(arena, "1 / 2.0 + 3;"));
+    ANQOU_ASSERT(ast->kind == AST_LITERAL && ast->type.kind == TY_DOUBLE);
+    ANQOU_ASSERT(ast->fval == 3.5);
+
+    /* these trap or have no literal form, so they are left alone */
+    ast = fold_ast(arena, test_parse_expr(arena, "(1 + 1) / 0;"));
+    ANQOU_ASSERT(ast->kind == AST_DIV && ast->lhs->kind == AST_LITERAL);
+    ast = fold_ast(arena, test_parse_expr(arena, "1.0 / 0;"));
+    ANQOU_ASSERT(ast->kind == AST_DIV);
+
+    free_arena(arena);
+}
+
+void test_hashcons()
+{
+    static const char *program = "(1 + 2 * 3) * (1 + 2 * 3) - (1 + 2 * 3); "
+                                 "1 + 2 * 3; (4 + 5) * (4 + 5);";
+    Arena *arena = new_arena();
+    TokenList *tokens;
+    AST *prog, *stmt;
+    IR *ir;
+    long nreused = 0;
+    int i, nadds = 0;
+
+    tokens = tokenize_buffer(arena, NULL, program, strlen(program));
+    prog = parse(tokens, arena, NULL, false);
+    ANQOU_ASSERT(hashcons_ast(prog, &nreused) == 18 && nreused == 2);
+    stmt = prog->stmts[0];
+    ANQOU_ASSERT(stmt->lhs->lhs == stmt->lhs->rhs);
+    ANQOU_ASSERT(stmt->lhs->lhs == stmt->rhs && stmt->rhs == prog->stmts[1]);
+    stmt = prog->stmts[2];
+    ANQOU_ASSERT(stmt->lhs == stmt->rhs && stmt->lhs->shared == 0);
+
+    /*
+    computed once in each statement that uses it, but one operation on
+    leaves is done again where it is used
+    */
+    ir = lower_prog(prog);
+    for (i = 0; i < ir->ninsts; i++) nadds += ir->insts[i].op == IR_ADD;
+    ANQOU_ASSERT(nadds == 4);
+
+    free_ir(ir);
+    free_arena(arena);
+}
+
+void test_symtab()
+{
+    static const char *program = "x = 1; _y2 = x * 2.0; x = _y2 - x; x;";
+    SymTab *syms = new_symtab();
+    Arena *arena = new_arena();
+    TokenList *tokens;
+    AST *prog;
+    char name[16];
+    int i;
+
+    ANQOU_ASSERT(symtab_intern(syms, "xyz", 2) == 0);
+    ANQOU_ASSERT(symtab_intern(syms, "xy", 2) == 0);
+    ANQOU_ASSERT(symtab_intern(syms, "x", 1) == 1);
+    ANQOU_ASSERT(strcmp(symtab_name(syms, 0), "xy") == 0);
+    for (i = 0; i < 100000; i++) {
+        sprintf(name, "v%d", i);
+        ANQOU_ASSERT(symtab_intern(syms, name, strlen(name)) == i + 2);
+    }
+    for (i = 0; i < 100000; i += 997) {
+        sprintf(name, "v%d", i);
+        ANQOU_ASSERT(symtab_intern(syms, name, strlen(name)) == i + 2);
+    }
+    free_symtab(syms);
+
+    /* names are an error without a table to put them in */
+    ANQOU_ASSERT(tokenize_buffer(arena, NULL, program, strlen(program)) ==
+                 NULL);
+
+    syms = new_symtab();
+    tokens = tokenize_buffer(arena, syms, program, strlen(program));
+    ANQOU_ASSERT(tokens != NULL && syms->size == 2);
+    ANQOU_ASSERT(tokens->kind[0] == tVARIABLE && tokens->kind[1] == tASSIGN);
+    ANQOU_ASSERT(tokens->value[0].ival == tokens->value[10].ival);
+    prog = parse(tokens, arena, syms, false);
+    ANQOU_ASSERT(prog != NULL && prog->nstmts == 4);
+    ANQOU_ASSERT(prog->stmts[2]->kind == AST_ASSIGN);
+    ANQOU_ASSERT(prog->stmts[3]->type.kind == TY_DOUBLE);
+    ANQOU_ASSERT(syms->types[0] == TY_DOUBLE);
+
+    /* the literals are carried through the names */
+    prog = fold_ast(arena, prog);
+    ANQOU_ASSERT(prog->stmts[3]->kind == AST_LITERAL);
+    ANQOU_ASSERT(prog->stmts[3]->fval == 1.0);
+
+    free_symtab(syms);
+    free_arena(arena);
+}
+
+void test_ir()
+{
+    static const int ops[] = {IR_LOADI, IR_LOADI, IR_ADD,  IR_CVT,
+                              IR_LOADF, IR_MUL,   IR_PRINT};
+    Arena *arena;
+    AST *prog;
+    IR *ir;
+    int i, v[9], nspilled;
+
+    arena = new_arena();
+
+    /* the subtree that needs more registers is lowered first */
+    prog = parse(tokenize_buffer(arena, NULL, "3.0 * (1 + 2);", 14), arena,
+                 NULL, false);
+    ir = lower_prog(prog);
+    ANQOU_ASSERT(ir->ninsts == sizeof(ops) / sizeof(ops[0]));
+    for (i = 0; i < ir->ninsts; i++) ANQOU_ASSERT(ir->insts[i].op == ops[i]);
+
+    /* a dead load goes away, but a division that may trap stays */
+    ir_append(ir, IR_LOADI, ir_new_vreg(ir, TY_LONG), -1, -1);
+    ir_append(ir, IR_DIV, ir_new_vreg(ir, TY_LONG), 0, 1);
+    ANQOU_ASSERT(dce_ir(ir) == 1);
+    ANQOU_ASSERT(ir->insts[ir->ninsts - 1].op == IR_DIV);
+
+    /* the operands of the division are live across printf */
+    regalloc_ir(ir, true);
+    ANQOU_ASSERT(ir->stack_size == 2 * SZ_QWORD);
+    ANQOU_ASSERT(ir->vregs[0].reg < 0 && ir->vregs[1].reg < 0);
+    ANQOU_ASSERT(ir->vregs[2].reg >= 0);
+    regalloc_ir(ir, false);
+    ANQOU_ASSERT(ir->stack_size == 4 * SZ_QWORD);
+    for (i = 0; i < ir->nvregs; i++) ANQOU_ASSERT(ir->vregs[i].reg < 0);
+    free_ir(ir);
+
+    /* nine longs live at once do not fit in the pool */
+    ir = new_ir();
+    for (i = 0; i < 9; i++) {
+        v[i] = ir_new_vreg(ir, TY_LONG);
+        ir_append(ir, IR_LOADI, v[i], -1, -1)->ival = i;
+    }
+    for (i = 1; i < 9; i++) {
+        int dst = ir_new_vreg(ir, TY_LONG);
+
+        ir_append(ir, IR_ADD, dst, v[0], v[i]);
+        v[0] = dst;
+    }
+    ir_append(ir, IR_PRINT, -1, v[0], -1);
+    regalloc_ir(ir, true);
+    for (i = nspilled = 0; i < ir->nvregs; i++)
+        if (ir->vregs[i].reg < 0) nspilled++;
+    ANQOU_ASSERT(nspilled == 9 - NUM_GP_REGS);
+    ANQOU_ASSERT(ir->stack_size == nspilled * SZ_QWORD);
+    free_ir(ir);
+
+    free_arena(arena);
+}
+
+void test_vectorize()
+{
+    static const int ops[] = {IR_LOADV,   IR_LOADV,   IR_ADD,   IR_EXTRACT,
+                              IR_EXTRACT, IR_PRINT,   IR_PRINT, IR_LOADI,
+                              IR_LOADI,   IR_MUL,     IR_PRINT, IR_LOADI,
+                              IR_LOADI,   IR_MUL,     IR_PRINT};
+    static const char *program = "1.0 + 2.0; 3.0 + 4.0; 5 * 6; 7 * 8;";
+    static const char *chain = "x = 2.0; x; x = x * 3.0; x - 1.0; "
+                               "x = x * 3.0; x - 1.0; x = x * 3.0; x - 1.0;";
+    Arena *arena = new_arena();
+    SymTab *syms = new_symtab();
+    IR *ir;
+    int i;
+
+    /* packed longs cannot be multiplied, so the second pair stays scalar */
+    ir = lower_prog(parse(tokenize_buffer(arena, NULL, program,
+                                          strlen(program)),
+                          arena, NULL, false));
+    ANQOU_ASSERT(vectorize_ir(ir) == 1);
+    ANQOU_ASSERT(ir->ninsts == sizeof(ops) / sizeof(ops[0]));
+    for (i = 0; i < ir->ninsts; i++) ANQOU_ASSERT(ir->insts[i].op == ops[i]);
+    ANQOU_ASSERT(ir->vregs[ir->insts[2].dst].type == TY_V2DOUBLE);
+    ANQOU_ASSERT(ir->insts[3].ival == 1 && ir->insts[4].ival == 0);
+
+    /* only the high lane is live across the first print */
+    regalloc_ir(ir, true);
+    ANQOU_ASSERT(ir->stack_size == SZ_QWORD);
+
+    /* packed values in the frame get aligned slots */
+    regalloc_ir(ir, false);
+    for (i = 0; i < ir->nvregs; i++) {
+        if (ir->vregs[i].type >= TY_V2LONG && ir->vregs[i].stack_idx > 0)
+            ANQOU_ASSERT(ir->vregs[i].stack_idx % 16 == 0);
+    }
+    free_ir(ir);
+
+    /* a statement reading what the one before computes is not paired */
+    ir = lower_prog(parse(tokenize_buffer(arena, syms, chain, strlen(chain)),
+                          arena, syms, false));
+    ANQOU_ASSERT(vectorize_ir(ir) == 0);
+    free_ir(ir);
+    free_symtab(syms);
+
+    free_arena(arena);
+}
+
+void test_strength_stmt(ByteBuf *src, ByteBuf *expected, long n, long c,
+                        int div)
+{
+    volatile long vc = c; /* keep the division to idiv */
+
+    /* the literal of LONG_MIN is out of range; it is a sum on the left */
+    if ((div && (c == 0 || c == -1)) || c == LONG_MIN) return;
+    if (n == LONG_MIN)
+        byte_buf_puts(src, "(-9223372036854775807 - 1)");
+    else
+        byte_buf_put_long(src, n);
+    byte_buf_puts(src, div ? " / " : " * ");
+    byte_buf_put_long(src, c);
+    byte_buf_puts(src, ";\n");
+    byte_buf_put_long(expected,
+                      div ? n / vc
+                          : (long)((unsigned long)n * (unsigned long)c));
+    byte_buf_puts(expected, "i\n");
+}
+
+/*
+Divide and multiply by all kinds of literals in generated code, with the
+dividends in registers and in the frame, and compare with the host.
+*/
+void test_strength()
+{
+    static const long edges[] = {
+        0, 1, 2, 3, 5, 6, 7, 9, 10, 100, 641, 1000003, 2147483647L,
+        2147483648L, 4294967295L, 4294967296L, 6700417L * 641,
+        3074457345618258602L, 4611686018427387904L, 9223372036854775807L};
+    static const char *program = "3 * x; x / -1; x / 1; x * 3000000000;";
+    int nedges = sizeof(edges) / sizeof(edges[0]);
+    ByteBuf *src = new_byte_buf(), *expected = new_byte_buf(), *out;
+    Arena *arena = new_arena();
+    SymTab *syms = new_symtab();
+    unsigned long seed = 1;
+    long c, divisors[4];
+    Options opts;
+    IR *ir;
+    FILE *fh;
+    int i, j, k, regalloc, fd, ndivs;
+
+    /* idiv stays for -1, on which it traps, and imul for large literals */
+    i = symtab_intern(syms, "x", 1);
+    syms->types[i] = TY_LONG;
+    ir = lower_prog(parse(tokenize_buffer(arena, syms, program,
+                                          strlen(program)),
+                          arena, syms, false));
+    ANQOU_ASSERT(strength_ir(ir, &ndivs) == 1 && ndivs == 1);
+    dce_ir(ir);
+    ANQOU_ASSERT(ir->insts[1].op == IR_MULI && ir->insts[1].ival == 3);
+    ANQOU_ASSERT(ir->insts[4].op == IR_DIV);
+    ANQOU_ASSERT(ir->insts[6].op == IR_MULI && ir->insts[6].ival == 1);
+    ANQOU_ASSERT(ir->insts[9].op == IR_MUL);
+    free_ir(ir);
+    free_symtab(syms);
+    free_arena(arena);
+
+    for (c = -300; c <= 300; c++) {
+        for (i = 0; i < nedges; i++) {
+            test_strength_stmt(src, expected, edges[i], c, false);
+            test_strength_stmt(src, expected, edges[i], c, true);
+            test_strength_stmt(src, expected, -edges[i] - 1, c, true);
+        }
+        /* around the multiples of c, where the quotient changes */
+        for (i = 1; i < 1000; i += 211) {
+            test_strength_stmt(src, expected, i * c - 1, c, true);
+            test_strength_stmt(src, expected, -i * c + 1, c, true);
+        }
+    }
+    for (i = 0; i < 63 + 40; i++) {
+        if (i < 63) {
+            /* the powers of two and their neighbours */
+            divisors[0] = 1L << i;
+            divisors[1] = -divisors[0];
+            divisors[2] = divisors[0] + 1;
+            divisors[3] = divisors[0] - 1;
+        }
+        else {
+            /* and some of all sizes */
+            for (k = 0; k < 4; k++) {
+                seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+                divisors[k] = (long)(seed >> (seed % 63));
+                if (k % 2 == 1) divisors[k] = -divisors[k];
+            }
+        }
+        for (k = 0; k < 4; k++) {
+            c = divisors[k];
+            for (j = 0; j < nedges; j++) {
+                test_strength_stmt(src, expected, edges[j], c, false);
+                test_strength_stmt(src, expected, -edges[j] - 1, c, false);
+                test_strength_stmt(src, expected, edges[j], c, true);
+                test_strength_stmt(src, expected, -edges[j] - 1, c, true);
+            }
+        }
+    }
+    init_options(&opts);
+    opts.emit = EMIT_RUN;
+    opts.enabled[OPT_FOLD] = false;
+    for (regalloc = false; regalloc <= true; regalloc++) {
+        opts.enabled[OPT_REGALLOC] = regalloc;
+        fh = tmpfile();
+        ANQOU_ASSERT(fh != NULL);
+        fflush(stdout);
+        fd = dup(1);
+        ANQOU_ASSERT(fd >= 0 && dup2(fileno(fh), 1) == 1);
+        compile(src->data, src->size, NULL, &opts);
+        ANQOU_ASSERT(dup2(fd, 1) == 1);
+        close(fd);
+
+        rewind(fh);
+        out = new_byte_buf();
+        byte_buf_reserve(out, expected->size + 1);
+        out->size = fread(out->data, 1, expected->size + 1, fh);
+        ANQOU_ASSERT(out->size == expected->size);
+        ANQOU_ASSERT(memcmp(out->data, expected->data, out->size) == 0);
+        free_byte_buf(out);
+        fclose(fh);
+    }
+
+    free_byte_buf(src);
+    free_byte_buf(expected);
+}
+
+void test_peephole()
+{
+    int hits[NUM_PEEPHOLE_RULES] = {0};
+    unsigned long args = (1UL << REG_RSI) | (1UL << REG_RDI);
+    ConstPool *pool = new_const_pool();
+    AsmList *code;
+
+    /* mov $2, %rsi; add %rsi, %rcx -> add $2, %rcx */
+    code = new_asm_list();
+    asm_append(code, X_MOV, opd_of(OPD_IMM, 1), opd_reg(REG_RCX));
+    asm_append(code, X_MOV, opd_of(OPD_IMM, 2), opd_reg(REG_RSI));
+    asm_append(code, X_ADD, opd_reg(REG_RSI), opd_reg(REG_RCX));
+    asm_append(code, X_MOV, opd_reg(REG_RCX), opd_reg(REG_RAX));
+    asm_append(code, X_MOV, opd_reg(REG_RAX), opd_reg(REG_RSI));
+    asm_append(code, X_CALL, opd_of(OPD_SYM, SYM_RT_PRINT_LONG),
+               opd_of(OPD_NONE, args));
+    peephole(code, pool, hits);
+    ANQOU_ASSERT(code->size == 4);
+    ANQOU_ASSERT(code->data[1].op == X_ADD && code->data[1].src.val == 2);
+    ANQOU_ASSERT(code->data[2].op == X_MOV &&
+                 opd_is_reg(&code->data[2].src, REG_RCX) &&
+                 opd_is_reg(&code->data[2].dst, REG_RSI));
+    ANQOU_ASSERT(hits[PH_FOLD_OPERAND] == 1 && hits[PH_COPY_CHAIN] == 1);
+    free_asm_list(code);
+
+    /* a slot that is read right after the store is never needed */
+    memset(hits, 0, sizeof(hits));
+    code = new_asm_list();
+    asm_append(code, X_MOV, opd_reg(REG_RCX), opd_mem(REG_RBP, -8));
+    asm_append(code, X_MOV, opd_mem(REG_RBP, -8), opd_reg(REG_RSI));
+    asm_append(code, X_CALL, opd_of(OPD_SYM, SYM_RT_PRINT_LONG),
+               opd_of(OPD_NONE, args));
+    peephole(code, pool, hits);
+    ANQOU_ASSERT(code->size == 2);
+    ANQOU_ASSERT(opd_is_reg(&code->data[0].src, REG_RCX));
+    ANQOU_ASSERT(hits[PH_STORE_FORWARD] == 1 && hits[PH_DEAD_STORE] == 1);
+    free_asm_list(code);
+
+    /* the loaded constant is dead after the conversion */
+    memset(hits, 0, sizeof(hits));
+    code = new_asm_list();
+    asm_append(code, X_MOV, opd_of(OPD_IMM, 4), opd_reg(REG_RCX));
+    asm_append(code, X_CVTSI2SDQ, opd_reg(REG_RCX), opd_reg(REG_XMM0));
+    asm_append(code, X_CALL, opd_of(OPD_SYM, SYM_RT_PRINT_LONG),
+               opd_of(OPD_NONE, 1UL << REG_XMM0));
+    peephole(code, pool, hits);
+    ANQOU_ASSERT(code->data[0].op == X_MOVSD &&
+                 code->data[0].src.kind == OPD_RIP_LABEL);
+    ANQOU_ASSERT(code->data[0].src.val == const_pool_intern(pool, 4.0));
+    ANQOU_ASSERT(pool->size == 1);
+    free_asm_list(code);
+    free_const_pool(pool);
+}
+
+void test_const_pool()
+{
+    ConstPool *pool = new_const_pool();
+    double zero = 0.0;
+    int i;
+
+    ANQOU_ASSERT(const_pool_intern(pool, 0.1) == 0);
+    ANQOU_ASSERT(const_pool_intern(pool, 0.0) == 1);
+    ANQOU_ASSERT(const_pool_intern(pool, -zero) == 2);
+    ANQOU_ASSERT(const_pool_intern(pool, 0.1) == 0);
+
+    /* survives rehashing */
+    for (i = 0; i < 1000; i++) const_pool_intern(pool, i + 0.5);
+    for (i = 0; i < 1000; i++)
+        ANQOU_ASSERT(const_pool_intern(pool, i + 0.5) == i + 3);
+    ANQOU_ASSERT(pool->size == 1003);
+    ANQOU_ASSERT(pool->bits[0] == 0x3fb999999999999aUL);
+
+    /* pairs are interned apart from their halves */
+    ANQOU_ASSERT(const_pool_intern_pair(pool, 7, 8) == 1003);
+    ANQOU_ASSERT(const_pool_intern_pair(pool, 7, 8) == 1003);
+    ANQOU_ASSERT(const_pool_intern_pair(pool, 8, 7) == 1005);
+    ANQOU_ASSERT(pool->size == 1007);
+
+    free_const_pool(pool);
+}
+
+void test_assembler()
+{
+    /* the encodings gas picks */
+    static const char expected[] =
+        "\x48\x89\x45\xf8"                         /* mov %rax,-8(%rbp) */
+        "\x4c\x8b\x85\x38\xff\xff\xff"             /* mov -200(%rbp),%r8 */
+        "\xf2\x44\x0f\x10\x4c\x24\x08"             /* movsd 8(%rsp),%xmm9 */
+        "\x48\x83\xc1\x01"                         /* add $1,%rcx */
+        "\x49\xbb\x89\x67\x45\x23\x01\x00\x00\x00" /* movabs */
+        "\x49\xf7\xfa"                             /* idiv %r10 */
+        "\xf2\x4d\x0f\x2a\xe1"                     /* cvtsi2sdq */
+        "\x48\x3d\x00\xfe\x00\x00"                 /* cmp $0xfe00,%rax */
+        "\x88\x0e"                                 /* mov %cl,(%rsi) */
+        "\x48\xc1\xea\x03"                         /* shr $3,%rdx */
+        "\x66\x41\x0f\x58\xc1"                     /* addpd %xmm9,%xmm0 */
+        "\x66\x0f\x29\x4d\xe0"                     /* movapd %xmm1,-32(%rbp) */
+        "\x41\x0f\x12\xfa"                         /* movhlps %xmm10,%xmm7 */
+        "\x4b\x8d\x74\x8d\x00"                     /* lea (%r13,%r9,4),%rsi */
+        "\x48\xc1\xfa\x05"                         /* sar $5,%rdx */
+        "\x48\xf7\x6d\xf8"                         /* imulq -8(%rbp) */
+        "\x49\xf7\xdb";                            /* neg %r11 */
+    AsmList *code = new_asm_list();
+    Assembler *as = new_assembler(false);
+
+    asm_append(code, X_MOV, opd_reg(REG_RAX), opd_mem(REG_RBP, -8));
+    asm_append(code, X_MOV, opd_mem(REG_RBP, -200), opd_reg(REG_R8));
+    asm_append(code, X_MOVSD, opd_mem(REG_RSP, 8), opd_reg(REG_XMM0 + 9));
+    asm_append(code, X_ADD, opd_of(OPD_IMM, 1), opd_reg(REG_RCX));
+    asm_append(code, X_MOV, opd_of(OPD_IMM, 0x123456789L), opd_reg(REG_R11));
+    asm_append(code, X_IDIV, opd_reg(REG_R10), opd_none());
+    asm_append(code, X_CVTSI2SDQ, opd_reg(REG_R9), opd_reg(REG_XMM0 + 12));
+    asm_append(code, X_CMP, opd_of(OPD_IMM, 0xfe00), opd_reg(REG_RAX));
+    asm_append(code, X_MOVB, opd_reg(REG_RCX), opd_mem(REG_RSI, 0));
+    asm_append(code, X_SHR, opd_of(OPD_IMM, 3), opd_reg(REG_RDX));
+    asm_append(code, X_ADDPD, opd_reg(REG_XMM0 + 9), opd_reg(REG_XMM0));
+    asm_append(code, X_MOVAPD, opd_reg(REG_XMM0 + 1), opd_mem(REG_RBP, -32));
+    asm_append(code, X_MOVHLPS, opd_reg(REG_XMM0 + 10), opd_reg(REG_XMM0 + 7));
+    asm_append(code, X_LEA, opd_index(REG_R13, REG_R9, 4), opd_reg(REG_RSI));
+    asm_append(code, X_SAR, opd_of(OPD_IMM, 5), opd_reg(REG_RDX));
+    asm_append(code, X_IMULQ, opd_mem(REG_RBP, -8), opd_none());
+    asm_append(code, X_NEG, opd_none(), opd_reg(REG_R11));
+    assemble(as, code);
+
+    ANQOU_ASSERT(as->secs[SEC_TEXT]->size == sizeof(expected) - 1);
+    ANQOU_ASSERT(memcmp(as->secs[SEC_TEXT]->data, expected,
+                        sizeof(expected) - 1) == 0);
+
+    free_assembler(as);
+    free_asm_list(code);
+}
+
+void test_jit()
+{
+    AsmList *code = new_asm_list();
+
+    asm_append(code, X_SECTION, opd_of(OPD_IMM, SEC_TEXT), opd_none());
+    asm_append(code, X_LABEL, opd_of(OPD_SYM, SYM_MAIN), opd_none());
+    asm_append(code, X_MOV, opd_of(OPD_IMM, 6), opd_reg(REG_RCX));
+    asm_append(code, X_IMUL, opd_of(OPD_IMM, 7), opd_reg(REG_RCX));
+    asm_append(code, X_MOV, opd_reg(REG_RCX), opd_reg(REG_RAX));
+    asm_append(code, X_RET, opd_none(), opd_none());
+    ANQOU_ASSERT(jit_run(code) == 42);
+
+    free_asm_list(code);
+}
+
+void test_interp()
+{
+    static const char *program =
+        "(1 + 2) * 3 - -7 / 2; 1 / 2.0 + 3; 9223372036854775807 + 1;";
+    static const char *expected =
+        "12i\n3.500000f\n-9223372036854775808i\n";
+    Arena *arena = new_arena();
+    TokenList *tokens;
+    Bytecode *bc;
+    FILE *fh;
+    char buf[256];
+    size_t size;
+
+    tokens = tokenize_buffer(arena, NULL, program, strlen(program));
+    ANQOU_ASSERT(tokens != NULL);
+    bc = bc_compile(parse(tokens, arena, NULL, false), 0);
+    ANQOU_ASSERT(bc->nregs == 3);
+
+    fh = tmpfile();
+    ANQOU_ASSERT(fh != NULL);
+    bc_run(bc, fh);
+    rewind(fh);
+    size = fread(buf, 1, sizeof(buf) - 1, fh);
+    buf[size] = '\0';
+    ANQOU_ASSERT(strcmp(buf, expected) == 0);
+
+    fclose(fh);
+    free_bytecode(bc);
+    free_arena(arena);
 }
 
 void execute_test()
 {
-    test_tokenize("0+0;", tFLOAT, tPLUS, tFLOAT, tSEMICOLON, tEOF);
-    test_tokenize("0+0+0+0+0;", tFLOAT, tPLUS, tFLOAT, tPLUS, tFLOAT, tPLUS,
-                  tFLOAT, tPLUS, tFLOAT, tSEMICOLON, tEOF);
-    test_tokenize("0+0*0+0+0;", tFLOAT, tPLUS, tFLOAT, tSTAR, tFLOAT, tPLUS,
-                  tFLOAT, tPLUS, tFLOAT, tSEMICOLON, tEOF);
-    test_tokenize("0+0*0+0-0;", tFLOAT, tPLUS, tFLOAT, tSTAR, tFLOAT, tPLUS,
-                  tFLOAT, tMINUS, tFLOAT, tSEMICOLON, tEOF);
-    test_tokenize("(0+0)*0+0-0;", tLPAREN, tFLOAT, tPLUS, tFLOAT, tRPAREN,
-                  tSTAR, tFLOAT, tPLUS, tFLOAT, tMINUS, tFLOAT, tSEMICOLON,
-                  tEOF);
+    test_arena();
+    test_parse_many_stmts();
+    test_parse_long_expr();
+    test_fold();
+    test_symtab();
+    test_hashcons();
+    test_ir();
+    test_strength();
+    test_vectorize();
+    test_peephole();
+    test_const_pool();
+    test_assembler();
+    test_jit();
+    test_interp();
+
+    test_tokenize("0+0;", tINTEGER, tPLUS, tINTEGER, tSEMICOLON, tEOF);
+    test_tokenize("0+0+0+0+0;", tINTEGER, tPLUS, tINTEGER, tPLUS, tINTEGER,
+                  tPLUS, tINTEGER, tPLUS, tINTEGER, tSEMICOLON, tEOF);
+    test_tokenize("0+0*0+0+0;", tINTEGER, tPLUS, tINTEGER, tSTAR, tINTEGER,
+                  tPLUS, tINTEGER, tPLUS, tINTEGER, tSEMICOLON, tEOF);
+    test_tokenize("0+0*0+0-0;", tINTEGER, tPLUS, tINTEGER, tSTAR, tINTEGER,
+                  tPLUS, tINTEGER, tMINUS, tINTEGER, tSEMICOLON, tEOF);
+    test_tokenize("(0+0)*0+0-0;", tLPAREN, tINTEGER, tPLUS, tINTEGER, tRPAREN,
+                  tSTAR, tINTEGER, tPLUS, tINTEGER, tMINUS, tINTEGER,
+                  tSEMICOLON, tEOF);
+    test_tokenize("1.5*2", tFLOAT, tSTAR, tINTEGER, tEOF);
+
+    test_tokenize_float("0.1;", 0.1);
+    test_tokenize_float("4583.", 4583.);
+    test_tokenize_float("1.2.3", 1.2);
+    test_tokenize_float("123456789012345678901234567890.5",
+                        123456789012345678901234567890.5);
+    test_tokenize_float(
+        "0.000000000000000000000000000000000000000000000000000000000000000000"
+        "000000000000000000000000000000000000000000000000000000000000000000000"
+        "000000000000000000000000000000000000000000000000000000000000000000000"
+        "000000000000000000000000000000000000000000000000000000000000000000001",
+        1e-273);
 }
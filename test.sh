@@ -5,13 +5,13 @@ test_anqoubc() {
     tempout=`mktemp --suffix=.o`
     tempres=`mktemp --suffix=.dat`
 
-    ./anqoubc $1 $tempasm
+    ./anqoubc $3 $1 $tempasm
     gcc $tempasm -no-pie -o $tempout
     $tempout > $tempres
     #paste -d "=" $tempres $2 | sed 's/=/==/g' - | bc 2> /dev/null | grep -n 0 | cut -f 1 -d ":" | awk "{print \"ERROR $1 L.\" \$1 }"
     diff $tempres $2
-    if [ $? -eq 1 ]; then
-        echo "ERROR: $1"
+    if [ $? -ne 0 ]; then
+        echo "ERROR: $1 $3"
     fi
 
     rm $tempasm
@@ -19,7 +19,219 @@ test_anqoubc() {
     rm $tempres
 }
 
-seq -f "%02.f" 1 11 | while read i; do
-    test_anqoubc "test/compile_$i.in" "test/compile_$i.out"
+# the object and the executable written without gas and ld
+test_anqoubc_elf() {
+    tempobj=`mktemp --suffix=.o`
+    tempout=`mktemp`
+    tempres=`mktemp --suffix=.dat`
+
+    ./anqoubc $3 --emit=obj $1 $tempobj
+    gcc $tempobj -no-pie -o $tempout
+    $tempout > $tempres
+    diff $tempres $2
+    if [ $? -ne 0 ]; then
+        echo "ERROR: $1 $3 --emit=obj"
+    fi
+
+    ./anqoubc $3 --emit=exe $1 $tempout
+    $tempout > $tempres
+    diff $tempres $2
+    if [ $? -ne 0 ]; then
+        echo "ERROR: $1 $3 --emit=exe"
+    fi
+
+    rm $tempobj
+    rm $tempout
+    rm $tempres
+}
+
+# --run has to print exactly what the compiled program prints
+test_anqoubc_run() {
+    tempres=`mktemp --suffix=.dat`
+
+    ./anqoubc $3 --run $1 > $tempres
+    diff $tempres $2
+    if [ $? -ne 0 ]; then
+        echo "ERROR: $1 $3 --run"
+    fi
+
+    rm $tempres
+}
+
+# assembly compiled from stdin as it is read
+test_anqoubc_stream() {
+    tempasm=`mktemp --suffix=.s`
+    tempout=`mktemp`
+    tempres=`mktemp --suffix=.dat`
+
+    ./anqoubc $3 - $tempasm < $1
+    gcc $tempasm -no-pie -o $tempout
+    $tempout > $tempres
+    diff $tempres $2
+    if [ $? -ne 0 ]; then
+        echo "ERROR: $1 $3 (stdin)"
+    fi
+
+    rm $tempasm
+    rm $tempout
+    rm $tempres
+}
+
+# the bytecode interpreter is the reference the native code is held to
+test_anqoubc_interp() {
+    tempres=`mktemp --suffix=.dat`
+
+    ./anqoubc --interp $1 > $tempres
+    diff $tempres $2
+    if [ $? -ne 0 ]; then
+        echo "ERROR: $1 --interp"
+    fi
+
+    rm $tempres
+}
+
+seq -f "%02.f" 1 18 | while read i; do
+    for opt in -O0 "-O0 -fpeephole" -O1 "-O1 -fno-fold"; do
+        test_anqoubc "test/compile_$i.in" "test/compile_$i.out" "$opt"
+    done
+    test_anqoubc_interp "test/compile_$i.in" "test/compile_$i.out"
+    for opt in -O0 -O1; do
+        test_anqoubc_elf "test/compile_$i.in" "test/compile_$i.out" "$opt"
+        test_anqoubc_run "test/compile_$i.in" "test/compile_$i.out" "$opt"
+        test_anqoubc_stream "test/compile_$i.in" "test/compile_$i.out" "$opt"
+    done
+done
+
+# sources longer than a chunk are compiled the same whatever -j is
+tempsrc=`mktemp --suffix=.in`
+tempexp=`mktemp --suffix=.dat`
+temp1=`mktemp --suffix=.s`
+temp3=`mktemp --suffix=.s`
+seq 1 200000 | awk '{ print "(" $1 " + 0.5) * 3 - " $1 ";" }' > $tempsrc
+./anqoubc --interp $tempsrc > $tempexp
+for opt in -O0 -O1; do
+    ./anqoubc $opt -j1 $tempsrc $temp1
+    ./anqoubc $opt -j3 $tempsrc $temp3
+    cmp -s $temp1 $temp3 || echo "ERROR: $tempsrc $opt -j3"
+    test_anqoubc_run $tempsrc $tempexp "$opt -j3"
+    test_anqoubc_stream $tempsrc $tempexp "$opt -j3"
 done
 
+# names carry their values and types from one chunk to the next
+echo "a = 0; b = 1;" > $tempsrc
+seq 1 100000 | awk '{ print "a = a + " $1 "; b = b * 0.5 + a; a - b;" }' \
+    >> $tempsrc
+./anqoubc --interp $tempsrc > $tempexp
+for opt in -O0 -O1; do
+    ./anqoubc $opt -j1 $tempsrc $temp1
+    ./anqoubc $opt -j3 $tempsrc $temp3
+    cmp -s $temp1 $temp3 || echo "ERROR: $tempsrc $opt -j3 (names)"
+    test_anqoubc_run $tempsrc $tempexp "$opt -j3"
+    test_anqoubc_stream $tempsrc $tempexp "$opt -j3"
+done
+
+# statements of a million operators, as deep as they are long
+echo "x = 3; y = 0.5;" > $tempsrc
+for v in x y; do
+    awk -v v=$v 'BEGIN { printf "%s", v
+        for (i = 1; i < 1000000; i++)
+            printf " %s %s", substr("+-*/", i % 4 + 1, 1), i % 7 ? i % 7 : v
+        print ";" }' >> $tempsrc
+done
+./anqoubc --interp $tempsrc > $tempexp
+for opt in -O0 -O1; do
+    test_anqoubc_run $tempsrc $tempexp "$opt"
+done
+
+# parentheses nest as deep as the parser allows, and deeper fails cleanly
+for depth in 10000 10001; do
+    awk -v d=$depth 'BEGIN { for (i = 0; i < d; i++) printf "1 - ("
+        printf "0.5"
+        for (i = 0; i < d; i++) printf ")"
+        print ";" }' > $tempsrc
+    for opt in --interp "-O0 --run" "-O1 --run"; do
+        ./anqoubc $opt $tempsrc > $temp1 2> /dev/null
+        ret=$?
+        if [ $depth -eq 10000 ]; then
+            [ $ret -eq 0 ] && [ "`cat $temp1`" = "0.500000f" ] ||
+                echo "ERROR: $tempsrc $opt (depth $depth)"
+        else
+            [ $ret -eq 134 ] || echo "ERROR: $tempsrc $opt (depth $depth)"
+        fi
+    done
+done
+seq 1 200000 | awk '{ print "(" $1 " + 0.5) * 3 - " $1 ";" }' > $tempsrc
+
+# --stats writes JSON to stderr and nothing else to stdout
+tempasm=`mktemp --suffix=.s`
+./anqoubc --stats test/compile_03.in $tempasm 2> $temp1 > $temp3
+grep -q '"tokens": 5,' $temp1 && grep -q '"ast_nodes": 4,' $temp1 &&
+    [ ! -s $temp3 ] || echo "ERROR: test/compile_03.in --stats"
+rm $tempasm
+
+# code spliced in from the cache is what compiling it again gives
+tempdir=`mktemp -d`
+./anqoubc -O1 $tempsrc $temp1
+for run in cold warm; do
+    ./anqoubc -O1 -j2 --cache=$tempdir $tempsrc $temp3
+    cmp -s $temp1 $temp3 || echo "ERROR: $tempsrc --cache ($run)"
+done
+echo "1 + 2;" >> $tempsrc
+./anqoubc -O1 $tempsrc $temp1
+./anqoubc -O1 --cache=$tempdir $tempsrc $temp3
+cmp -s $temp1 $temp3 || echo "ERROR: $tempsrc --cache (edited)"
+rm -r $tempdir
+
+# a client gets from the server what compiling on its own gives
+tempsock=`mktemp -u --suffix=.sock`
+templog=`mktemp`
+temperr=`mktemp`
+./anqoubc --server=$tempsock -j4 2> $templog &
+server=$!
+while [ ! -S $tempsock ]; do sleep 0.1; done
+# errors go to fd 3, as the output of the client may be redirected
+exec 3>&1
+test_anqoubc_client() {
+    served=`grep -cF -- "status 0: $*" $templog`
+    ./anqoubc --client=$tempsock "$@"
+    ret=$?
+    [ `grep -cF -- "status 0: $*" $templog` -gt $served ] ||
+        echo "ERROR: $* --client (not served)" >&3
+    return $ret
+}
+for i in 03 05 10 18; do
+    for opt in -O0 "-O1 -fstats" --emit=obj --emit=exe; do
+        ./anqoubc $opt test/compile_$i.in $temp1 2> $tempres
+        test_anqoubc_client $opt test/compile_$i.in $temp3 2> $temperr
+        cmp -s $temp1 $temp3 && cmp -s $tempres $temperr ||
+            echo "ERROR: test/compile_$i.in $opt --client"
+    done
+    test_anqoubc_client --interp test/compile_$i.in > $tempres
+    diff -q $tempres test/compile_$i.out > /dev/null ||
+        echo "ERROR: test/compile_$i.in --interp --client"
+    test_anqoubc_client - $temp3 < test/compile_$i.in
+    ./anqoubc - $temp1 < test/compile_$i.in
+    cmp -s $temp1 $temp3 || echo "ERROR: test/compile_$i.in - --client"
+done
+./anqoubc -O1 $tempsrc $temp1
+clients=
+for n in 1 2 3 4; do
+    test_anqoubc_client -O1 -j2 $tempsrc $temp3.$n &
+    clients="$clients $!"
+done
+wait $clients
+for n in 1 2 3 4; do
+    cmp -s $temp1 $temp3.$n || echo "ERROR: $tempsrc --client ($n of 4)"
+    rm $temp3.$n
+done
+# a source that fails an assert fails the client, and the server goes on
+echo "1 + ;" > $tempsrc
+./anqoubc --client=$tempsock $tempsrc $temp3 2> /dev/null &&
+    echo "ERROR: $tempsrc --client"
+./anqoubc --client=$tempsock - $temp3 < $tempsrc 2> /dev/null &&
+    echo "ERROR: $tempsrc - --client"
+test_anqoubc_client -j3 test/compile_03.in $temp3
+exec 3>&-
+kill $server
+rm $tempsock $templog $temperr
+rm $tempsrc $tempres $tempexp $temp1 $temp3